@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+#include "libserialcomm_interface.h"
+#include "libserialcomm_transport.h"
+
+/* Benchmarks of the communication hot paths, against the local stand-in
+ * devices of the "pty:" and "loopback:" transports. The results are printed on
+ * the standard output as a JSON object. */
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_PATTERN 256 /* Distinct frames in the injected pattern */
+
+static atomic_ulong bench_errors;
+static atomic_ulong bench_queue_full;
+
+void bench_err(SerialCommErr err, SerialComm *sc) {
+  if (err == SerialCommErrQueueFull)
+    atomic_fetch_add(&bench_queue_full, 1);
+  else if (err != SerialCommErrNoErr)
+    atomic_fetch_add(&bench_errors, 1);
+}
+
+uint64_t bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Opens, syncs, starts the listener and waits for the first frame of the simulator,
+ * that supports the framed protocol */
+SerialComm *bench_open(const char *port) {
+  int simulated = (strncmp(port, "pty:", 4) == 0);
+  SerialCommOptions opt;
+  memset(&opt, 0, sizeof(opt));
+  opt.protocol = SerialCommProtocolNegotiate;
+  SerialComm *sc = serialcomm_open_ex(port, &opt, bench_err);
+  if (!sc)
+    return NULL;
+  serialcomm_sync(sc);
+  serialcomm_start_listener(sc);
+  if (!sc->listener_running || (simulated && serialcomm_handshake(sc, SERIALCOMM_CONNECT_TIMEOUT_MS) < 0)) {
+    serialcomm_close(sc);
+    return NULL;
+  }
+  return sc;
+}
+
+int bench_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+double bench_percentile(uint64_t *v, size_t n, double p) {
+  size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+  return (double)v[i] / 1000.0;
+}
+
+/* Heartbeat round trip: request, simulator answer, parse and publication */
+int bench_rtt(size_t samples) {
+  SerialComm *sc = bench_open("pty:");
+  uint64_t *rtt = (uint64_t *)malloc(samples * sizeof(uint64_t));
+  if (!sc || !rtt) {
+    free(rtt);
+    return -1;
+  }
+  size_t n = 0, lost = 0;
+  for (size_t i = 0; i < samples + samples / 10; i++) {
+    unsigned long last = serialcomm_frame_number(sc);
+    uint64_t t0 = bench_now();
+    serialcomm_send(sc, cmdHearthbeat, 0.0);
+    if (serialcomm_wait_frame(sc, last, 1000) == 0) {
+      lost++;
+      continue;
+    }
+    if (i >= samples / 10) // The first tenth warms up the path
+      rtt[n++] = bench_now() - t0;
+  }
+  serialcomm_close(sc);
+  if (n == 0) {
+    free(rtt);
+    return -1;
+  }
+  qsort(rtt, n, sizeof(uint64_t), bench_cmp);
+  printf("  \"heartbeat_rtt_us\": {\"samples\": %zu, \"lost\": %zu, \"p50\": %.1f, \"p90\": %.1f, "
+         "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f},\n",
+         n, lost, bench_percentile(rtt, n, 0.5), bench_percentile(rtt, n, 0.9),
+         bench_percentile(rtt, n, 0.99), bench_percentile(rtt, n, 0.999), (double)rtt[n - 1] / 1000.0);
+  free(rtt);
+  return 0;
+}
+
+typedef struct bench_inject_s {
+  int fd;
+  const char *b;
+  size_t len;
+  size_t repeat;
+} bench_inject_s;
+
+void *bench_inject_thread(void *arg) {
+  bench_inject_s *in = (bench_inject_s *)arg;
+  for (size_t r = 0; r < in->repeat; r++) {
+    size_t done = 0;
+    while (done < in->len) {
+      ssize_t n = write(in->fd, in->b + done, in->len - done);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        return NULL;
+      }
+      done += (size_t)n;
+    }
+  }
+  return NULL;
+}
+
+/* Receive path: valid frames written at full speed on the loopback peer */
+int bench_parser(size_t frames) {
+  SerialComm *sc = bench_open("loopback:");
+  if (!sc)
+    return -1;
+  int peer = serialcomm_transport_peer(sc);
+  char signature;
+  if (read(peer, &signature, 1) != 1) {
+    serialcomm_close(sc);
+    return -1;
+  }
+
+  static output_u pattern[BENCH_PATTERN];
+  memset(pattern, 0, sizeof(pattern));
+  for (size_t i = 0; i < BENCH_PATTERN; i++) {
+    output_s *o = &(pattern[i].s);
+    o->t_meas = 25.0f + 0.01f * (float)i;
+    o->p_meas = 1.0f + 0.001f * (float)i;
+    o->cycle = (float)i;
+    o->state = StateRunning;
+    char check = 0x00;
+    for (size_t k = 0; k < output_size; k++)
+      check ^= pattern[i].b[k];
+    o->check = check;
+  }
+  size_t repeat = (frames + BENCH_PATTERN - 1) / BENCH_PATTERN;
+  frames = repeat * BENCH_PATTERN;
+  bench_inject_s in = { peer, pattern[0].b, sizeof(pattern), repeat };
+
+  double cpu0 = serialcomm_listener_cpu_time(sc);
+  uint64_t t0 = bench_now();
+  pthread_t th;
+  if (pthread_create(&th, NULL, bench_inject_thread, &in)) {
+    serialcomm_close(sc);
+    return -1;
+  }
+  unsigned long got = 0;
+  while (got < frames) {
+    unsigned long f = serialcomm_wait_frame(sc, got, 1000);
+    if (f == 0)
+      break;
+    got = f;
+  }
+  uint64_t dt = bench_now() - t0;
+  double cpu = serialcomm_listener_cpu_time(sc) - cpu0;
+  pthread_join(th, NULL);
+  printf("  \"parser\": {\"frames\": %lu, \"expected\": %zu, \"frames_per_s\": %.0f, \"mbytes_per_s\": %.2f, "
+         "\"listener_cpu_ns_per_frame\": %.1f, \"resyncs\": %lu},\n",
+         got, frames, (double)got * 1e9 / (double)dt,
+         (double)got * output_buffer_size * 1e3 / (double)dt,
+         got ? cpu * 1e9 / (double)got : 0.0, atomic_load(&(sc->rx_resyncs)));
+  serialcomm_close(sc);
+  return 0;
+}
+
+void *bench_drain_thread(void *arg) {
+  bench_inject_s *in = (bench_inject_s *)arg;
+  char b[4096];
+  size_t done = 0;
+  while (done < in->len) {
+    ssize_t n = read(in->fd, b, sizeof(b));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      break;
+    }
+    done += (size_t)n;
+  }
+  in->len = done;
+  return NULL;
+}
+
+/* Send path: commands enqueued back to back, until written on the loopback peer */
+int bench_send(size_t commands) {
+  SerialComm *sc = bench_open("loopback:");
+  if (!sc)
+    return -1;
+  int peer = serialcomm_transport_peer(sc);
+  char signature;
+  if (read(peer, &signature, 1) != 1) {
+    serialcomm_close(sc);
+    return -1;
+  }
+  bench_inject_s out = { peer, NULL, commands * input_buffer_size, 0 };
+  pthread_t th;
+  if (pthread_create(&th, NULL, bench_drain_thread, &out)) {
+    serialcomm_close(sc);
+    return -1;
+  }
+
+  atomic_store(&bench_queue_full, 0);
+  uint64_t enqueue = 0;
+  uint64_t t0 = bench_now();
+  for (size_t i = 0; i < commands; i++) {
+    unsigned long full = atomic_load(&bench_queue_full);
+    uint64_t c0 = bench_now();
+    serialcomm_send(sc, cmdSetTemperature, (float)i);
+    enqueue += bench_now() - c0;
+    if (atomic_load(&bench_queue_full) != full) { // Queue full: retries the same command
+      sched_yield();
+      i--;
+    }
+  }
+  pthread_join(th, NULL);
+  uint64_t dt = bench_now() - t0;
+  printf("  \"send\": {\"commands\": %zu, \"written\": %zu, \"commands_per_s\": %.0f, "
+         "\"enqueue_ns\": %.1f, \"queue_full\": %lu},\n",
+         commands, out.len / input_buffer_size, (double)commands * 1e9 / (double)dt,
+         (double)enqueue / (double)(commands + atomic_load(&bench_queue_full)),
+         atomic_load(&bench_queue_full));
+  serialcomm_close(sc);
+  return 0;
+}
+
+typedef struct bench_reader_s {
+  void *sc;
+  atomic_int *stop;
+  unsigned long calls;
+} bench_reader_s;
+
+void *bench_reader_thread(void *arg) {
+  bench_reader_s *r = (bench_reader_s *)arg;
+  output_s out;
+  unsigned long calls = 0;
+  while (!atomic_load_explicit(r->stop, memory_order_relaxed)) {
+    serialcomm_get_snapshot(r->sc, &out);
+    calls++;
+  }
+  r->calls = calls;
+  return NULL;
+}
+
+/* Getters: snapshot readers against a 1ms telemetry stream */
+int bench_getters(unsigned int max_threads, double seconds) {
+  SerialComm *sc = bench_open("pty:");
+  if (!sc)
+    return -1;
+  serialcomm_stream(sc, 1);
+  serialcomm_wait_frame(sc, 0, 1000);
+
+  printf("  \"getters\": [");
+  for (unsigned int t = 1; t <= max_threads; t *= 2) {
+    static bench_reader_s readers[BENCH_MAX_THREADS];
+    pthread_t th[BENCH_MAX_THREADS];
+    atomic_int stop;
+    atomic_init(&stop, 0);
+    unsigned long f0 = serialcomm_frame_number(sc);
+    double cpu0 = serialcomm_listener_cpu_time(sc);
+    uint64_t t0 = bench_now();
+    unsigned int started = 0;
+    for (; started < t; started++) {
+      readers[started].sc = sc;
+      readers[started].stop = &stop;
+      readers[started].calls = 0;
+      if (pthread_create(&th[started], NULL, bench_reader_thread, &readers[started]))
+        break;
+    }
+    usleep((useconds_t)(seconds * 1e6));
+    atomic_store(&stop, 1);
+    unsigned long calls = 0;
+    for (unsigned int i = 0; i < started; i++) {
+      pthread_join(th[i], NULL);
+      calls += readers[i].calls;
+    }
+    uint64_t dt = bench_now() - t0;
+    unsigned long frames = serialcomm_frame_number(sc) - f0;
+    double cpu = serialcomm_listener_cpu_time(sc) - cpu0;
+    printf("%s\n    {\"threads\": %u, \"calls_per_s\": %.0f, \"frames_per_s\": %.0f, \"listener_cpu_pct\": %.2f}",
+           (t == 1 ? "" : ","), started, (double)calls * 1e9 / (double)dt,
+           (double)frames * 1e9 / (double)dt, cpu * 1e11 / (double)dt);
+  }
+  printf("\n  ],\n");
+
+  serialcomm_stream(sc, 0);
+  serialcomm_close(sc);
+  return 0;
+}
+
+/* Idle listener: no traffic, it must not consume CPU */
+int bench_idle(double seconds) {
+  SerialComm *sc = bench_open("pty:");
+  if (!sc)
+    return -1;
+  double cpu0 = serialcomm_listener_cpu_time(sc);
+  usleep((useconds_t)(seconds * 1e6));
+  double cpu = serialcomm_listener_cpu_time(sc) - cpu0;
+  printf("  \"idle_listener_cpu_pct\": %.4f,\n", cpu * 100.0 / seconds);
+  serialcomm_close(sc);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t samples = 10000, frames = 1000000, commands = 1000000;
+  unsigned int threads = 8;
+  double seconds = 1.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:f:c:t:s:")) != -1) {
+    switch (opt) {
+    case 'r': samples = strtoul(optarg, NULL, 10); break;
+    case 'f': frames = strtoul(optarg, NULL, 10); break;
+    case 'c': commands = strtoul(optarg, NULL, 10); break;
+    case 't': threads = (unsigned int)strtoul(optarg, NULL, 10); break;
+    case 's': seconds = strtod(optarg, NULL); break;
+    default:
+      fprintf(stderr, "Usage: %s [-r rtt samples] [-f parser frames] [-c commands] "
+                      "[-t max reader threads] [-s seconds per run]\n", argv[0]);
+      return -1;
+    }
+  }
+  if (samples < 10 || frames == 0 || commands == 0 || seconds <= 0.0)
+    return -1;
+  if (threads < 1 || threads > BENCH_MAX_THREADS)
+    threads = BENCH_MAX_THREADS;
+
+  printf("{\n");
+  printf("  \"config\": {\"ring_size\": %d, \"tx_queue_size\": %d, \"history_size\": %d, \"cpus\": %ld},\n",
+         SERIALCOMM_RING_SIZE, SERIALCOMM_TX_QUEUE_SIZE, SERIALCOMM_HISTORY_SIZE, sysconf(_SC_NPROCESSORS_ONLN));
+  int ret = 0;
+  ret |= bench_rtt(samples);
+  ret |= bench_parser(frames);
+  ret |= bench_send(commands);
+  ret |= bench_getters(threads, seconds);
+  ret |= bench_idle(seconds);
+  printf("  \"errors\": %lu\n}\n", atomic_load(&bench_errors));
+  return ret ? -1 : 0;
+}
@@ -54,7 +54,7 @@ begin
   while (1)
     system("clear")
     
-    sc.update
+    sc.update_wait
     puts " STATUS   : #{sc.state}"
     puts " ERROR    : #{sc.error_string}"
     puts " CYCLES   : #{sc.cycle.to_i} of #{sc.max_cycle.to_i} (#{'% 3.1%' % (sc.cycle/sc.max_cycle * 100.0) }%)"
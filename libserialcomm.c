@@ -27,19 +27,70 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-#include <wiringSerial.h>
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/uio.h>
 #include "libserialcomm.h"
+#include "libserialcomm_archive.h"
+#include "libserialcomm_bus.h"
+#include "libserialcomm_crc.h"
+#include "libserialcomm_cycle.h"
+#include "libserialcomm_filter.h"
+#include "libserialcomm_recorder.h"
+#include "libserialcomm_replay.h"
+#include "libserialcomm_transport.h"
 
 
-/** \brief Evaluates the checksum */
-char serialcomm_lcr_check(char * b, size_t size) {
+extern char serialcomm_lcr_check(char * b, size_t size) {
   char sum = 0x00;
   for (size_t i = 0; i < size; i++)
     sum ^= b[i];
   return sum;
 }
 
+/** \brief Encodes a command in b, framed or in the legacy format
+ * \return the length of the encoded command
+ */
+static size_t serialcomm_encode_command(char * b, CommandCode cmd, float value, int framed) {
+  input_u in;
+  in.s.command = cmd;
+  in.s.value = value;
+  if (!framed) {
+    in.s.check = serialcomm_lcr_check(in.b, input_size);
+    memcpy(b, in.b, input_buffer_size);
+    return input_buffer_size;
+  }
+  memcpy(b + frame_header_size, in.b, input_size);
+  return serialcomm_frame_seal(b, FrameCommand, input_size);
+} // serialcomm_encode_command
+
+/** \brief Encodes a sequenced command (FrameCommandSeq) in b
+ * \return the length of the encoded command
+ */
+static size_t serialcomm_encode_sequenced(char * b, unsigned char epoch, const SerialCommAck * a) {
+  sequenced_s p = { epoch, a->seq, a->command, a->value };
+  memcpy(b + frame_header_size, &p, sizeof(sequenced_s));
+  return serialcomm_frame_seal(b, FrameCommandSeq, sizeof(sequenced_s));
+} // serialcomm_encode_sequenced
+
 extern SerialComm * serialcomm_open(const char * port, serialcomm_error_clbk err) {
+  return serialcomm_open_ex(port, NULL, err);
+} // serialcomm_open
+
+extern SerialComm * serialcomm_open_ex(const char * port, const SerialCommOptions * opt, serialcomm_error_clbk err) {
+  if (opt && (opt->vmin || opt->vtime)) {
+    if (err)
+      err(SerialCommErrCannotSetAttr, NULL);
+    return NULL;
+  }
+
   // Phase 1: Initializes the structure
   SerialComm * sc = (SerialComm*)malloc(sizeof(SerialComm));
   if (!sc) {
@@ -47,19 +98,123 @@ extern SerialComm * serialcomm_open(const char * port, serialcomm_error_clbk err
       err(SerialCommErrAllocErr, NULL);
     return NULL;
   }
+  if (opt)
+    sc->options = *opt;
+  else
+    memset(&(sc->options), 0, sizeof(SerialCommOptions));
+  if (sc->options.baud == 0)
+    sc->options.baud = SERIALCOMM_BAUD;
+  serialcomm_crc_init();
+
+  // The receive ring must hold at least two frames of the longest format
+  size_t ring = sc->options.ring_size ? sc->options.ring_size : SERIALCOMM_RING_SIZE;
+  size_t size = 64;
+  while (size < ring || size < 2 * frame_max_size)
+    size <<= 1;
+  sc->options.ring_size = size;
+  sc->rx.b = (char*)malloc(size);
+  sc->rx.mask = size - 1;
+  if (!sc->rx.b) {
+    free(sc);
+    if (err)
+      err(SerialCommErrAllocErr, NULL);
+    return NULL;
+  }
 
-  memset(sc->input.b, 0, input_buffer_size);
   memset(sc->output.b, 0, output_buffer_size);
+  atomic_init(&(sc->tx.head), 0);
+  atomic_init(&(sc->tx.tail), 0);
+  sc->tx.sent = 0;
+  sc->tx.stall_ns = 0;
+  sc->rx.head = 0;
+  sc->rx.tail = 0;
+  sc->rx_synced = 0;
+  atomic_init(&(sc->rx_resyncs), 0);
+  atomic_init(&(sc->rx_discarded), 0);
+  // The framed protocol is requested only on demand: a legacy firmware has no
+  // handler for the commands after cmdLoadStorageCycle
+  if (sc->options.protocol == SerialCommProtocolUnknown)
+    sc->options.protocol = SerialCommProtocolLegacy;
+  atomic_init(&(sc->protocol), (sc->options.protocol == SerialCommProtocolNegotiate) ?
+              SerialCommProtocolUnknown : sc->options.protocol);
+  sc->rx_delta_ref = 0;
+  sc->rx_delta_seq = 0;
+  atomic_init(&(sc->rx_delta_dropped), 0);
+  atomic_init(&(sc->rx_bytes), 0);
+  atomic_init(&(sc->rx_bad), 0);
+  memset(&(sc->rx_heartbeat), 0, sizeof(SerialCommHistogram));
+  memset(&(sc->rx_ack), 0, sizeof(SerialCommHistogram));
+  atomic_init(&(sc->stats_seq), 0);
+  atomic_init(&(sc->heartbeat_ns), 0);
+  atomic_init(&(sc->tx_bytes), 0);
+  atomic_init(&(sc->tx_commands), 0);
+  atomic_init(&(sc->tx_dropped), 0);
+  atomic_init(&(sc->rx_time_ns), 0);
+  atomic_init(&(sc->rx_first_ns), 0);
+  sc->transport = NULL;
+  sc->transport_data = NULL;
+  atomic_init(&(sc->stream_period_ms), 0);
+  sc->stream_last_ns = 0;
+  sc->stream_credit = 0;
+  atomic_init(&(sc->stream_missed), 0);
+  atomic_init(&(sc->stream_duplicated), 0);
   sc->state = SerialStateClose;
   sc->listener_exit = 0;
+  sc->listener_running = 0;
+  sc->listener_cpu = 0.0;
+  sc->writer_running = 0;
+  atomic_init(&(sc->writer_idle), 0);
+  sc->serial = -1;
+  sc->wakeup = -1;
+  sc->writer_wakeup = -1;
+  memset(sc->acks, 0, sizeof(sc->acks));
+  // A random epoch: a firmware that missed the signature must not take the
+  // commands of this connection for retransmissions of a previous one
+  if (getrandom(&(sc->ack_epoch), sizeof(sc->ack_epoch), GRND_NONBLOCK) != sizeof(sc->ack_epoch))
+    sc->ack_epoch = (unsigned char)((unsigned long)time(NULL) ^ (unsigned long)getpid());
+  sc->ack_base = 0;
+  sc->ack_next = 0;
+  atomic_init(&(sc->ack_inflight), 0);
+  atomic_init(&(sc->ack_retransmits), 0);
+  atomic_init(&(sc->ack_failures), 0);
 
   // Preparing memory lock systems
   pthread_mutex_init(&(sc->input_lock), NULL);
-  pthread_mutex_init(&(sc->output_lock), NULL);
+  atomic_init(&(sc->output_seq), 0);
+  atomic_init(&(sc->frame_waiters), 0);
+  sc->recorder = NULL;
+  pthread_mutex_init(&(sc->recorder_lock), NULL);
+  sc->archive = NULL;
+  pthread_mutex_init(&(sc->archive_lock), NULL);
+  sc->bus = NULL;
+  pthread_mutex_init(&(sc->bus_lock), NULL);
+  atomic_init(&(sc->filter), NULL);
+  atomic_init(&(sc->cycles), NULL);
+  pthread_mutex_init(&(sc->frame_lock), NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&(sc->frame_cond), &cond_attr);
+  pthread_mutex_init(&(sc->ack_lock), NULL);
+  pthread_cond_init(&(sc->ack_cond), &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
 
   sc->port = port;
   sc->err_clbk = err;
-  sc->serial = serialOpen(sc->port, 115200);
+
+  // Events used to wake up the listener when the port is closed, and the idle writer
+  sc->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  sc->writer_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (sc->wakeup < 0 || sc->writer_wakeup < 0) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotWakeup, sc);
+    serialcomm_close(sc);
+    return NULL;
+  }
+
+  const char * path;
+  sc->transport = serialcomm_transport_find(sc->port, &path);
+  sc->serial = sc->transport->open(sc, path);
 
   if (sc->serial < 0) {
     if (sc->err_clbk)
@@ -69,7 +224,20 @@ extern SerialComm * serialcomm_open(const char * port, serialcomm_error_clbk err
   }
   sc->state = SerialStateOpen;
   return sc;
-} // serialcomm_opne
+} // serialcomm_open_ex
+
+/** \brief Writes the signature, followed by the request of the framed protocol
+ * \return 0 on success
+ */
+static int serialcomm_write_signature(SerialComm * sc) {
+  char signature = SIGNATURE_MESSAGE;
+  char request[input_buffer_size];
+  struct iovec iov[2] = { { &signature, 1 }, { request, 0 } };
+  if (sc->options.protocol != SerialCommProtocolLegacy)
+    iov[1].iov_len = serialcomm_encode_command(request, cmdProtocolVersion, (float)FRAME_VERSION, 0);
+  ssize_t n = sc->transport->writev(sc, iov, iov[1].iov_len ? 2 : 1);
+  return (n == (ssize_t)(1 + iov[1].iov_len)) ? 0 : -1;
+} // serialcomm_write_signature
 
 extern void serialcomm_sync(SerialComm * sc) {
   if (!sc) {
@@ -80,12 +248,79 @@ extern void serialcomm_sync(SerialComm * sc) {
       sc->err_clbk(SerialCommErrIsClosed, sc);
     return;
   }
-  serialFlush(sc->serial);
-  serialPutchar(sc->serial, SIGNATURE_MESSAGE);
+  sc->transport->flush(sc);
+  if (serialcomm_write_signature(sc) < 0) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotWrite, sc);
+    return;
+  }
   sc->state = SerialStateSync;
 } // serialcomm_sync
 
 
+/** \brief Current CLOCK_MONOTONIC time in nanoseconds */
+static uint64_t serialcomm_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+} // serialcomm_time_ns
+
+/** \brief CLOCK_MONOTONIC deadline timeout_ms from now (for the condition waits) */
+static void serialcomm_deadline(struct timespec * deadline, int timeout_ms) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  if (timeout_ms >= 0) {
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000L;
+    }
+  }
+} // serialcomm_deadline
+
+/** \brief Adds a latency to a histogram, under the stats seqlock (by the listener, its only writer) */
+static void serialcomm_histogram_add(SerialComm * sc, SerialCommHistogram * h, uint64_t ns) {
+  unsigned long seq = atomic_load_explicit(&(sc->stats_seq), memory_order_relaxed);
+  atomic_store_explicit(&(sc->stats_seq), seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  uint64_t us = ns / 1000ULL;
+  int k = us ? 63 - __builtin_clzll(us) : 0;
+  h->buckets[(k < SERIALCOMM_STATS_BUCKETS) ? k : SERIALCOMM_STATS_BUCKETS - 1]++;
+  h->count++;
+  h->sum_ns += ns;
+  if (ns > h->max_ns)
+    h->max_ns = ns;
+  atomic_store_explicit(&(sc->stats_seq), seq + 2, memory_order_release);
+} // serialcomm_histogram_add
+
+/** \brief Raises an event descriptor */
+static void serialcomm_event_signal(SerialComm * sc, int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN && sc->err_clbk)
+    sc->err_clbk(SerialCommErrCannotWakeup, sc);
+} // serialcomm_event_signal
+
+/** \brief Free slot at the head of the queue, NULL if full (the input lock must be held) */
+static SerialCommSlot * serialcomm_queue_slot(SerialComm * sc) {
+  size_t head = atomic_load_explicit(&(sc->tx.head), memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&(sc->tx.tail), memory_order_acquire);
+  if (head - tail >= SERIALCOMM_TX_QUEUE_SIZE)
+    return NULL;
+  return &(sc->tx.q[head & SERIALCOMM_TX_QUEUE_MASK]);
+} // serialcomm_queue_slot
+
+/** \brief Hands the slot filled at the head of the queue to the writer (the input lock must be held) */
+static void serialcomm_queue_push(SerialComm * sc) {
+  size_t head = atomic_load_explicit(&(sc->tx.head), memory_order_relaxed);
+  atomic_store(&(sc->tx.head), head + 1);
+} // serialcomm_queue_push
+
+/** \brief Wakes up the writer, if idle: only the first command of a burst pays for it */
+static void serialcomm_writer_wake(SerialComm * sc) {
+  if (atomic_exchange(&(sc->writer_idle), 0))
+    serialcomm_event_signal(sc, sc->writer_wakeup);
+} // serialcomm_writer_wake
+
 extern void serialcomm_send(SerialComm * sc, CommandCode cmd, float value) {
   if (!sc)
     return;
@@ -97,37 +332,447 @@ extern void serialcomm_send(SerialComm * sc, CommandCode cmd, float value) {
   }
   
   pthread_mutex_lock(&(sc->input_lock));
-  sc->input.s.command = cmd;
-  sc->input.s.value = value;
-  sc->input.s.check = serialcomm_lcr_check(sc->input.b, input_size);
+  SerialCommSlot * slot = serialcomm_queue_slot(sc);
+  if (!slot) {
+    pthread_mutex_unlock(&(sc->input_lock));
+    atomic_fetch_add_explicit(&(sc->tx_dropped), 1, memory_order_relaxed);
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrQueueFull, sc);
+    return;
+  }
+  // Only the oldest hearthbeat not answered is timed, the next frame answers all of them
+  if (cmd == cmdHearthbeat && !atomic_load_explicit(&(sc->heartbeat_ns), memory_order_relaxed)) {
+    uint_fast64_t none = 0;
+    atomic_compare_exchange_strong(&(sc->heartbeat_ns), &none, serialcomm_time_ns());
+  }
+  int framed = (atomic_load_explicit(&(sc->protocol), memory_order_relaxed) == SerialCommProtocolFramed);
+  slot->len = serialcomm_encode_command(slot->b, cmd, value, framed);
+  serialcomm_queue_push(sc);
   pthread_mutex_unlock(&(sc->input_lock));
-  
+  serialcomm_writer_wake(sc);
+} // serialcomm_send
+
+extern long serialcomm_send_acked(SerialComm * sc, CommandCode cmd, float value) {
+  if (!sc)
+    return -1;
+  if (atomic_load(&(sc->protocol)) != SerialCommProtocolFramed) {
+    serialcomm_send(sc, cmd, value);
+    return -1;
+  }
+
   pthread_mutex_lock(&(sc->input_lock));
-  for (size_t i = 0; i < input_buffer_size; i++) 
-    serialPutchar(sc->serial, sc->input.b[i]);
+  pthread_mutex_lock(&(sc->ack_lock));
+  SerialCommSlot * slot = serialcomm_queue_slot(sc);
+  if (!slot || (uint16_t)(sc->ack_next - sc->ack_base) >= SERIALCOMM_ACK_WINDOW) {
+    pthread_mutex_unlock(&(sc->ack_lock));
+    pthread_mutex_unlock(&(sc->input_lock));
+    atomic_fetch_add_explicit(&(sc->tx_dropped), 1, memory_order_relaxed);
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrQueueFull, sc);
+    return -1;
+  }
+  SerialCommAck * a = &(sc->acks[sc->ack_next & SERIALCOMM_ACK_MASK]);
+  a->seq = sc->ack_next++;
+  a->command = cmd;
+  a->value = value;
+  a->state = SerialCommAckPending;
+  a->retries = 0;
+  a->sent_ns = serialcomm_time_ns();
+  a->retry_ns = a->sent_ns;
+  a->latency_ns = 0;
+  atomic_fetch_add(&(sc->ack_inflight), 1);
+  slot->len = serialcomm_encode_sequenced(slot->b, sc->ack_epoch, a);
+  long seq = a->seq;
+  pthread_mutex_unlock(&(sc->ack_lock));
+  serialcomm_queue_push(sc);
   pthread_mutex_unlock(&(sc->input_lock));
-} // serialcomm_send
+  serialcomm_writer_wake(sc);
+  return seq;
+} // serialcomm_send_acked
+
+extern int serialcomm_wait_ack(SerialComm * sc, unsigned int seq, int timeout_ms, uint64_t * latency_ns) {
+  if (!sc)
+    return -1;
+  struct timespec deadline;
+  serialcomm_deadline(&deadline, timeout_ms);
+
+  int rc = 0;
+  pthread_mutex_lock(&(sc->ack_lock));
+  SerialCommAck * a = &(sc->acks[seq & SERIALCOMM_ACK_MASK]);
+  while (a->seq == seq && a->state == SerialCommAckPending && rc == 0) {
+    if (timeout_ms < 0)
+      rc = pthread_cond_wait(&(sc->ack_cond), &(sc->ack_lock));
+    else
+      rc = pthread_cond_timedwait(&(sc->ack_cond), &(sc->ack_lock), &deadline);
+  }
+  int done = (a->seq == seq && a->state == SerialCommAckDone);
+  if (done && latency_ns)
+    *latency_ns = a->latency_ns;
+  int pending = (a->seq == seq && a->state == SerialCommAckPending);
+  pthread_mutex_unlock(&(sc->ack_lock));
+
+  if (pending && sc->err_clbk)
+    sc->err_clbk(SerialCommErrTimeout, sc);
+  return done ? 0 : -1;
+} // serialcomm_wait_ack
+
+extern int serialcomm_ack_timer(SerialComm * sc) {
+  if (!atomic_load(&(sc->ack_inflight)))
+    return -1;
+
+  uint64_t timeout = (uint64_t)SERIALCOMM_ACK_TIMEOUT_MS * 1000000ULL;
+  uint64_t now = serialcomm_time_ns();
+  int lost = 0, wake = 0, wait_ms = -1;
+  pthread_mutex_lock(&(sc->input_lock));
+  pthread_mutex_lock(&(sc->ack_lock));
+  if (sc->ack_base != sc->ack_next) {
+    SerialCommAck * oldest = &(sc->acks[sc->ack_base & SERIALCOMM_ACK_MASK]);
+    if (now - oldest->retry_ns < timeout) {
+      wait_ms = (int)((oldest->retry_ns + timeout - now + 999999ULL) / 1000000ULL);
+    } else if (oldest->retries >= SERIALCOMM_ACK_RETRIES) {
+      // The device does not answer: all the commands in flight are lost, and the
+      // next ones start a new epoch, that the device accepts from its first command
+      for (uint16_t s = sc->ack_base; s != sc->ack_next; s++)
+        sc->acks[s & SERIALCOMM_ACK_MASK].state = SerialCommAckFailed;
+      lost = (uint16_t)(sc->ack_next - sc->ack_base);
+      atomic_fetch_add_explicit(&(sc->ack_failures), lost, memory_order_relaxed);
+      sc->ack_base = sc->ack_next;
+      sc->ack_epoch++;
+      atomic_store(&(sc->ack_inflight), 0);
+      pthread_cond_broadcast(&(sc->ack_cond));
+    } else {
+      // Go back N: the device executes in order, all the commands in flight are sent again
+      for (uint16_t s = sc->ack_base; s != sc->ack_next; s++) {
+        SerialCommSlot * slot = serialcomm_queue_slot(sc);
+        if (!slot)
+          break;
+        SerialCommAck * a = &(sc->acks[s & SERIALCOMM_ACK_MASK]);
+        slot->len = serialcomm_encode_sequenced(slot->b, sc->ack_epoch, a);
+        serialcomm_queue_push(sc);
+        a->retry_ns = now;
+        a->retries++;
+        atomic_fetch_add_explicit(&(sc->ack_retransmits), 1, memory_order_relaxed);
+        wake = 1;
+      }
+      wait_ms = SERIALCOMM_ACK_TIMEOUT_MS;
+    }
+  }
+  pthread_mutex_unlock(&(sc->ack_lock));
+  pthread_mutex_unlock(&(sc->input_lock));
+
+  if (wake)
+    serialcomm_writer_wake(sc);
+  if (lost && sc->err_clbk)
+    sc->err_clbk(SerialCommErrNoAck, sc);
+  return wait_ms;
+} // serialcomm_ack_timer
+
+/** \brief Confirms the sequenced commands up to an acknowledged number (listener) */
+static void serialcomm_ack_receive(SerialComm * sc, const ack_s * ack) {
+  pthread_mutex_lock(&(sc->ack_lock));
+  uint16_t count = (uint16_t)(ack->seq - sc->ack_base + 1);
+  if (ack->epoch == sc->ack_epoch && count <= (uint16_t)(sc->ack_next - sc->ack_base)) {
+    for (uint16_t i = 0; i < count; i++) {
+      SerialCommAck * a = &(sc->acks[(sc->ack_base + i) & SERIALCOMM_ACK_MASK]);
+      a->state = SerialCommAckDone;
+      a->latency_ns = atomic_load_explicit(&(sc->rx_time_ns), memory_order_relaxed) - a->sent_ns;
+      serialcomm_histogram_add(sc, &(sc->rx_ack), a->latency_ns);
+    }
+    sc->ack_base += count;
+    atomic_fetch_sub(&(sc->ack_inflight), count);
+    pthread_cond_broadcast(&(sc->ack_cond));
+  }
+  pthread_mutex_unlock(&(sc->ack_lock));
+} // serialcomm_ack_receive
+
+
+/** \brief Tells if the remote device speaks the framed protocol, raising SerialCommErrUnsupported if not
+ *
+ * The commands after cmdLoadStorageCycle have no handler in a legacy firmware,
+ * thus they are never sent to it.
+ */
+static int serialcomm_framed(SerialComm * sc) {
+  if (atomic_load(&(sc->protocol)) == SerialCommProtocolFramed)
+    return 1;
+  if (sc->err_clbk)
+    sc->err_clbk(SerialCommErrUnsupported, sc);
+  return 0;
+} // serialcomm_framed
+
+extern void serialcomm_stream(SerialComm * sc, unsigned int period_ms) {
+  if (!sc || !serialcomm_framed(sc))
+    return;
+  atomic_store(&(sc->stream_period_ms), period_ms);
+  serialcomm_send(sc, cmdStreamTelemetry, (float)period_ms);
+} // serialcomm_stream
+
+extern void serialcomm_compact(SerialComm * sc, unsigned int key_interval) {
+  if (!sc || !serialcomm_framed(sc))
+    return;
+  serialcomm_send(sc, cmdCompactTelemetry, (float)key_interval);
+} // serialcomm_compact
+
+
+/** \brief Writes all the buffers described by iov, handling partial writes and a full output buffer */
+static int serialcomm_write_all(SerialComm * sc, struct iovec * iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = sc->transport->writev(sc, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        // The descriptor is non blocking: waits for room in the output buffer
+        struct pollfd fds = { sc->serial, POLLOUT, 0 };
+        if (poll(&fds, 1, SERIALCOMM_TX_STALL_MS) == 0) {
+          errno = ETIMEDOUT;
+          return -1;
+        }
+        continue;
+      }
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+} // serialcomm_write_all
+
+/** \brief Waits up to SERIALCOMM_TX_LINGER_US for the counter to change from value
+ * \return 1 if the counter changed
+ */
+static int serialcomm_linger(atomic_size_t * counter, size_t value) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    sched_yield();
+    if (atomic_load_explicit(counter, memory_order_acquire) != value)
+      return 1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000L < SERIALCOMM_TX_LINGER_US);
+  return 0;
+} // serialcomm_linger
+
+/** \brief Describes the queued commands from tail to head in iov, skipping the bytes already sent
+ * \return the number of buffers
+ */
+static int serialcomm_queue_iov(SerialComm * sc, size_t tail, size_t head, struct iovec * iov, size_t * bytes) {
+  // Commands have different lengths in the two formats: one buffer per command
+  size_t count = head - tail;
+  *bytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    SerialCommSlot * slot = &(sc->tx.q[(tail + i) & SERIALCOMM_TX_QUEUE_MASK]);
+    iov[i].iov_base = slot->b;
+    iov[i].iov_len = slot->len;
+    *bytes += slot->len;
+  }
+  iov[0].iov_base = (char*)iov[0].iov_base + sc->tx.sent;
+  iov[0].iov_len -= sc->tx.sent;
+  *bytes -= sc->tx.sent;
+  return (int)count;
+} // serialcomm_queue_iov
+
+/** \brief Counts the commands from tail to head as dropped, and raises SerialCommErrCannotWrite */
+static void serialcomm_queue_drop(SerialComm * sc, size_t tail, size_t head) {
+  // Not retried (the line is gone, or part of the batch was written): counted as dropped
+  atomic_fetch_add_explicit(&(sc->tx_dropped), head - tail, memory_order_relaxed);
+  sc->tx.sent = 0;
+  sc->tx.stall_ns = 0;
+  atomic_store_explicit(&(sc->tx.tail), head, memory_order_release);
+  if (sc->err_clbk)
+    sc->err_clbk(SerialCommErrCannotWrite, sc);
+} // serialcomm_queue_drop
+
+extern size_t serialcomm_send_drain(SerialComm * sc) {
+  size_t tail = atomic_load_explicit(&(sc->tx.tail), memory_order_relaxed);
+  size_t head = atomic_load(&(sc->tx.head));
+  if (head == tail)
+    return 0;
+
+  struct iovec iov[SERIALCOMM_TX_QUEUE_SIZE];
+  size_t bytes;
+  int count = serialcomm_queue_iov(sc, tail, head, iov, &bytes);
+  if (serialcomm_write_all(sc, iov, count) < 0) {
+    serialcomm_queue_drop(sc, tail, head);
+    return head - tail;
+  }
+  atomic_fetch_add_explicit(&(sc->tx_bytes), bytes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&(sc->tx_commands), head - tail, memory_order_relaxed);
+  sc->tx.sent = 0;
+  sc->tx.stall_ns = 0;
+  atomic_store_explicit(&(sc->tx.tail), head, memory_order_release);
+  return head - tail;
+} // serialcomm_send_drain
+
+extern int serialcomm_send_ready(SerialComm * sc) {
+  size_t tail = atomic_load_explicit(&(sc->tx.tail), memory_order_relaxed);
+  size_t head = atomic_load(&(sc->tx.head));
+  if (head == tail)
+    return 0;
+
+  struct iovec iov[SERIALCOMM_TX_QUEUE_SIZE];
+  size_t bytes;
+  int count = serialcomm_queue_iov(sc, tail, head, iov, &bytes);
+  ssize_t n;
+  do {
+    n = sc->transport->writev(sc, iov, count);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && errno != EAGAIN) {
+    serialcomm_queue_drop(sc, tail, head);
+    return -1;
+  }
+  if (n <= 0) {
+    uint64_t now = serialcomm_time_ns();
+    if (!sc->tx.stall_ns) {
+      sc->tx.stall_ns = now;
+    } else if (now - sc->tx.stall_ns >= (uint64_t)SERIALCOMM_TX_STALL_MS * 1000000ULL) {
+      serialcomm_queue_drop(sc, tail, head);
+      return -1;
+    }
+    return 1;
+  }
+  sc->tx.stall_ns = 0;
+  atomic_fetch_add_explicit(&(sc->tx_bytes), (unsigned long)n, memory_order_relaxed);
+
+  // Completed commands leave the queue, the rest of a partial one is kept in sent
+  size_t done = 0;
+  while (done < (size_t)count && (size_t)n >= iov[done].iov_len) {
+    n -= iov[done].iov_len;
+    done++;
+  }
+  sc->tx.sent = (done == (size_t)count) ? 0 : (done == 0 ? sc->tx.sent : 0) + (size_t)n;
+  atomic_fetch_add_explicit(&(sc->tx_commands), done, memory_order_relaxed);
+  atomic_store_explicit(&(sc->tx.tail), tail + done, memory_order_release);
+  return (done == (size_t)count && atomic_load(&(sc->tx.head)) == head) ? 0 : 1;
+} // serialcomm_send_ready
+
+void * serialcomm_send_thread(void * sc_v) {
+  if (!sc_v)
+    pthread_exit(NULL);
+
+  SerialComm * sc = (SerialComm*)sc_v;
+  struct pollfd fds;
+  fds.fd = sc->writer_wakeup;
+  fds.events = POLLIN;
+
+  while (1) {
+    size_t tail = atomic_load_explicit(&(sc->tx.tail), memory_order_relaxed);
+    if (serialcomm_send_drain(sc))
+      continue;
+
+    if (sc->listener_exit)
+      break;
+
+    // Commands usually come in bursts: waits a little before going to sleep
+    if (serialcomm_linger(&(sc->tx.head), tail))
+      continue;
+
+    // Declares the idle state, then checks again the queue to not lose a wakeup
+    atomic_store(&(sc->writer_idle), 1);
+    if (atomic_load(&(sc->tx.head)) != tail) {
+      atomic_store(&(sc->writer_idle), 0);
+      continue;
+    }
+    if (poll(&fds, 1, serialcomm_ack_timer(sc)) > 0) {
+      uint64_t count;
+      if (read(sc->writer_wakeup, &count, sizeof(count)) < 0 && errno != EAGAIN && sc->err_clbk)
+        sc->err_clbk(SerialCommErrCannotWakeup, sc);
+    }
+    atomic_store(&(sc->writer_idle), 0);
+  }
+
+  pthread_exit(NULL);
+} // serialcomm_send_thread
 
 
 extern void serialcomm_close(SerialComm * sc) {
   if (sc) {
     sc->listener_exit = 1;
-    pthread_join(sc->listener, NULL); // Joining listener thread
+    if (sc->writer_running) {
+      serialcomm_event_signal(sc, sc->writer_wakeup);
+      pthread_join(sc->writer, NULL); // Joining writer thread, after the queue is drained
+      sc->writer_running = 0;
+    }
+    if (sc->listener_running) {
+      serialcomm_event_signal(sc, sc->wakeup);
+      pthread_join(sc->listener, NULL); // Joining listener thread
+      sc->listener_running = 0;
+    }
+    if (sc->wakeup >= 0)
+      close(sc->wakeup);
+    if (sc->writer_wakeup >= 0)
+      close(sc->writer_wakeup);
 
     pthread_mutex_unlock(&(sc->input_lock));
     pthread_mutex_destroy(&(sc->input_lock));
 
-    pthread_mutex_unlock(&(sc->output_lock));
-    pthread_mutex_destroy(&(sc->output_lock));
+    pthread_cond_destroy(&(sc->frame_cond));
+    pthread_mutex_destroy(&(sc->frame_lock));
+    pthread_cond_destroy(&(sc->ack_cond));
+    pthread_mutex_destroy(&(sc->ack_lock));
+
+    serialcomm_record_stop(sc);
+    pthread_mutex_destroy(&(sc->recorder_lock));
+    serialcomm_archive_stop(sc);
+    pthread_mutex_destroy(&(sc->archive_lock));
+    serialcomm_bus_stop(sc);
+    pthread_mutex_destroy(&(sc->bus_lock));
+    serialcomm_filter_free(sc);
+    serialcomm_cycles_free(sc);
     
-    if (sc->serial > 0) {
-      serialClose(sc->serial);
+    if (sc->serial >= 0) {
+      sc->transport->close(sc);
     }
+    free(sc->rx.b);
     free(sc);
   }
 } // serialcomm_close
 
 
+/** \brief Creates a thread with the scheduling and the CPU affinity of the options
+ *
+ * When they cannot be applied (SerialCommErrCannotSchedule is raised) the thread is
+ * created with the default attributes.
+ */
+static int serialcomm_thread_create(SerialComm * sc, pthread_t * thread, void * (*start)(void *)) {
+  const SerialCommOptions * opt = &(sc->options);
+  if (opt->rt_priority <= 0 && opt->cpu_mask == 0)
+    return pthread_create(thread, NULL, start, (void*)sc);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (opt->rt_priority > 0) {
+    struct sched_param param;
+    param.sched_priority = opt->rt_priority;
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+  }
+  if (opt->cpu_mask) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (size_t i = 0; i < 8 * sizeof(opt->cpu_mask); i++) {
+      if (opt->cpu_mask & (1UL << i))
+        CPU_SET(i, &cpus);
+    }
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+  }
+  int rc = pthread_create(thread, &attr, start, (void*)sc);
+  pthread_attr_destroy(&attr);
+  if (rc == 0)
+    return 0;
+
+  if (sc->err_clbk)
+    sc->err_clbk(SerialCommErrCannotSchedule, sc);
+  return pthread_create(thread, NULL, start, (void*)sc);
+} // serialcomm_thread_create
+
 extern void serialcomm_start_listener(SerialComm * sc) {
   if (!sc)
     return;
@@ -138,12 +783,536 @@ extern void serialcomm_start_listener(SerialComm * sc) {
     return;
   }
   
-  if (pthread_create(&(sc->listener), NULL, serialcomm_receive_thread, (void*)sc)) {
-    sc->err_clbk(SerialCommErrSendPthread, sc);
+  // Flushed before starting the threads, so no queued command can be discarded
+  sc->transport->flush(sc);
+
+  if (serialcomm_thread_create(sc, &(sc->listener), serialcomm_receive_thread)) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrReceivePthread, sc);
     return;
   }
+  sc->listener_running = 1;
+
+  if (serialcomm_thread_create(sc, &(sc->writer), serialcomm_send_thread)) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrSendPthread, sc);
+    return;
+  }
+  sc->writer_running = 1;
 } // serialcomm_start_listener
 
+
+extern double serialcomm_listener_cpu_time(SerialComm * sc) {
+  if (!sc)
+    return -1.0;
+  if (!sc->listener_running)
+    return sc->listener_cpu;
+
+  clockid_t cid;
+  struct timespec ts;
+  if (pthread_getcpuclockid(sc->listener, &cid) || clock_gettime(cid, &ts))
+    return sc->listener_cpu;
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+} // serialcomm_listener_cpu_time
+
+
+/** \brief Stores the CPU time consumed by the calling (listener) thread */
+static void serialcomm_store_listener_cpu(SerialComm * sc) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    sc->listener_cpu = (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+} // serialcomm_store_listener_cpu
+
+/** \brief Reads all the available bytes in the receive ring
+ *
+ * A single read() is performed in the contiguous free space of the ring. If
+ * more bytes are pending they are collected at the next poll() wakeup.
+ * \return the number of bytes read, or a negative value on a read error
+ */
+static ssize_t serialcomm_ring_read(SerialComm * sc) {
+  SerialCommRing * r = &(sc->rx);
+  size_t used = r->head - r->tail;
+  size_t pos = r->head & r->mask;
+  size_t room = r->mask + 1 - used;
+  if (room > r->mask + 1 - pos)
+    room = r->mask + 1 - pos;
+  if (room == 0)
+    return 0;
+
+  ssize_t n = sc->transport->read(sc, r->b + pos, room);
+  if (n < 0)
+    return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+  r->head += (size_t)n;
+  atomic_fetch_add_explicit(&(sc->rx_bytes), (size_t)n, memory_order_relaxed);
+  atomic_store_explicit(&(sc->rx_time_ns), serialcomm_time_ns(), memory_order_relaxed);
+  return n;
+} // serialcomm_ring_read
+
+/** \brief Copies len bytes from the ring, starting at counter from */
+static void serialcomm_ring_copy(const SerialCommRing * r, size_t from, char * dst, size_t len) {
+  size_t pos = from & r->mask;
+  size_t first = r->mask + 1 - pos;
+  if (first >= len) {
+    memcpy(dst, r->b + pos, len);
+  } else {
+    memcpy(dst, r->b + pos, first);
+    memcpy(dst + first, r->b, len - first);
+  }
+} // serialcomm_ring_copy
+
+/** \brief Publishes a decoded frame
+ *
+ * The listener is the only writer: the sequence is made odd, the frame is
+ * copied (in the output and in the history ring), and the sequence is made
+ * even again. Readers retry on odd or
+ * changed sequence numbers.
+ * \return the history record of the frame
+ */
+static const SerialCommRecord * serialcomm_output_publish(SerialComm * sc, const output_u * frame) {
+  unsigned long seq = atomic_load_explicit(&(sc->output_seq), memory_order_relaxed);
+  atomic_store_explicit(&(sc->output_seq), seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy((void*)(sc->output.b), (void*)(frame->b), output_buffer_size);
+
+  SerialCommRecord * rec = &(sc->history[((seq >> 1) + 1) & SERIALCOMM_HISTORY_MASK]);
+  rec->seq = (seq >> 1) + 1;
+  rec->time_ns = atomic_load_explicit(&(sc->rx_time_ns), memory_order_relaxed);
+  if (rec->seq == 1)
+    atomic_store_explicit(&(sc->rx_first_ns), rec->time_ns, memory_order_relaxed);
+  memcpy((void*)&(rec->frame), (void*)(sc->output.b), output_buffer_size);
+  atomic_store_explicit(&(sc->output_seq), seq + 2, memory_order_release);
+
+  // The condition is signaled only when someone is waiting for it
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&(sc->frame_waiters))) {
+    pthread_mutex_lock(&(sc->frame_lock));
+    pthread_cond_broadcast(&(sc->frame_cond));
+    pthread_mutex_unlock(&(sc->frame_lock));
+  }
+  return rec;
+} // serialcomm_output_publish
+
+extern unsigned long serialcomm_read_output(SerialComm * sc, output_s * out) {
+  unsigned long begin, end;
+  do {
+    begin = atomic_load_explicit(&(sc->output_seq), memory_order_acquire);
+    memcpy((void*)out, (void*)(sc->output.b), output_buffer_size);
+    atomic_thread_fence(memory_order_acquire);
+    end = atomic_load_explicit(&(sc->output_seq), memory_order_relaxed);
+  } while ((begin & 1) || begin != end);
+  return begin >> 1;
+} // serialcomm_read_output
+
+extern SerialCommProtocol serialcomm_protocol(SerialComm * sc) {
+  if (!sc)
+    return SerialCommProtocolUnknown;
+  if (serialcomm_frame_number(sc) == 0)
+    return SerialCommProtocolUnknown;
+  return (SerialCommProtocol)atomic_load(&(sc->protocol));
+} // serialcomm_protocol
+
+extern size_t serialcomm_read_history(SerialComm * sc, unsigned long since, SerialCommRecord * buf, size_t n) {
+  if (!sc || !buf)
+    return 0;
+
+  unsigned long head = serialcomm_frame_number(sc);
+  unsigned long first = since + 1;
+  if (head >= SERIALCOMM_HISTORY_SIZE && first < head - SERIALCOMM_HISTORY_SIZE + 1)
+    first = head - SERIALCOMM_HISTORY_SIZE + 1;
+  if (first > head)
+    return 0;
+  size_t count = head - first + 1;
+  if (count > n)
+    count = n;
+
+  for (size_t i = 0; i < count; i++)
+    memcpy((void*)&(buf[i]), (void*)&(sc->history[(first + i) & SERIALCOMM_HISTORY_MASK]), sizeof(SerialCommRecord));
+  atomic_thread_fence(memory_order_acquire);
+
+  // Records older than valid may have been overwritten during the copy
+  unsigned long last = serialcomm_frame_number(sc);
+  unsigned long valid = (last + 2 > SERIALCOMM_HISTORY_SIZE) ? last + 2 - SERIALCOMM_HISTORY_SIZE : 0;
+  if (first >= valid)
+    return count;
+  size_t skip = valid - first;
+  if (skip >= count)
+    return 0;
+  memmove((void*)buf, (void*)&(buf[skip]), (count - skip) * sizeof(SerialCommRecord));
+  return count - skip;
+} // serialcomm_read_history
+
+extern unsigned long serialcomm_frame_number(SerialComm * sc) {
+  return atomic_load(&(sc->output_seq)) >> 1;
+} // serialcomm_frame_number
+
+extern unsigned long serialcomm_frame_wait(SerialComm * sc, unsigned long after, int timeout_ms) {
+  struct timespec deadline;
+  serialcomm_deadline(&deadline, timeout_ms);
+
+  unsigned long frame;
+  int rc = 0;
+  atomic_fetch_add(&(sc->frame_waiters), 1);
+  pthread_mutex_lock(&(sc->frame_lock));
+  while ((frame = serialcomm_frame_number(sc)) <= after && rc == 0) {
+    if (timeout_ms < 0)
+      rc = pthread_cond_wait(&(sc->frame_cond), &(sc->frame_lock));
+    else
+      rc = pthread_cond_timedwait(&(sc->frame_cond), &(sc->frame_lock), &deadline);
+  }
+  pthread_mutex_unlock(&(sc->frame_lock));
+  atomic_fetch_sub(&(sc->frame_waiters), 1);
+  return (frame > after) ? frame : 0;
+} // serialcomm_frame_wait
+
+extern unsigned long serialcomm_wait_frame(SerialComm * sc, unsigned long after, int timeout_ms) {
+  if (!sc)
+    return 0;
+  unsigned long frame = serialcomm_frame_wait(sc, after, timeout_ms);
+  if (frame == 0 && sc->err_clbk)
+    sc->err_clbk(SerialCommErrTimeout, sc);
+  return frame;
+} // serialcomm_wait_frame
+
+extern int serialcomm_handshake(SerialComm * sc, int timeout_ms) {
+  if (!sc)
+    return -1;
+  if (sc->state != SerialStateSync) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrNotSynced, sc);
+    return -1;
+  }
+
+  uint64_t start = serialcomm_time_ns();
+  uint64_t heard = 0;
+  while (serialcomm_frame_number(sc) == 0) {
+    uint64_t elapsed_ms = (serialcomm_time_ns() - start) / 1000000ULL;
+    if (timeout_ms >= 0 && elapsed_ms >= (uint64_t)timeout_ms) {
+      if (sc->err_clbk)
+        sc->err_clbk(SerialCommErrTimeout, sc);
+      return -1;
+    }
+
+    // A silent device is still booting and may have missed the signature. A
+    // device that sent something is synced: the signature would be a command.
+    uint64_t rx_ns = atomic_load_explicit(&(sc->rx_time_ns), memory_order_relaxed);
+    if (elapsed_ms > 0 && rx_ns == heard)
+      serialcomm_write_signature(sc);
+    heard = rx_ns;
+    serialcomm_send(sc, cmdHearthbeat, 0.0);
+
+    int wait_ms = SERIALCOMM_CONNECT_PROBE_MS;
+    if (timeout_ms >= 0 && (uint64_t)wait_ms > (uint64_t)timeout_ms - elapsed_ms)
+      wait_ms = (int)((uint64_t)timeout_ms - elapsed_ms);
+    serialcomm_frame_wait(sc, 0, wait_ms);
+  }
+  return 0;
+} // serialcomm_handshake
+
+/** \brief Tracks the arrival of a streamed frame
+ *
+ * A gap longer than one period and a half counts the frames missed in it. Frames
+ * read in the same batch arrive with no gap: an early frame identical to the
+ * previous one is a duplicate, otherwise it is one of the frames counted as
+ * missed in the last gap that arrived late.
+ */
+static void serialcomm_stream_track(SerialComm * sc, const output_u * frame) {
+  unsigned int period_ms = atomic_load_explicit(&(sc->stream_period_ms), memory_order_relaxed);
+  if (!period_ms) {
+    sc->stream_last_ns = 0;
+    return;
+  }
+
+  uint64_t period = (uint64_t)period_ms * 1000000ULL;
+  uint64_t rx_ns = atomic_load_explicit(&(sc->rx_time_ns), memory_order_relaxed);
+  if (sc->stream_last_ns) {
+    uint64_t gap = rx_ns - sc->stream_last_ns;
+    if (gap < period / 2) {
+      if (memcmp(frame->b, sc->output.b, output_buffer_size) == 0) {
+        atomic_fetch_add_explicit(&(sc->stream_duplicated), 1, memory_order_relaxed);
+      } else if (sc->stream_credit) {
+        sc->stream_credit--;
+        atomic_fetch_sub_explicit(&(sc->stream_missed), 1, memory_order_relaxed);
+      }
+    } else if (gap > period + period / 2) {
+      unsigned long lost = (unsigned long)((gap + period / 2) / period - 1);
+      atomic_fetch_add_explicit(&(sc->stream_missed), lost, memory_order_relaxed);
+      sc->stream_credit = lost;
+    } else {
+      sc->stream_credit = 0;
+    }
+  }
+  sc->stream_last_ns = rx_ns;
+} // serialcomm_stream_track
+
+/** \brief Checks that the content of a frame is plausible
+ *
+ * The XOR checksum alone matches on 1 over 256 misaligned windows, thus
+ * while searching for the alignment the candidate frame must also
+ * contain known flags and finite values.
+ */
+static int serialcomm_frame_plausible(const output_u * f) {
+  float v[12];
+  memcpy(v, f->b, sizeof(v));
+  for (size_t i = 0; i < 12; i++) {
+    if (!isfinite(v[i]))
+      return 0;
+  }
+  if (f->s.config & ~(CtrlEnChiller | CtrlEnResistance | CtrlEnPActuator))
+    return 0;
+  if ((unsigned char)f->s.error >= ErrMessageCount)
+    return 0;
+  switch (f->s.state) {
+    case StateAlarm:
+    case StatePause:
+    case StateRunning:
+    case StateWaiting:
+    case StateSerialSetup:
+      return 1;
+    default:
+      return 0;
+  }
+} // serialcomm_frame_plausible
+
+/** \brief Outcome of a decoder on the bytes at the tail of the receive ring */
+typedef enum SerialCommDecode {
+  SerialCommDecodeIncomplete = -1, /**< More bytes are needed to decide */
+  SerialCommDecodeInvalid = 0,     /**< No valid frame starts at the tail */
+  SerialCommDecodeFrame,           /**< An output frame has been decoded */
+  SerialCommDecodeSkip             /**< A valid frame that carries no output */
+} SerialCommDecode;
+
+/** \brief Decodes a legacy frame (output_s with the XOR check) */
+static SerialCommDecode serialcomm_decode_legacy(SerialComm * sc, output_u * out) {
+  SerialCommRing * r = &(sc->rx);
+  if (r->head - r->tail < output_buffer_size)
+    return SerialCommDecodeIncomplete;
+  serialcomm_ring_copy(r, r->tail, out->b, output_buffer_size);
+  if (serialcomm_lcr_check(out->b, output_size) != out->s.check) {
+    // While searching the alignment a wrong checksum is just a wrong position
+    if (sc->rx_synced)
+      atomic_fetch_add_explicit(&(sc->rx_bad), 1, memory_order_relaxed);
+    return SerialCommDecodeInvalid;
+  }
+  if (!sc->rx_synced && !serialcomm_frame_plausible(out))
+    return SerialCommDecodeInvalid;
+  return SerialCommDecodeFrame;
+} // serialcomm_decode_legacy
+
+/** \brief Copies n bytes of a compact payload from *pos, if available */
+static int serialcomm_delta_take(const unsigned char * p, size_t len, size_t * pos, void * dst, size_t n) {
+  if (*pos + n > len)
+    return 0;
+  memcpy(dst, p + *pos, n);
+  *pos += n;
+  return 1;
+} // serialcomm_delta_take
+
+/** \brief Rebuilds the output from a compact frame, applying it on the last frame received
+ *
+ * Without a reference (no full frame yet, or a delta lost in between) the frame
+ * cannot be applied: it is dropped, and the deltas are ignored until the next
+ * full frame.
+ */
+static SerialCommDecode serialcomm_decode_delta(SerialComm * sc, const unsigned char * p, size_t len, output_u * out) {
+  if (len < delta_header_size || !sc->rx_delta_ref || p[0] != (unsigned char)(sc->rx_delta_seq + 1)) {
+    sc->rx_delta_ref = 0;
+    atomic_fetch_add_explicit(&(sc->rx_delta_dropped), 1, memory_order_relaxed);
+    return SerialCommDecodeSkip;
+  }
+
+  unsigned int mask = (unsigned int)p[1] | ((unsigned int)p[2] << 8);
+  memcpy(out->b, sc->output.b, output_buffer_size);
+  size_t pos = delta_header_size;
+  int ok = !(mask >> DeltaFieldCount);
+  for (int i = 0; i < DeltaFieldCount && ok; i++) {
+    if (!(mask & (1u << i)))
+      continue;
+    if (i >= DeltaConfig) {
+      ok = serialcomm_delta_take(p, len, &pos, out->b + DeltaConfig * sizeof(float) + (i - DeltaConfig), 1);
+      continue;
+    }
+    int16_t q = DELTA_ESCAPE;
+    float v = 0.0f;
+    if (DELTA_SCALED_FIELDS & (1u << i))
+      ok = serialcomm_delta_take(p, len, &pos, &q, sizeof(q));
+    if (ok && q != DELTA_ESCAPE)
+      v = (float)q / DELTA_SCALE;
+    else if (ok)
+      ok = serialcomm_delta_take(p, len, &pos, &v, sizeof(v));
+    memcpy(out->b + i * sizeof(float), &v, sizeof(v));
+  }
+  if (!ok || pos != len) {
+    sc->rx_delta_ref = 0;
+    atomic_fetch_add_explicit(&(sc->rx_delta_dropped), 1, memory_order_relaxed);
+    return SerialCommDecodeSkip;
+  }
+  sc->rx_delta_seq = p[0];
+  out->s.check = serialcomm_lcr_check(out->b, output_size);
+  return SerialCommDecodeFrame;
+} // serialcomm_decode_delta
+
+/** \brief Decodes a frame of the framed protocol
+ *
+ * The output payload is converted to the legacy layout (with its XOR check), thus
+ * the history, the recorder and the replay do not depend on the protocol.
+ * \param len the length of the frame, when valid
+ */
+static SerialCommDecode serialcomm_decode_framed(SerialComm * sc, output_u * out, size_t * len) {
+  SerialCommRing * r = &(sc->rx);
+  size_t avail = r->head - r->tail;
+  if ((unsigned char)r->b[r->tail & r->mask] != FRAME_START)
+    return SerialCommDecodeInvalid;
+  if (avail < frame_header_size)
+    return SerialCommDecodeIncomplete;
+
+  unsigned char f[frame_max_size];
+  frame_header_s h;
+  serialcomm_ring_copy(r, r->tail, (char*)f, frame_header_size);
+  memcpy(&h, f, frame_header_size);
+  if (h.version != FRAME_VERSION || (h.type == FrameOutput && h.length != output_size))
+    return SerialCommDecodeInvalid;
+  *len = frame_header_size + h.length + frame_crc_size;
+  if (avail < *len)
+    return SerialCommDecodeIncomplete;
+
+  serialcomm_ring_copy(r, r->tail + frame_header_size, (char*)f + frame_header_size, *len - frame_header_size);
+  uint16_t crc = serialcomm_crc16(FRAME_CRC_INIT, f, *len - frame_crc_size);
+  if (f[*len - 2] != (crc & 0xFF) || f[*len - 1] != (crc >> 8)) {
+    atomic_fetch_add_explicit(&(sc->rx_bad), 1, memory_order_relaxed);
+    return SerialCommDecodeInvalid;
+  }
+  if (h.type == FrameDelta)
+    return serialcomm_decode_delta(sc, f + frame_header_size, h.length, out);
+  if (h.type == FrameAck && h.length == sizeof(ack_s)) {
+    ack_s ack;
+    memcpy(&ack, f + frame_header_size, sizeof(ack_s));
+    serialcomm_ack_receive(sc, &ack);
+  }
+  if (h.type != FrameOutput)
+    return SerialCommDecodeSkip;
+  memcpy(out->b, f + frame_header_size, output_size);
+  out->s.check = serialcomm_lcr_check(out->b, output_size);
+  sc->rx_delta_ref = 1;
+  sc->rx_delta_seq = 0;
+  return SerialCommDecodeFrame;
+} // serialcomm_decode_framed
+
+/** \brief Bytes to skip to reach the next FRAME_START after the tail (all the ring if none) */
+static size_t serialcomm_ring_next_start(const SerialCommRing * r) {
+  size_t avail = r->head - r->tail;
+  size_t skip = 1;
+  while (skip < avail) {
+    size_t pos = (r->tail + skip) & r->mask;
+    size_t run = r->mask + 1 - pos;
+    if (run > avail - skip)
+      run = avail - skip;
+    const char * p = (const char*)memchr(r->b + pos, FRAME_START, run);
+    if (p)
+      return skip + (size_t)(p - (r->b + pos));
+    skip += run;
+  }
+  return avail;
+} // serialcomm_ring_next_start
+
+/** \brief Parses all the complete frames in the receive ring
+ *
+ * Each frame is decoded once, and each valid frame is copied in the output union
+ * through the output seqlock. Until the protocol is known both the formats are
+ * tried at each position: the first valid frame tells the protocol of the device.
+ * A device that answers with the framed protocol is never parsed as legacy again.
+ * When no frame is valid the legacy window slides by one byte, while the framed
+ * parser jumps to the next FRAME_START, until the alignment is recovered.
+ */
+static void serialcomm_ring_parse(SerialComm * sc) {
+  SerialCommRing * r = &(sc->rx);
+  int framed = (sc->options.protocol != SerialCommProtocolLegacy);
+  while (r->head != r->tail) {
+    int protocol = atomic_load_explicit(&(sc->protocol), memory_order_relaxed);
+    output_u frame;
+    size_t len = output_buffer_size;
+    SerialCommDecode res = framed ? serialcomm_decode_framed(sc, &frame, &len) : SerialCommDecodeInvalid;
+    if (res >= SerialCommDecodeFrame) {
+      if (protocol != SerialCommProtocolFramed)
+        atomic_store(&(sc->protocol), SerialCommProtocolFramed);
+    } else if (protocol != SerialCommProtocolFramed) {
+      SerialCommDecode legacy = serialcomm_decode_legacy(sc, &frame);
+      if (legacy == SerialCommDecodeFrame) {
+        res = legacy;
+        len = output_buffer_size;
+        if (protocol == SerialCommProtocolUnknown)
+          atomic_store(&(sc->protocol), SerialCommProtocolLegacy);
+      } else if (legacy == SerialCommDecodeIncomplete) {
+        res = legacy;
+      }
+    }
+
+    // A full ring that still holds no complete frame starts with a corrupted header
+    if (res == SerialCommDecodeIncomplete && r->head - r->tail <= r->mask)
+      break;
+    if (res <= SerialCommDecodeInvalid) {
+      if (sc->rx_synced) {
+        sc->rx_synced = 0;
+        atomic_fetch_add_explicit(&(sc->rx_resyncs), 1, memory_order_relaxed);
+        if (sc->err_clbk)
+          sc->err_clbk(SerialCommErrBadData, sc);
+      }
+      size_t skip = (protocol == SerialCommProtocolFramed) ? serialcomm_ring_next_start(r) : 1;
+      r->tail += skip;
+      atomic_fetch_add_explicit(&(sc->rx_discarded), skip, memory_order_relaxed);
+      continue;
+    }
+
+    if (res == SerialCommDecodeFrame) {
+      if (atomic_load_explicit(&(sc->heartbeat_ns), memory_order_relaxed)) {
+        uint64_t sent_ns = atomic_exchange(&(sc->heartbeat_ns), 0);
+        uint64_t rx_ns = atomic_load_explicit(&(sc->rx_time_ns), memory_order_relaxed);
+        if (sent_ns && rx_ns > sent_ns)
+          serialcomm_histogram_add(sc, &(sc->rx_heartbeat), rx_ns - sent_ns);
+      }
+      serialcomm_stream_track(sc, &frame);
+      const SerialCommRecord * rec = serialcomm_output_publish(sc, &frame);
+      serialcomm_record_frame(sc, rec);
+      serialcomm_archive_frame(sc, rec);
+      serialcomm_bus_frame(sc, rec);
+      serialcomm_filter_frame(sc, rec);
+      serialcomm_cycle_frame(sc, rec);
+    }
+    r->tail += len;
+    sc->rx_synced = 1;
+  }
+} // serialcomm_ring_parse
+
+/** \brief Drops a partial frame left in the ring after a silence on the line */
+static void serialcomm_ring_drop(SerialComm * sc) {
+  SerialCommRing * r = &(sc->rx);
+  atomic_fetch_add_explicit(&(sc->rx_discarded), r->head - r->tail, memory_order_relaxed);
+  r->tail = r->head;
+  if (sc->rx_synced) {
+    sc->rx_synced = 0;
+    atomic_fetch_add_explicit(&(sc->rx_resyncs), 1, memory_order_relaxed);
+  }
+} // serialcomm_ring_drop
+
+extern int serialcomm_receive_ready(SerialComm * sc, int readable, int hangup) {
+  // The pending bytes are consumed before handling a hang up
+  ssize_t n = 0;
+  if (readable) {
+    n = serialcomm_ring_read(sc);
+    if (n > 0)
+      serialcomm_ring_parse(sc);
+  }
+  if (n < 0 || (n == 0 && hangup)) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrIsClosed, sc);
+    return -1;
+  }
+  return 0;
+} // serialcomm_receive_ready
+
+extern void serialcomm_receive_gap(SerialComm * sc) {
+  serialcomm_ring_drop(sc);
+} // serialcomm_receive_gap
+
 void * serialcomm_receive_thread(void * sc_v) {
   if (!sc_v)
     pthread_exit(NULL);
@@ -155,32 +1324,77 @@ void * serialcomm_receive_thread(void * sc_v) {
     pthread_exit(NULL);
   }
 
-  serialFlush(sc->serial);
-
-  // Reading operation
-  char buffer[output_buffer_size];
-  size_t pos = 0;
+  // The listener sleeps until data is available or the wakeup event is raised
+  struct pollfd fds[2];
+  fds[0].fd = sc->serial;
+  fds[0].events = POLLIN;
+  fds[1].fd = sc->wakeup;
+  fds[1].events = POLLIN;
 
   while (!sc->listener_exit) {
-    if (serialDataAvail(sc->serial) > 0) {
-      char b = serialGetchar(sc->serial);
-      buffer[pos++] = b;
-
-      if (pos >= output_buffer_size) {
-        char check = serialcomm_lcr_check(buffer, output_size);
-        if (check == buffer[output_size]) {
-          pthread_mutex_lock(&(sc->output_lock));
-          memcpy((void*)(sc->output.b), (void*)buffer, output_buffer_size);
-          pthread_mutex_unlock(&(sc->output_lock));
-        } else {
-          if (sc->err_clbk)
-            sc->err_clbk(SerialCommErrBadData, sc);
-        }
-        pos = 0;
-      }
+    // With a partial frame pending, a silence on the line marks a frame boundary
+    int timeout = (sc->rx.head != sc->rx.tail) ? SERIALCOMM_RX_GAP_MS : -1;
+    int ready = poll(fds, 2, timeout);
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      if (sc->err_clbk)
+        sc->err_clbk(SerialCommErrBadData, sc);
+      break;
+    }
+    if (ready == 0) {
+      serialcomm_receive_gap(sc);
+      continue;
     }
+    if (fds[1].revents)
+      break;
 
+    if (serialcomm_receive_ready(sc, fds[0].revents & POLLIN,
+                                 fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) < 0)
+      break;
   }
-  
+
+  serialcomm_store_listener_cpu(sc);
   pthread_exit(NULL);
 }
+
+
+extern void serialcomm_get_stats(SerialComm * sc, SerialCommStats * stats) {
+  if (!sc || !stats)
+    return;
+  stats->bytes_in = atomic_load_explicit(&(sc->rx_bytes), memory_order_relaxed);
+  stats->bytes_out = atomic_load_explicit(&(sc->tx_bytes), memory_order_relaxed);
+  stats->frames_ok = serialcomm_frame_number(sc);
+  stats->frames_bad = atomic_load_explicit(&(sc->rx_bad), memory_order_relaxed);
+  stats->resyncs = atomic_load_explicit(&(sc->rx_resyncs), memory_order_relaxed);
+  stats->discarded = atomic_load_explicit(&(sc->rx_discarded), memory_order_relaxed);
+  stats->delta_dropped = atomic_load_explicit(&(sc->rx_delta_dropped), memory_order_relaxed);
+  stats->commands_sent = atomic_load_explicit(&(sc->tx_commands), memory_order_relaxed);
+  stats->commands_dropped = atomic_load_explicit(&(sc->tx_dropped), memory_order_relaxed);
+  stats->ack_retransmits = atomic_load_explicit(&(sc->ack_retransmits), memory_order_relaxed);
+  stats->ack_failures = atomic_load_explicit(&(sc->ack_failures), memory_order_relaxed);
+  stats->stream_missed = atomic_load_explicit(&(sc->stream_missed), memory_order_relaxed);
+  stats->stream_duplicated = atomic_load_explicit(&(sc->stream_duplicated), memory_order_relaxed);
+  // The histograms are copied as the output, retrying while the listener updates them
+  unsigned long begin, end;
+  do {
+    begin = atomic_load_explicit(&(sc->stats_seq), memory_order_acquire);
+    memcpy(&(stats->heartbeat), &(sc->rx_heartbeat), sizeof(SerialCommHistogram));
+    memcpy(&(stats->ack), &(sc->rx_ack), sizeof(SerialCommHistogram));
+    atomic_thread_fence(memory_order_acquire);
+    end = atomic_load_explicit(&(sc->stats_seq), memory_order_relaxed);
+  } while ((begin & 1) || begin != end);
+} // serialcomm_get_stats
+
+extern double serialcomm_histogram_quantile(const SerialCommHistogram * h, double q) {
+  if (!h || !h->count)
+    return 0.0;
+  unsigned long rank = (unsigned long)(q * (double)h->count);
+  unsigned long seen = 0;
+  for (int k = 0; k < SERIALCOMM_STATS_BUCKETS - 1; k++) {
+    seen += h->buckets[k];
+    if (seen > rank)
+      return 1e-6 * (double)(2ULL << k);
+  }
+  return 1e-9 * (double)h->max_ns;
+} // serialcomm_histogram_quantile
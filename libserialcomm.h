@@ -31,11 +31,12 @@
 #define LIBSERIALCOMM_H_
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <wiringSerial.h>
 #include "messages.h"
 
 
@@ -49,6 +50,114 @@ typedef union input_u {
   char b[input_buffer_size];
 } input_u;
 
+#define SERIALCOMM_BAUD 115200 /**< Default line speed of the serial devices */
+#define SERIALCOMM_RING_SIZE 4096 /**< Default size of the receive ring buffer (power of two) */
+#define SERIALCOMM_TX_QUEUE_SIZE 64 /**< Length of the outgoing commands queue (power of two) */
+#define SERIALCOMM_TX_QUEUE_MASK (SERIALCOMM_TX_QUEUE_SIZE - 1)
+#define SERIALCOMM_TX_LINGER_US 200 /**< Time (us) the writer waits for more commands before sleeping */
+#define SERIALCOMM_TX_STALL_MS 1000 /**< Time (ms) the writer waits for room in a full output buffer */
+#define SERIALCOMM_HISTORY_SIZE 4096 /**< Frames kept in the history ring (power of two) */
+#define SERIALCOMM_HISTORY_MASK (SERIALCOMM_HISTORY_SIZE - 1)
+#define SERIALCOMM_RX_GAP_MS 50 /**< Silence (ms) after which a partial frame is dropped */
+#define SERIALCOMM_CONNECT_PROBE_MS 100 /**< Interval (ms) between the handshake probes */
+#define SERIALCOMM_CONNECT_TIMEOUT_MS 5000 /**< Default handshake timeout (ms) */
+#define SERIALCOMM_ACK_WINDOW 64 /**< Acknowledged commands in flight (power of two) */
+#define SERIALCOMM_ACK_MASK (SERIALCOMM_ACK_WINDOW - 1)
+#define SERIALCOMM_ACK_TIMEOUT_MS 20 /**< Time (ms) without acknowledgement before a retransmission */
+#define SERIALCOMM_ACK_RETRIES 5 /**< Retransmissions before a command is declared lost */
+#define SERIALCOMM_STATS_BUCKETS 24 /**< Buckets of the latency histograms (the last one reaches about 8 s) */
+
+/** \brief Receive ring buffer
+ *
+ * The listener reads all the available bytes from the serial in the ring, and
+ * the frames are parsed directly from it. Head and tail are free running
+ * counters, the position in the buffer is obtained masking them.
+ */
+typedef struct SerialCommRing {
+  char * b; /**< Ring storage */
+  size_t mask; /**< Size of the storage minus one (the size is a power of two) */
+  size_t head; /**< Write counter (bytes received) */
+  size_t tail; /**< Read counter (bytes consumed by the parser) */
+} SerialCommRing;
+
+/** \brief An encoded command, in the legacy or in the framed format */
+typedef struct SerialCommSlot {
+  char b[frame_sequenced_size]; /**< Encoded command */
+  size_t len; /**< Bytes used in b */
+} SerialCommSlot;
+
+/** \brief Outgoing commands queue
+ *
+ * Single producer / single consumer ring of encoded commands. The producer
+ * side is serialcomm_send (callers are serialized by the input lock), the
+ * consumer is the writer thread, that sends all the queued commands with a
+ * single writev().
+ */
+typedef struct SerialCommQueue {
+  SerialCommSlot q[SERIALCOMM_TX_QUEUE_SIZE]; /**< Encoded commands */
+  atomic_size_t head; /**< Commands enqueued (written by the producer) */
+  atomic_size_t tail; /**< Commands sent (written by the writer thread) */
+  size_t sent; /**< Bytes of the command at tail already written (serialcomm_send_ready) */
+  uint64_t stall_ns; /**< Since when the output buffer is full, 0 if writable (serialcomm_send_ready) */
+} SerialCommQueue;
+
+typedef enum SerialCommAckState {
+  SerialCommAckUnused = 0,
+  SerialCommAckPending,
+  SerialCommAckDone,
+  SerialCommAckFailed
+} SerialCommAckState;
+
+/** \brief A sequenced command, waiting for (or with) its acknowledgement */
+typedef struct SerialCommAck {
+  uint16_t seq; /**< Sequence number */
+  char command; /**< Command code */
+  float value; /**< Command value */
+  SerialCommAckState state; /**< State of the acknowledgement */
+  unsigned int retries; /**< Retransmissions performed */
+  uint64_t sent_ns; /**< CLOCK_MONOTONIC time of the first transmission */
+  uint64_t retry_ns; /**< CLOCK_MONOTONIC time of the last transmission */
+  uint64_t latency_ns; /**< Time from the first transmission to the acknowledgement */
+} SerialCommAck;
+
+/** \brief Histogram of latencies
+ *
+ * Bucket k counts the latencies from 2^k to 2^(k+1) microseconds: the first one
+ * also counts those under 1 us, the last one all the longer ones.
+ */
+typedef struct SerialCommHistogram {
+  unsigned long count; /**< Latencies measured */
+  uint64_t sum_ns; /**< Sum of the latencies (ns), for the mean */
+  uint64_t max_ns; /**< Longest latency (ns) */
+  unsigned long buckets[SERIALCOMM_STATS_BUCKETS]; /**< Latencies in each power of two of microseconds */
+} SerialCommHistogram;
+
+/** \brief Counters of a connection, returned by serialcomm_get_stats */
+typedef struct SerialCommStats {
+  unsigned long bytes_in; /**< Bytes read from the port */
+  unsigned long bytes_out; /**< Bytes written to the port */
+  unsigned long frames_ok; /**< Output frames received (the compact ones included) */
+  unsigned long frames_bad; /**< Frames with a wrong checksum or CRC */
+  unsigned long resyncs; /**< Times the parser lost the frame alignment */
+  unsigned long discarded; /**< Bytes discarded while searching the alignment */
+  unsigned long delta_dropped; /**< Compact frames dropped for lack of a reference */
+  unsigned long commands_sent; /**< Commands written to the port (retransmissions included) */
+  unsigned long commands_dropped; /**< Commands dropped because the queue was full or the write failed */
+  unsigned long ack_retransmits; /**< Retransmissions of sequenced commands */
+  unsigned long ack_failures; /**< Sequenced commands declared lost */
+  unsigned long stream_missed; /**< Streamed frames missed */
+  unsigned long stream_duplicated; /**< Streamed frames received twice */
+  SerialCommHistogram heartbeat; /**< From a hearthbeat request to the next frame */
+  SerialCommHistogram ack; /**< From the first transmission of a sequenced command to its acknowledgement */
+} SerialCommStats;
+
+/** \brief A received frame, with its number and reception time */
+typedef struct SerialCommRecord {
+  unsigned long seq; /**< Frame number (the first frame received is 1) */
+  uint64_t time_ns; /**< CLOCK_MONOTONIC reception time in nanoseconds */
+  output_s frame; /**< The frame */
+} SerialCommRecord;
+
 typedef enum SerialState {
   SerialStateOpen,
   SerialStateSync,
@@ -64,10 +173,49 @@ typedef enum SerialCommErr {
   SerialCommErrNotSynced,
   SerialCommErrSendPthread,
   SerialCommErrReceivePthread,
-  SerialCommErrBadData
+  SerialCommErrBadData,
+  SerialCommErrCannotWakeup,
+  SerialCommErrQueueFull,
+  SerialCommErrCannotWrite,
+  SerialCommErrTimeout,
+  SerialCommErrCannotRecord,
+  SerialCommErrCannotSchedule,
+  SerialCommErrNoAck,
+  SerialCommErrCannotPublish,
+  SerialCommErrCannotArchive,
+  SerialCommErrUnsupported
 } SerialCommErr;
 
+/** \brief Protocol spoken with the remote device (see messages.h) */
+typedef enum SerialCommProtocol {
+  SerialCommProtocolUnknown = 0, /**< Not known yet (as an option, the default: SerialCommProtocolLegacy) */
+  SerialCommProtocolLegacy,      /**< output_s and input_s frames, with the XOR check */
+  SerialCommProtocolFramed,      /**< Framed protocol (FRAME_VERSION), with the CRC-16 */
+  SerialCommProtocolNegotiate    /**< Option only: requests the framed protocol, and follows the frames received */
+} SerialCommProtocol;
+
 typedef struct SerialComm SerialComm;
+typedef struct SerialCommRecorder SerialCommRecorder;
+typedef struct SerialCommArchive SerialCommArchive;
+typedef struct SerialCommBus SerialCommBus;
+typedef struct SerialCommFilter SerialCommFilter;
+typedef struct SerialCommCycles SerialCommCycles;
+typedef struct SerialCommTransport SerialCommTransport;
+
+/** \brief Options of the connection
+ *
+ * A zero initialized structure gives the default of every field.
+ */
+typedef struct SerialCommOptions {
+  unsigned int baud; /**< Line speed (bps), 0 for SERIALCOMM_BAUD */
+  unsigned char vmin; /**< termios VMIN: must be 0, the listener polls and its reads never wait */
+  unsigned char vtime; /**< termios VTIME: must be 0, as vmin */
+  int low_latency; /**< Requests the low latency mode of the serial driver (best effort) */
+  size_t ring_size; /**< Size of the receive ring (rounded up to a power of two), 0 for SERIALCOMM_RING_SIZE */
+  int rt_priority; /**< SCHED_FIFO priority (1-99) of the listener and writer threads, 0 for normal scheduling */
+  unsigned long cpu_mask; /**< CPUs the listener and writer threads run on (bit i for CPU i), 0 for all */
+  SerialCommProtocol protocol; /**< Protocol of the device, 0 for legacy, SerialCommProtocolNegotiate to detect it */
+} SerialCommOptions;
 
 /** \brief Callback for error handling
  * 
@@ -79,22 +227,77 @@ typedef void (*serialcomm_error_clbk)(SerialCommErr err, SerialComm * sc);
 
 /** \brief SerialComm is the struct which represents the serial connection */
 struct SerialComm {
-  input_u input; /**< Command union for sending commands */
+  SerialCommQueue tx; /**< Queue of the commands waiting to be sent */
   output_u output; /**< Machine state input union */
+  SerialCommRing rx; /**< Receive ring buffer, used only by the listener */
+  char rx_synced; /**< The parser is aligned on the frame boundaries */
+  atomic_ulong rx_resyncs; /**< Number of times the parser lost the frame alignment */
+  atomic_ulong rx_discarded; /**< Number of bytes discarded while searching the alignment */
+  atomic_int protocol; /**< Protocol of the frames received (SerialCommProtocolUnknown until the first one) */
+  char rx_delta_ref; /**< The output is a valid reference for the next compact frame */
+  unsigned char rx_delta_seq; /**< Sequence number of the last compact frame applied */
+  atomic_ulong rx_delta_dropped; /**< Compact frames dropped for lack of a reference (after a lost frame) */
+  atomic_ulong rx_bytes; /**< Bytes read from the serial */
+  atomic_ulong rx_bad; /**< Frames with a wrong checksum or CRC */
+  SerialCommHistogram rx_heartbeat; /**< Latency from a hearthbeat request to the next frame */
+  SerialCommHistogram rx_ack; /**< Latency of the acknowledgements */
+  atomic_ulong stats_seq; /**< Seqlock on the histograms: odd while the listener updates them */
+  atomic_uint_fast64_t heartbeat_ns; /**< Time of the oldest hearthbeat not yet answered, 0 if none */
+  atomic_ulong tx_bytes; /**< Bytes written by the writer */
+  atomic_ulong tx_commands; /**< Commands written by the writer */
+  atomic_ulong tx_dropped; /**< Commands dropped with the queue full or a failed write */
+  atomic_uint_fast64_t rx_time_ns; /**< CLOCK_MONOTONIC time (ns) of the last read from the serial (written by the listener) */
+  atomic_uint_fast64_t rx_first_ns; /**< CLOCK_MONOTONIC time (ns) of the first frame received (written by the listener) */
+  atomic_uint stream_period_ms; /**< Period of the telemetry stream requested, 0 if not streaming */
+  uint64_t stream_last_ns; /**< Arrival time of the last streamed frame */
+  unsigned long stream_credit; /**< Frames counted as missed in the last gap, that may still arrive late */
+  atomic_ulong stream_missed; /**< Streamed frames missed (gaps longer than the period) */
+  atomic_ulong stream_duplicated; /**< Streamed frames received twice */
   SerialState state; /**< State of the serial connection */
-  pthread_mutex_t input_lock;  /**< Memory lock for writing a new command in memory */
-  pthread_mutex_t output_lock; /**< Memory lock for receiving new state from serial */
+  pthread_mutex_t input_lock;  /**< Serializes the callers of serialcomm_send on the queue */
+  atomic_ulong output_seq; /**< Seqlock on output: odd while the listener is writing, frame number times two */
+  SerialCommRecord history[SERIALCOMM_HISTORY_SIZE]; /**< Last frames received, frame n is in n & SERIALCOMM_HISTORY_MASK */
+  SerialCommRecorder * recorder; /**< Binary recorder of the frames, or NULL */
+  pthread_mutex_t recorder_lock; /**< Lock on the recorder, held by the listener while appending */
+  SerialCommArchive * archive; /**< Columnar archive of the frames, or NULL */
+  pthread_mutex_t archive_lock; /**< Lock on the archive, held by the listener while appending */
+  SerialCommBus * bus; /**< Shared memory bus of the frames, or NULL */
+  pthread_mutex_t bus_lock; /**< Lock on the bus, held by the listener while publishing */
+  _Atomic(SerialCommFilter *) filter; /**< Filtering stage of the frames, or NULL */
+  _Atomic(SerialCommCycles *) cycles; /**< Tracker of the pressure cycles, or NULL */
+  pthread_mutex_t frame_lock; /**< Lock for the new frame condition */
+  pthread_cond_t frame_cond; /**< Signaled by the listener on each valid frame, if someone waits */
+  atomic_int frame_waiters; /**< Number of threads waiting on frame_cond */
   pthread_t listener; /**< Incoming messages listener thread */
   char listener_exit; /**< Request for quit listener thread */
+  char listener_running; /**< The listener thread has been started and must be joined */
+  int wakeup; /**< Event descriptor used to wake up the listener on close */
+  double listener_cpu; /**< CPU time (s) consumed by the listener, stored at its exit */
+  pthread_t writer; /**< Outgoing commands writer thread */
+  char writer_running; /**< The writer thread has been started and must be joined */
+  int writer_wakeup; /**< Event descriptor used to wake up the idle writer */
+  SerialCommAck acks[SERIALCOMM_ACK_WINDOW]; /**< Sequenced commands, command n is in n & SERIALCOMM_ACK_MASK */
+  unsigned char ack_epoch; /**< Epoch of the sequence, changed when a command is lost */
+  uint16_t ack_base; /**< Oldest sequenced command waiting for its acknowledgement */
+  uint16_t ack_next; /**< Sequence number of the next command */
+  atomic_uint ack_inflight; /**< Commands waiting for their acknowledgement */
+  atomic_ulong ack_retransmits; /**< Retransmissions performed */
+  atomic_ulong ack_failures; /**< Commands declared lost */
+  pthread_mutex_t ack_lock; /**< Lock on the sequenced commands */
+  pthread_cond_t ack_cond; /**< Signaled on each acknowledgement or loss */
+  atomic_int writer_idle; /**< The writer is sleeping and must be woken up on enqueue */
   int serial; /**< Serial port descriptor */
   const char * port; /**< Port name */
+  const SerialCommTransport * transport; /**< Transport used to access the port */
+  void * transport_data; /**< Private state of the transport */
+  SerialCommOptions options; /**< Options given at open */
   serialcomm_error_clbk err_clbk; /**< Error callback for serial */
 };
 
 /** \brief Open the serial port
  * 
  * This serial port is configured to work with Arduino: 8N1 at 115200bps.
- * The configuration is fixed, and the user should always call first the 
+ * The configuration is fixed (see serialcomm_open_ex), and the user should always call first the 
  * open and at the end the close method in order to meke everything work.
  * Operation performed:
  *  0. Allocates a SerialComm structure (it may fails, returning null)
@@ -104,38 +307,232 @@ struct SerialComm {
  *  4. Syncronizes the serial ends by flushing and sending the signature byte
  * The failing should be reported through standard error number, but it is also 
  * stated in the sc->state variable.
+ * The port name selects the transport with its prefix ("termios:", "pty:",
+ * "replay:", ...), see libserialcomm_transport.h.
  * \param port portname for connection
  * \param err pointer to error callback
  * \return a pointer to the SerialComm structure or NULL on error
  */
 extern SerialComm * serialcomm_open(const char * port, serialcomm_error_clbk err);
+/** \brief Open the serial port with options
+ *
+ * As serialcomm_open, with the line speed, the receive ring size and the scheduling
+ * of the listener and writer threads given in opt (NULL for the defaults). The
+ * descriptor stays non blocking with VMIN and VTIME at 0, as the listener needs:
+ * other values are rejected (SerialCommErrCannotSetAttr is raised). If the real time priority or the CPU affinity cannot be applied
+ * (usually for lack of privileges) SerialCommErrCannotSchedule is raised at
+ * serialcomm_start_listener, and the threads run with the normal scheduling.
+ * The protocol option selects the frame format. The default is the legacy one:
+ * the framed protocol is requested at sync only with SerialCommProtocolFramed or
+ * SerialCommProtocolNegotiate, since a legacy firmware has no handler for its
+ * commands. With SerialCommProtocolNegotiate the format of the frames received
+ * tells if the device supports it (see serialcomm_protocol).
+ * \param port portname for connection
+ * \param opt options of the connection, or NULL
+ * \param err pointer to error callback
+ * \return a pointer to the SerialComm structure or NULL on error
+ */
+extern SerialComm * serialcomm_open_ex(const char * port, const SerialCommOptions * opt, serialcomm_error_clbk err);
 /** \brief The function syncronize the sygnals through a signature
  * 
  * This function synchronize with the other end-point, by sending 
  * a synchronization char that is included asd a define. It also flushes
- * all the input data from serial.
+ * all the input data from serial. If the framed protocol has been opted in (see
+ * serialcomm_open_ex), it is requested too (cmdProtocolVersion).
  * \param sc pointer to the communication structure
  */
 extern void serialcomm_sync(SerialComm * sc);
+/** \brief Waits until the remote device answers
+ *
+ * To be called after serialcomm_start_listener (or after the connection is attached
+ * to a manager), in place of fixed waits for the board to boot. A hearthbeat is sent
+ * every SERIALCOMM_CONNECT_PROBE_MS until the first valid frame is received. While the
+ * device stays completely silent the signature (and the protocol request) is sent again
+ * before each probe, since a board that resets on open misses what is sent while it boots.
+ * \param sc pointer to the communication structure
+ * \param timeout_ms maximum waiting time in milliseconds (negative waits forever)
+ * \return 0 when the device answered, -1 on timeout (SerialCommErrTimeout is raised)
+ */
+extern int serialcomm_handshake(SerialComm * sc, int timeout_ms);
 /**  \brief Function for thread: Receiving data
  * 
  * The function shall run in a thread and it is used to receive a packet of data from
  * the serial connection. The data received is specified in the output_s, and are copied
  * only once all the data have been received.
+ * All the available bytes are read with a single read() in a ring buffer, and the
+ * complete frames are parsed directly from it. When a frame fails the checksum the
+ * parser slides over the stream one byte at a time, until a frame that passes the
+ * checksum and contains plausible values is found (see rx_resyncs). With the framed
+ * protocol the parser jumps directly to the next FRAME_START byte. A partial frame
+ * followed by SERIALCOMM_RX_GAP_MS of silence is dropped. The thread sleeps in poll()
+ * on the serial descriptor and on the wakeup event, thus it does not consume CPU while
+ * the remote device is silent.
  * \param sc_v a pointer to the communication structure
  */
 void * serialcomm_receive_thread(void * sc_v);
+/**  \brief Function for thread: Sending data
+ *
+ * The function shall run in a thread and it drains the outgoing commands queue: all
+ * the commands queued are written with a single writev(). When the queue stays empty
+ * for SERIALCOMM_TX_LINGER_US the thread sleeps on the writer wakeup event. On close
+ * the queue is drained before exit.
+ * \param sc_v a pointer to the communication structure
+ */
+void * serialcomm_send_thread(void * sc_v);
+/** \brief Handles the readiness of the serial descriptor
+ *
+ * The body of the receive thread, for event loops that serve the descriptor
+ * themselves (see libserialcomm_manager.h): reads the available bytes when
+ * readable and parses the complete frames.
+ * \param sc a pointer to the communication structure
+ * \param readable the descriptor is readable
+ * \param hangup the descriptor reported an error or a hang up
+ * \return -1 when the port has been closed by the remote end (SerialCommErrIsClosed is raised)
+ */
+extern int serialcomm_receive_ready(SerialComm * sc, int readable, int hangup);
+/** \brief Drops the partial frame after SERIALCOMM_RX_GAP_MS of silence on the line */
+extern void serialcomm_receive_gap(SerialComm * sc);
+/** \brief Writes all the queued commands, with a single writev()
+ *
+ * The body of the send thread, for event loops that serve the descriptor themselves.
+ * \param sc a pointer to the communication structure
+ * \return the number of commands written
+ */
+extern size_t serialcomm_send_drain(SerialComm * sc);
+/** \brief Writes the queued commands the output buffer accepts, without waiting
+ *
+ * For event loops that must not block on a full output buffer: when commands
+ * remain, the loop waits for the descriptor to be writable and calls it again.
+ * The commands that still find the buffer full after SERIALCOMM_TX_STALL_MS are
+ * dropped, as in serialcomm_send_drain.
+ * \param sc a pointer to the communication structure
+ * \return 1 if commands remain to be written, 0 if the queue is empty, -1 if
+ * the commands have been dropped (SerialCommErrCannotWrite is raised)
+ */
+extern int serialcomm_send_ready(SerialComm * sc);
 /** \brief Sending a command to the remote device
  * 
- * The function sends a command over the serial connection.
- * When the command is written by the external send command function, the memory is put in a locked
- * state. When the lock state is intercepted by the function, the memory is copied, the memory is 
- * made unlocked, and then it is written in serial.
+ * The function encodes the command (with its checksum, in the protocol of the device)
+ * directly in the outgoing queue, and returns without waiting for the serial write, that is performed by the writer
+ * thread. Only the first command of a burst pays for the wakeup of the idle writer.
+ * If the queue is full the command is dropped and SerialCommErrQueueFull is raised.
+ * Commands sent before serialcomm_start_listener are queued and written when the
+ * writer is started.
  * \param sc a pointer to the communication structure
  * \param cmd The command code to send
  * \param value a float value to send (also for unsigned long, the data to send is float, converted in receiver)
  */
 extern void serialcomm_send(SerialComm * sc, CommandCode cmd, float value);
+/** \brief Sends a command that the remote device acknowledges
+ *
+ * As serialcomm_send, with a sequence number: the device executes the sequenced
+ * commands once and in order, and acknowledges them. Without an acknowledgement
+ * in SERIALCOMM_ACK_TIMEOUT_MS the commands not acknowledged are sent again, up to
+ * SERIALCOMM_ACK_RETRIES times, then they are declared lost (SerialCommErrNoAck is
+ * raised) and the sequence restarts. Up to SERIALCOMM_ACK_WINDOW commands can be
+ * in flight: a batch is confirmed by waiting for the last command only. It needs
+ * the framed protocol: otherwise the command is sent without sequence number.
+ * \param sc a pointer to the communication structure
+ * \param cmd The command code to send
+ * \param value a float value to send
+ * \return the sequence number of the command (see serialcomm_wait_ack), -1 if it
+ *         is not acknowledged (legacy protocol, or SerialCommErrQueueFull)
+ */
+extern long serialcomm_send_acked(SerialComm * sc, CommandCode cmd, float value);
+/** \brief Waits for the acknowledgement of a sequenced command
+ *
+ * \param sc a pointer to the communication structure
+ * \param seq the sequence number returned by serialcomm_send_acked
+ * \param timeout_ms maximum waiting time in milliseconds (negative waits forever)
+ * \param latency_ns if not NULL, the time from the first transmission to the acknowledgement
+ * \return 0 when the command has been acknowledged, -1 if it has been lost, if it is
+ *         too old to be known, or on timeout (SerialCommErrTimeout is raised)
+ */
+extern int serialcomm_wait_ack(SerialComm * sc, unsigned int seq, int timeout_ms, uint64_t * latency_ns);
+/** \brief Retransmits the sequenced commands not acknowledged in time
+ *
+ * Called by the writer thread (or by the event loops that serve the descriptor
+ * themselves) when it is idle.
+ * \param sc a pointer to the communication structure
+ * \return the time (ms) to the next retransmission, -1 if no command is waiting
+ */
+extern int serialcomm_ack_timer(SerialComm * sc);
+/** \brief Starts or stops the telemetry stream of the remote device
+ *
+ * With a period greater than zero the remote device sends an output frame every
+ * period milliseconds, without hearthbeat requests. The listener tracks the
+ * streamed frames arrival, counting missed (stream_missed) and duplicated
+ * (stream_duplicated) frames. A zero period stops the stream. It needs the framed
+ * protocol: on a legacy device nothing is sent, and SerialCommErrUnsupported is raised.
+ * \param sc a pointer to the communication structure
+ * \param period_ms period of the stream in milliseconds, 0 to stop it
+ */
+extern void serialcomm_stream(SerialComm * sc, unsigned int period_ms);
+/** \brief Protocol spoken by the remote device
+ *
+ * \param sc a pointer to the communication structure
+ * \return the protocol of the frames received, SerialCommProtocolUnknown if no frame has
+ *         been received yet
+ */
+extern SerialCommProtocol serialcomm_protocol(SerialComm * sc);
+/** \brief Requests the compact telemetry (FrameDelta of messages.h)
+ *
+ * The remote device sends only the fields changed since the previous frame, with
+ * the measurements in fixed point, and a full frame every key_interval frames. The
+ * listener rebuilds each output_s, thus the frames read do not depend on the
+ * encoding (the measurements are rounded to 1 / DELTA_SCALE). It needs the framed
+ * protocol: on a legacy device nothing is sent, and SerialCommErrUnsupported is raised.
+ * \param sc a pointer to the communication structure
+ * \param key_interval frames between two full frames, 0 to send full frames only
+ */
+extern void serialcomm_compact(SerialComm * sc, unsigned int key_interval);
+/** \brief Reads a coherent copy of the last received frame
+ *
+ * The listener publishes each valid frame through a sequence lock: the reader
+ * copies the frame and retries only if the listener was writing it in the
+ * meanwhile. The reader never takes a lock, thus it never blocks the listener.
+ * \param sc a pointer to the communication structure
+ * \param out destination of the copy
+ * \return the number of the frame (0 if no frame has been received yet)
+ */
+extern unsigned long serialcomm_read_output(SerialComm * sc, output_s * out);
+/** \brief Copies a batch of frames from the history ring
+ *
+ * The listener keeps the last SERIALCOMM_HISTORY_SIZE frames, each with its number
+ * and reception time. The function copies, in order, the frames with a number
+ * greater than since, up to n frames. Frames overwritten before they could be
+ * copied are skipped (the gap is visible in the seq field). As for the output,
+ * the read is lock free and never blocks the listener.
+ * \param sc a pointer to the communication structure
+ * \param since number of the last frame already known by the caller (0 for all)
+ * \param buf destination of the copy, at least n records
+ * \param n maximum number of records to copy
+ * \return the number of records copied
+ */
+extern size_t serialcomm_read_history(SerialComm * sc, unsigned long since, SerialCommRecord * buf, size_t n);
+/** \brief Number of the last frame received
+ *
+ * \param sc a pointer to the communication structure
+ * \return the number of the last frame completely received
+ */
+extern unsigned long serialcomm_frame_number(SerialComm * sc);
+/** \brief Waits for a frame newer than a given one
+ *
+ * The calling thread sleeps until the listener publishes a frame with a number
+ * greater than after, or until the timeout expires (SerialCommErrTimeout is raised).
+ * \param sc a pointer to the communication structure
+ * \param after number of the last frame already known by the caller
+ * \param timeout_ms maximum waiting time in milliseconds (negative waits forever)
+ * \return the number of the new frame, or 0 on timeout
+ */
+extern unsigned long serialcomm_wait_frame(SerialComm * sc, unsigned long after, int timeout_ms);
+/** \brief As serialcomm_wait_frame, without raising SerialCommErrTimeout
+ *
+ * For the threads whose normal idle state is waiting for the next frame (the
+ * handshake, the fan-out of the daemon): an idle line is not an error for them.
+ * \return the number of the new frame, or 0 on timeout
+ */
+extern unsigned long serialcomm_frame_wait(SerialComm * sc, unsigned long after, int timeout_ms);
 /** \brief Close the connection and frees the space occupied by the SerialComm
  * 
  * The function closes the serial port if it is still open, then frees up
@@ -147,9 +544,43 @@ extern void serialcomm_close(SerialComm * sc);
 /** \brief Request an update, this function in not blocking and uses a thread
  *
  * The function creates a new thread that executes the update of the internal structure.
- * The operation is not blocking and requires some time.
+ * The operation is not blocking and requires some time. The writer thread, that sends
+ * the queued commands, is started too.
  */
 extern void serialcomm_start_listener(SerialComm * sc);
+/** \brief CPU time consumed by the listener thread
+ *
+ * Returns the CPU time (user + system, in seconds) used by the listener thread
+ * since it has been started. If the listener already exited, the value measured
+ * at its exit is returned.
+ * \param sc pointer to the communication structure
+ * \return CPU time in seconds, or a negative value if it cannot be measured
+ */
+extern double serialcomm_listener_cpu_time(SerialComm * sc);
+/** \brief Copies the counters and the latency histograms of the connection
+ *
+ * Each counter is an atomic updated by the thread that owns it (listener, writer)
+ * with relaxed operations, and each histogram is copied whole under a sequence
+ * lock, as the output. The copy is taken while the threads run, so two counters
+ * updated in the meanwhile may be slightly out of step.
+ * \param sc pointer to the communication structure
+ * \param stats destination of the copy
+ */
+extern void serialcomm_get_stats(SerialComm * sc, SerialCommStats * stats);
+/** \brief Latency under which a fraction of the measures falls
+ *
+ * \param h the histogram
+ * \param q the fraction, from 0 to 1 (e.g. 0.99)
+ * \return the upper bound (s) of the bucket that reaches the fraction, 0 if the histogram is empty
+ */
+extern double serialcomm_histogram_quantile(const SerialCommHistogram * h, double q);
+/** \brief XOR checksum of the legacy frames (the check field of output_s and input_s)
+ *
+ * \param b the bytes of the frame
+ * \param size number of bytes before the check field
+ * \return the checksum
+ */
+extern char serialcomm_lcr_check(char * b, size_t size);
 
 
 #endif /* LIBSERIALCOMM_H_ */
@@ -0,0 +1,808 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "libserialcomm_archive.h"
+#include "libserialcomm_crc.h"
+
+#define SERIALCOMM_ARCHIVE_FLOATS DeltaConfig /**< Float columns */
+#define SERIALCOMM_ARCHIVE_RLE 3              /**< Run length columns (config, state, error) */
+
+/** \brief A column being written, as a stream of bits (most significant first) */
+typedef struct SerialCommArchiveBits {
+  uint8_t * b; /**< The bytes of the column */
+  size_t len; /**< Complete bytes in b */
+  uint64_t acc; /**< Bits not yet moved to b */
+  unsigned int n; /**< Number of bits in acc (less than 8 between two calls) */
+} SerialCommArchiveBits;
+
+/** \brief State of an archive being written */
+struct SerialCommArchive {
+  int fd; /**< The archive file */
+  uint64_t offset; /**< Bytes of the chunks handed to the helper */
+  uint64_t total; /**< Frames written, including the chunk in progress */
+  SerialCommArchiveIndex * index; /**< Index of the chunks written */
+  size_t chunks; /**< Entries in index */
+  size_t index_size; /**< Capacity of index */
+  SerialCommArchiveIndex cur; /**< Ranges of the chunk in progress */
+  SerialCommArchiveBits col[SerialCommArchiveColumns]; /**< Columns of the chunk in progress */
+  uint64_t int_prev[2]; /**< Last seq and time_ns */
+  uint64_t int_delta[2]; /**< Last difference of seq and time_ns */
+  uint32_t float_prev[SERIALCOMM_ARCHIVE_FLOATS]; /**< Bits of the last float values */
+  unsigned int float_lead[SERIALCOMM_ARCHIVE_FLOATS]; /**< Leading zeros of the XOR window (32 if none) */
+  unsigned int float_trail[SERIALCOMM_ARCHIVE_FLOATS]; /**< Trailing zeros of the XOR window */
+  uint8_t rle_value[SERIALCOMM_ARCHIVE_RLE]; /**< Value of the current run */
+  uint32_t rle_run[SERIALCOMM_ARCHIVE_RLE]; /**< Length of the current run */
+  pthread_t helper; /**< Writes the full chunks, the encoder goes on in the other columns */
+  pthread_mutex_t lock; /**< Lock on the fields below */
+  pthread_cond_t cond; /**< Signaled on a full chunk for the helper, and when it is written */
+  uint8_t * out[SerialCommArchiveColumns]; /**< Columns of the full chunk (swapped with col) */
+  SerialCommArchiveChunk out_head; /**< Header of the full chunk, without its CRC */
+  int pending; /**< A full chunk waits in out for the helper */
+  int write_err; /**< errno of a failed write, 0 if none */
+  int exit; /**< Request for quit the helper */
+};
+
+/** \brief State of an archive being read */
+struct SerialCommArchiveReader {
+  int fd; /**< The archive file */
+  const uint8_t * map; /**< Mapping of the whole file */
+  size_t size; /**< Size of the file */
+  SerialCommArchiveIndex * index; /**< Index of the chunks */
+  size_t chunks; /**< Entries in index */
+  uint64_t frames; /**< Frames in the archive */
+  uint32_t chunk_frames; /**< Frames in a full chunk */
+  size_t next; /**< Next chunk to decode */
+  SerialCommRecord * buf; /**< Frames of the last chunk decoded */
+  size_t count; /**< Frames in buf */
+  size_t pos; /**< Next frame of buf to read */
+};
+
+/** \brief Worst case size of a column, for a chunk */
+static size_t serialcomm_archive_column_size(int c) {
+  size_t bits;
+  if (c < SerialCommArchiveFloat)
+    bits = 68;   // '1111' and 64 bits
+  else if (c < SerialCommArchiveConfig)
+    bits = 44;   // '11', the window and 32 bits
+  else
+    bits = 24;   // a run of one frame
+  return (bits * SERIALCOMM_ARCHIVE_CHUNK) / 8 + 16;
+} // serialcomm_archive_column_size
+
+/** \brief Appends the n low bits of v (n up to 64) */
+static void serialcomm_archive_put(SerialCommArchiveBits * w, uint64_t v, unsigned int n) {
+  if (n > 32) {
+    serialcomm_archive_put(w, v >> 32, n - 32);
+    n = 32;
+  }
+  w->acc = (w->acc << n) | (v & ((1ull << n) - 1));
+  w->n += n;
+  while (w->n >= 8) {
+    w->n -= 8;
+    w->b[w->len++] = (uint8_t)(w->acc >> w->n);
+  }
+} // serialcomm_archive_put
+
+/** \brief Moves the last bits of a column to its bytes, padded with zeros */
+static void serialcomm_archive_pad(SerialCommArchiveBits * w) {
+  if (w->n)
+    w->b[w->len++] = (uint8_t)(w->acc << (8 - w->n));
+  w->acc = 0;
+  w->n = 0;
+} // serialcomm_archive_pad
+
+/** \brief Appends seq or time_ns (column c), as a delta of delta */
+static void serialcomm_archive_put_int(SerialCommArchive * ar, int c, uint64_t v) {
+  SerialCommArchiveBits * w = &(ar->col[c]);
+  if (ar->cur.frames == 0) {
+    serialcomm_archive_put(w, v, 64);
+    ar->int_delta[c] = 0;
+  } else {
+    uint64_t delta = v - ar->int_prev[c];
+    int64_t dod = (int64_t)(delta - ar->int_delta[c]);
+    uint64_t z = ((uint64_t)dod << 1) ^ (uint64_t)(dod >> 63);
+    if (z == 0) {
+      serialcomm_archive_put(w, 0x0, 1);
+    } else if (z < (1ull << 12)) {
+      serialcomm_archive_put(w, 0x2, 2);
+      serialcomm_archive_put(w, z, 12);
+    } else if (z < (1ull << 20)) {
+      serialcomm_archive_put(w, 0x6, 3);
+      serialcomm_archive_put(w, z, 20);
+    } else if (z < (1ull << 32)) {
+      serialcomm_archive_put(w, 0xE, 4);
+      serialcomm_archive_put(w, z, 32);
+    } else {
+      serialcomm_archive_put(w, 0xF, 4);
+      serialcomm_archive_put(w, z, 64);
+    }
+    ar->int_delta[c] = delta;
+  }
+  ar->int_prev[c] = v;
+} // serialcomm_archive_put_int
+
+/** \brief Appends the float field f, XOR with its previous value */
+static void serialcomm_archive_put_float(SerialCommArchive * ar, int f, float x) {
+  SerialCommArchiveBits * w = &(ar->col[SerialCommArchiveFloat + f]);
+  uint32_t v;
+  memcpy(&v, &x, sizeof(v));
+  if (ar->cur.frames == 0) {
+    serialcomm_archive_put(w, v, 32);
+    ar->float_lead[f] = 32;
+  } else {
+    uint32_t d = v ^ ar->float_prev[f];
+    if (!d) {
+      serialcomm_archive_put(w, 0x0, 1);
+    } else {
+      unsigned int lead = (unsigned int)__builtin_clz(d);
+      unsigned int trail = (unsigned int)__builtin_ctz(d);
+      if (ar->float_lead[f] < 32 && lead >= ar->float_lead[f] && trail >= ar->float_trail[f]) {
+        serialcomm_archive_put(w, 0x2, 2);
+        serialcomm_archive_put(w, d >> ar->float_trail[f], 32 - ar->float_lead[f] - ar->float_trail[f]);
+      } else {
+        unsigned int len = 32 - lead - trail;
+        serialcomm_archive_put(w, 0x3, 2);
+        serialcomm_archive_put(w, lead, 5);
+        serialcomm_archive_put(w, len - 1, 5);
+        serialcomm_archive_put(w, d >> trail, len);
+        ar->float_lead[f] = lead;
+        ar->float_trail[f] = trail;
+      }
+    }
+  }
+  ar->float_prev[f] = v;
+} // serialcomm_archive_put_float
+
+/** \brief Appends the current run of the run length column k */
+static void serialcomm_archive_put_run(SerialCommArchive * ar, int k) {
+  SerialCommArchiveBits * w = &(ar->col[SerialCommArchiveConfig + k]);
+  serialcomm_archive_put(w, ar->rle_value[k], 8);
+  serialcomm_archive_put(w, ar->rle_run[k], 16);
+} // serialcomm_archive_put_run
+
+/** \brief Appends a byte to the run length column k */
+static void serialcomm_archive_put_byte(SerialCommArchive * ar, int k, uint8_t v) {
+  if (ar->cur.frames && v == ar->rle_value[k]) {
+    ar->rle_run[k]++;
+    return;
+  }
+  if (ar->cur.frames)
+    serialcomm_archive_put_run(ar, k);
+  ar->rle_value[k] = v;
+  ar->rle_run[k] = 1;
+} // serialcomm_archive_put_byte
+
+/** \brief Writes all the buffers, continuing after partial writes */
+static int serialcomm_archive_writev(int fd, struct iovec * iov, int cnt) {
+  while (cnt > 0) {
+    ssize_t w = writev(fd, iov, cnt);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (cnt > 0 && (size_t)w >= iov->iov_len) {
+      w -= (ssize_t)iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + w;
+      iov->iov_len -= (size_t)w;
+    }
+  }
+  return 0;
+} // serialcomm_archive_writev
+
+/** \brief Writes the chunk handed by the encoder: the CRC and the file write are off the listener */
+static int serialcomm_archive_write(SerialCommArchive * ar, SerialCommArchiveChunk * h) {
+  struct iovec iov[1 + SerialCommArchiveColumns];
+  iov[0].iov_base = (void*)h;
+  iov[0].iov_len = sizeof(*h);
+  uint16_t crc = FRAME_CRC_INIT;
+  for (int c = 0; c < SerialCommArchiveColumns; c++) {
+    crc = serialcomm_crc16(crc, ar->out[c], h->column[c]);
+    iov[1 + c].iov_base = (void*)ar->out[c];
+    iov[1 + c].iov_len = h->column[c];
+  }
+  h->crc = crc;
+  return serialcomm_archive_writev(ar->fd, iov, 1 + SerialCommArchiveColumns);
+} // serialcomm_archive_write
+
+/** \brief Helper thread: writes the full chunks */
+static void * serialcomm_archive_thread(void * ar_v) {
+  SerialCommArchive * ar = (SerialCommArchive*)ar_v;
+  pthread_mutex_lock(&(ar->lock));
+  while (1) {
+    if (ar->pending) {
+      SerialCommArchiveChunk h = ar->out_head;
+      pthread_mutex_unlock(&(ar->lock));
+      int res = serialcomm_archive_write(ar, &h);
+      int err = errno;
+      pthread_mutex_lock(&(ar->lock));
+      if (res < 0 && !ar->write_err)
+        ar->write_err = err ? err : EIO;
+      ar->pending = 0;
+      pthread_cond_broadcast(&(ar->cond));
+      continue;
+    }
+    if (ar->exit)
+      break;
+    pthread_cond_wait(&(ar->cond), &(ar->lock));
+  }
+  pthread_mutex_unlock(&(ar->lock));
+  return NULL;
+} // serialcomm_archive_thread
+
+/** \brief Hands the chunk in progress to the helper, and adds it to the index
+ *
+ * The helper is usually done with the previous chunk: the encoder only swaps the
+ * columns. It waits for it otherwise.
+ * \return 0 on success, -1 if a chunk could not be written (errno is set)
+ */
+static int serialcomm_archive_flush(SerialCommArchive * ar) {
+  if (!ar->cur.frames)
+    return 0;
+
+  if (ar->chunks == ar->index_size) {
+    size_t size = ar->index_size ? 2 * ar->index_size : 256;
+    SerialCommArchiveIndex * index = (SerialCommArchiveIndex*)realloc(ar->index, size * sizeof(SerialCommArchiveIndex));
+    if (!index)
+      return -1;
+    ar->index = index;
+    ar->index_size = size;
+  }
+
+  SerialCommArchiveChunk h;
+  memset(&h, 0, sizeof(h));
+  h.magic = SERIALCOMM_ARCHIVE_CHUNK_MAGIC;
+  uint32_t bytes = 0;
+  for (int k = 0; k < SERIALCOMM_ARCHIVE_RLE; k++)
+    serialcomm_archive_put_run(ar, k);
+  for (int c = 0; c < SerialCommArchiveColumns; c++) {
+    serialcomm_archive_pad(&(ar->col[c]));
+    h.column[c] = (uint32_t)ar->col[c].len;
+    bytes += (uint32_t)ar->col[c].len;
+  }
+  ar->cur.offset = ar->offset;
+  ar->cur.bytes = bytes;
+  h.range = ar->cur;
+
+  pthread_mutex_lock(&(ar->lock));
+  while (ar->pending)
+    pthread_cond_wait(&(ar->cond), &(ar->lock));
+  if (ar->write_err) {
+    errno = ar->write_err;
+    pthread_mutex_unlock(&(ar->lock));
+    return -1;
+  }
+  for (int c = 0; c < SerialCommArchiveColumns; c++) {
+    uint8_t * b = ar->out[c];
+    ar->out[c] = ar->col[c].b;
+    ar->col[c].b = b;
+    ar->col[c].len = 0;
+  }
+  ar->out_head = h;
+  ar->pending = 1;
+  pthread_cond_broadcast(&(ar->cond));
+  pthread_mutex_unlock(&(ar->lock));
+
+  ar->index[ar->chunks++] = ar->cur;
+  ar->offset += sizeof(h) + bytes;
+  ar->cur.frames = 0;
+  return 0;
+} // serialcomm_archive_flush
+
+/** \brief Frees the memory of an archive */
+static void serialcomm_archive_free(SerialCommArchive * ar) {
+  for (int c = 0; c < SerialCommArchiveColumns; c++) {
+    free(ar->col[c].b);
+    free(ar->out[c]);
+  }
+  free(ar->index);
+  free(ar);
+} // serialcomm_archive_free
+
+extern SerialCommArchive * serialcomm_archive_create(const char * path) {
+  if (!path) {
+    errno = EINVAL;
+    return NULL;
+  }
+  serialcomm_crc_init();
+  SerialCommArchive * ar = (SerialCommArchive*)calloc(1, sizeof(SerialCommArchive));
+  if (!ar)
+    return NULL;
+  for (int c = 0; c < SerialCommArchiveColumns; c++) {
+    ar->col[c].b = (uint8_t*)malloc(serialcomm_archive_column_size(c));
+    ar->out[c] = (uint8_t*)malloc(serialcomm_archive_column_size(c));
+    if (!ar->col[c].b || !ar->out[c]) {
+      serialcomm_archive_free(ar);
+      return NULL;
+    }
+  }
+
+  ar->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (ar->fd < 0) {
+    serialcomm_archive_free(ar);
+    return NULL;
+  }
+  char header[SERIALCOMM_ARCHIVE_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  SerialCommArchiveHeader * h = (SerialCommArchiveHeader*)header;
+  h->magic = SERIALCOMM_ARCHIVE_MAGIC;
+  h->version = SERIALCOMM_ARCHIVE_VERSION;
+  h->header_size = SERIALCOMM_ARCHIVE_HEADER_SIZE;
+  h->frame_size = output_buffer_size;
+  h->chunk_frames = SERIALCOMM_ARCHIVE_CHUNK;
+  h->columns = SerialCommArchiveColumns;
+  struct iovec iov = { (void*)header, sizeof(header) };
+  if (serialcomm_archive_writev(ar->fd, &iov, 1) < 0) {
+    int err = errno;
+    close(ar->fd);
+    serialcomm_archive_free(ar);
+    errno = err;
+    return NULL;
+  }
+  ar->offset = SERIALCOMM_ARCHIVE_HEADER_SIZE;
+
+  pthread_mutex_init(&(ar->lock), NULL);
+  pthread_cond_init(&(ar->cond), NULL);
+  int err = pthread_create(&(ar->helper), NULL, serialcomm_archive_thread, (void*)ar);
+  if (err) {
+    pthread_cond_destroy(&(ar->cond));
+    pthread_mutex_destroy(&(ar->lock));
+    close(ar->fd);
+    serialcomm_archive_free(ar);
+    errno = err;
+    return NULL;
+  }
+  return ar;
+} // serialcomm_archive_create
+
+extern int serialcomm_archive_append(SerialCommArchive * ar, const SerialCommRecord * r) {
+  const output_s * o = &(r->frame);
+  uint64_t cycle = (o->cycle > 0.0f) ? (uint64_t)o->cycle : 0;
+  if (ar->cur.frames == 0) {
+    ar->cur.first_seq = r->seq;
+    ar->cur.first_ns = r->time_ns;
+    ar->cur.first_cycle = cycle;
+    ar->cur.last_cycle = cycle;
+  }
+
+  // The float fields come first in output_s, in DeltaField order
+  float v[SERIALCOMM_ARCHIVE_FLOATS];
+  memcpy(v, (const void*)o, sizeof(v));
+  serialcomm_archive_put_int(ar, SerialCommArchiveSeq, r->seq);
+  serialcomm_archive_put_int(ar, SerialCommArchiveTime, r->time_ns);
+  for (int f = 0; f < SERIALCOMM_ARCHIVE_FLOATS; f++)
+    serialcomm_archive_put_float(ar, f, v[f]);
+  serialcomm_archive_put_byte(ar, 0, (uint8_t)o->config);
+  serialcomm_archive_put_byte(ar, 1, (uint8_t)o->state);
+  serialcomm_archive_put_byte(ar, 2, (uint8_t)o->error);
+
+  ar->cur.last_seq = r->seq;
+  ar->cur.last_ns = r->time_ns;
+  if (cycle > ar->cur.last_cycle)
+    ar->cur.last_cycle = cycle;
+  ar->cur.frames++;
+  ar->total++;
+  if (ar->cur.frames == SERIALCOMM_ARCHIVE_CHUNK)
+    return serialcomm_archive_flush(ar);
+  return 0;
+} // serialcomm_archive_append
+
+extern int serialcomm_archive_close(SerialCommArchive * ar) {
+  if (!ar)
+    return 0;
+  int res = serialcomm_archive_flush(ar);
+
+  pthread_mutex_lock(&(ar->lock));
+  ar->exit = 1;
+  pthread_cond_broadcast(&(ar->cond));
+  pthread_mutex_unlock(&(ar->lock));
+  pthread_join(ar->helper, NULL);
+  if (ar->write_err)
+    res = -1;
+
+  if (res == 0) {
+    SerialCommArchiveTrailer t;
+    memset(&t, 0, sizeof(t));
+    t.index_offset = ar->offset;
+    t.chunks = ar->chunks;
+    t.magic = SERIALCOMM_ARCHIVE_INDEX_MAGIC;
+    t.version = SERIALCOMM_ARCHIVE_VERSION;
+    struct iovec iov[2] = {
+      { (void*)ar->index, ar->chunks * sizeof(SerialCommArchiveIndex) },
+      { (void*)&t, sizeof(t) }
+    };
+    res = serialcomm_archive_writev(ar->fd, iov, 2);
+  }
+  if (close(ar->fd) < 0)
+    res = -1;
+  pthread_cond_destroy(&(ar->cond));
+  pthread_mutex_destroy(&(ar->lock));
+  serialcomm_archive_free(ar);
+  return res;
+} // serialcomm_archive_close
+
+extern uint64_t serialcomm_archive_count(const SerialCommArchive * ar, uint64_t * bytes) {
+  if (bytes)
+    *bytes = ar ? ar->offset : 0;
+  return ar ? ar->total : 0;
+} // serialcomm_archive_count
+
+
+extern int serialcomm_archive_start(SerialComm * sc, const char * path) {
+  if (!sc)
+    return -1;
+
+  SerialCommArchive * ar = serialcomm_archive_create(path);
+  if (!ar) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotArchive, sc);
+    return -1;
+  }
+
+  pthread_mutex_lock(&(sc->archive_lock));
+  SerialCommArchive * old = sc->archive;
+  sc->archive = ar;
+  pthread_mutex_unlock(&(sc->archive_lock));
+
+  if (serialcomm_archive_close(old) < 0 && sc->err_clbk)
+    sc->err_clbk(SerialCommErrCannotArchive, sc);
+  return 0;
+} // serialcomm_archive_start
+
+extern void serialcomm_archive_stop(SerialComm * sc) {
+  if (!sc)
+    return;
+
+  pthread_mutex_lock(&(sc->archive_lock));
+  SerialCommArchive * old = sc->archive;
+  sc->archive = NULL;
+  pthread_mutex_unlock(&(sc->archive_lock));
+
+  if (serialcomm_archive_close(old) < 0 && sc->err_clbk)
+    sc->err_clbk(SerialCommErrCannotArchive, sc);
+} // serialcomm_archive_stop
+
+extern void serialcomm_archive_frame(SerialComm * sc, const SerialCommRecord * r) {
+  // The lock is contended only while an archive is started or stopped
+  pthread_mutex_lock(&(sc->archive_lock));
+  if (sc->archive && serialcomm_archive_append(sc->archive, r) < 0) {
+    serialcomm_archive_close(sc->archive);
+    sc->archive = NULL;
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotArchive, sc);
+  }
+  pthread_mutex_unlock(&(sc->archive_lock));
+} // serialcomm_archive_frame
+
+
+/** \brief A column being read */
+typedef struct SerialCommArchiveCursor {
+  const uint8_t * b; /**< The bytes of the column */
+  size_t len; /**< Size of the column */
+  size_t pos; /**< Next bit to read */
+} SerialCommArchiveCursor;
+
+/** \brief Reads n bits (n up to 64), zeros past the end of the column */
+static uint64_t serialcomm_archive_get(SerialCommArchiveCursor * r, unsigned int n) {
+  uint64_t v = 0;
+  while (n) {
+    size_t byte = r->pos >> 3;
+    unsigned int off = (unsigned int)(r->pos & 7);
+    unsigned int take = (8 - off < n) ? 8 - off : n;
+    unsigned int cur = (byte < r->len) ? r->b[byte] : 0;
+    v = (v << take) | ((cur >> (8 - off - take)) & ((1u << take) - 1));
+    r->pos += take;
+    n -= take;
+  }
+  return v;
+} // serialcomm_archive_get
+
+/** \brief Tells if the columns of a chunk header add up to its size
+ *
+ * The header is not covered by the CRC: a damaged column size must not move the
+ * cursors out of the chunk.
+ */
+static int serialcomm_archive_columns_valid(const SerialCommArchiveChunk * h) {
+  uint64_t bytes = 0;
+  for (int c = 0; c < SerialCommArchiveColumns; c++)
+    bytes += h->column[c];
+  return bytes == h->range.bytes;
+} // serialcomm_archive_columns_valid
+
+/** \brief Decodes the chunk k in the buffer of the reader
+ * \return 0 on success, -1 on a damaged chunk
+ */
+static int serialcomm_archive_decode(SerialCommArchiveReader * rd, size_t k) {
+  const SerialCommArchiveIndex * e = &(rd->index[k]);
+  SerialCommArchiveChunk h;
+  rd->count = 0;
+  rd->pos = 0;
+  rd->next = k + 1;
+  if (e->offset + sizeof(h) > rd->size)
+    return -1;
+  memcpy(&h, rd->map + e->offset, sizeof(h));
+  if (h.magic != SERIALCOMM_ARCHIVE_CHUNK_MAGIC || h.range.frames > rd->chunk_frames ||
+      e->offset + sizeof(h) + h.range.bytes > rd->size || !serialcomm_archive_columns_valid(&h))
+    return -1;
+  const uint8_t * col = rd->map + e->offset + sizeof(h);
+  if (serialcomm_crc16(FRAME_CRC_INIT, col, h.range.bytes) != h.crc)
+    return -1;
+
+  size_t frames = h.range.frames;
+  SerialCommRecord * out = rd->buf;
+  memset(out, 0, frames * sizeof(SerialCommRecord));
+  for (int c = 0; c < SerialCommArchiveColumns; c++) {
+    SerialCommArchiveCursor r = { col, h.column[c], 0 };
+    col += h.column[c];
+
+    if (c < SerialCommArchiveFloat) {
+      uint64_t v = 0, delta = 0;
+      for (size_t i = 0; i < frames; i++) {
+        if (i == 0) {
+          v = serialcomm_archive_get(&r, 64);
+        } else {
+          uint64_t z = 0;
+          if (serialcomm_archive_get(&r, 1) == 0)
+            z = 0;
+          else if (serialcomm_archive_get(&r, 1) == 0)
+            z = serialcomm_archive_get(&r, 12);
+          else if (serialcomm_archive_get(&r, 1) == 0)
+            z = serialcomm_archive_get(&r, 20);
+          else if (serialcomm_archive_get(&r, 1) == 0)
+            z = serialcomm_archive_get(&r, 32);
+          else
+            z = serialcomm_archive_get(&r, 64);
+          delta += (z >> 1) ^ (0 - (z & 1));
+          v += delta;
+        }
+        if (c == SerialCommArchiveSeq)
+          out[i].seq = (unsigned long)v;
+        else
+          out[i].time_ns = v;
+      }
+    } else if (c < SerialCommArchiveConfig) {
+      uint32_t v = 0;
+      unsigned int lead = 32, trail = 0;
+      for (size_t i = 0; i < frames; i++) {
+        if (i == 0) {
+          v = (uint32_t)serialcomm_archive_get(&r, 32);
+        } else if (serialcomm_archive_get(&r, 1)) {
+          if (serialcomm_archive_get(&r, 1)) {
+            lead = (unsigned int)serialcomm_archive_get(&r, 5);
+            unsigned int len = (unsigned int)serialcomm_archive_get(&r, 5) + 1;
+            if (lead + len > 32)
+              return -1;
+            trail = 32 - lead - len;
+          } else if (lead == 32) {
+            return -1;
+          }
+          v ^= (uint32_t)(serialcomm_archive_get(&r, 32 - lead - trail) << trail);
+        }
+        memcpy((char*)&(out[i].frame) + (c - SerialCommArchiveFloat) * sizeof(float), &v, sizeof(v));
+      }
+    } else {
+      size_t i = 0;
+      while (i < frames) {
+        uint8_t v = (uint8_t)serialcomm_archive_get(&r, 8);
+        size_t run = (size_t)serialcomm_archive_get(&r, 16);
+        if (run == 0 || run > frames - i)
+          return -1;
+        for (; run; run--, i++) {
+          if (c == SerialCommArchiveConfig)
+            out[i].frame.config = (char)v;
+          else if (c == SerialCommArchiveState)
+            out[i].frame.state = (char)v;
+          else
+            out[i].frame.error = (char)v;
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < frames; i++)
+    out[i].frame.check = serialcomm_lcr_check((char*)&(out[i].frame), output_size);
+  rd->count = frames;
+  return 0;
+} // serialcomm_archive_decode
+
+/** \brief Loads the index from the trailer, or rebuilds it from the chunk headers */
+static int serialcomm_archive_index(SerialCommArchiveReader * rd) {
+  SerialCommArchiveTrailer t;
+  size_t end = rd->size;
+  if (rd->size >= SERIALCOMM_ARCHIVE_HEADER_SIZE + sizeof(t)) {
+    memcpy(&t, rd->map + rd->size - sizeof(t), sizeof(t));
+    if (t.magic == SERIALCOMM_ARCHIVE_INDEX_MAGIC && t.version == SERIALCOMM_ARCHIVE_VERSION &&
+        t.index_offset >= SERIALCOMM_ARCHIVE_HEADER_SIZE &&
+        t.chunks <= (rd->size - sizeof(t) - t.index_offset) / sizeof(SerialCommArchiveIndex) &&
+        t.index_offset + t.chunks * sizeof(SerialCommArchiveIndex) + sizeof(t) == rd->size) {
+      rd->chunks = (size_t)t.chunks;
+      rd->index = (SerialCommArchiveIndex*)malloc((rd->chunks ? rd->chunks : 1) * sizeof(SerialCommArchiveIndex));
+      if (!rd->index)
+        return -1;
+      memcpy(rd->index, rd->map + t.index_offset, rd->chunks * sizeof(SerialCommArchiveIndex));
+      return 0;
+    }
+  }
+
+  // Not closed: every complete chunk is indexed
+  size_t size = 0;
+  size_t off = SERIALCOMM_ARCHIVE_HEADER_SIZE;
+  SerialCommArchiveChunk h;
+  while (off + sizeof(h) <= end) {
+    memcpy(&h, rd->map + off, sizeof(h));
+    if (h.magic != SERIALCOMM_ARCHIVE_CHUNK_MAGIC || h.range.offset != off ||
+        off + sizeof(h) + h.range.bytes > end || !serialcomm_archive_columns_valid(&h))
+      break;
+    if (rd->chunks == size) {
+      size = size ? 2 * size : 256;
+      SerialCommArchiveIndex * index = (SerialCommArchiveIndex*)realloc(rd->index, size * sizeof(SerialCommArchiveIndex));
+      if (!index)
+        return -1;
+      rd->index = index;
+    }
+    rd->index[rd->chunks++] = h.range;
+    off += sizeof(h) + h.range.bytes;
+  }
+  return 0;
+} // serialcomm_archive_index
+
+extern SerialCommArchiveReader * serialcomm_archive_load(const char * path) {
+  if (!path) {
+    errno = EINVAL;
+    return NULL;
+  }
+  serialcomm_crc_init();
+  SerialCommArchiveReader * rd = (SerialCommArchiveReader*)calloc(1, sizeof(SerialCommArchiveReader));
+  if (!rd)
+    return NULL;
+  rd->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (rd->fd < 0) {
+    free(rd);
+    return NULL;
+  }
+
+  struct stat st;
+  SerialCommArchiveHeader h;
+  if (fstat(rd->fd, &st) < 0)
+    goto fail;
+  rd->size = (size_t)st.st_size;
+  if (rd->size < SERIALCOMM_ARCHIVE_HEADER_SIZE) {
+    errno = EILSEQ;
+    goto fail;
+  }
+  rd->map = (const uint8_t*)mmap(NULL, rd->size, PROT_READ, MAP_SHARED, rd->fd, 0);
+  if (rd->map == MAP_FAILED) {
+    rd->map = NULL;
+    goto fail;
+  }
+  memcpy(&h, rd->map, sizeof(h));
+  if (h.magic != SERIALCOMM_ARCHIVE_MAGIC || h.version != SERIALCOMM_ARCHIVE_VERSION ||
+      h.header_size != SERIALCOMM_ARCHIVE_HEADER_SIZE || h.frame_size != output_buffer_size ||
+      h.columns != SerialCommArchiveColumns || h.chunk_frames == 0 || h.chunk_frames > 65535) {
+    errno = EILSEQ;
+    goto fail;
+  }
+  rd->chunk_frames = h.chunk_frames;
+  rd->buf = (SerialCommRecord*)malloc(rd->chunk_frames * sizeof(SerialCommRecord));
+  if (!rd->buf || serialcomm_archive_index(rd) < 0) {
+    errno = ENOMEM;
+    goto fail;
+  }
+  for (size_t k = 0; k < rd->chunks; k++)
+    rd->frames += rd->index[k].frames;
+  return rd;
+
+fail: {
+    int err = errno;
+    serialcomm_archive_unload(rd);
+    errno = err;
+    return NULL;
+  }
+} // serialcomm_archive_load
+
+extern void serialcomm_archive_unload(SerialCommArchiveReader * rd) {
+  if (!rd)
+    return;
+  if (rd->map)
+    munmap((void*)rd->map, rd->size);
+  if (rd->fd >= 0)
+    close(rd->fd);
+  free(rd->index);
+  free(rd->buf);
+  free(rd);
+} // serialcomm_archive_unload
+
+extern uint64_t serialcomm_archive_frames(const SerialCommArchiveReader * rd) {
+  return rd ? rd->frames : 0;
+} // serialcomm_archive_frames
+
+extern int serialcomm_archive_seek_cycle(SerialCommArchiveReader * rd, unsigned long cycle) {
+  if (!rd)
+    return -1;
+  // First chunk reaching the cycle
+  size_t lo = 0, hi = rd->chunks;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (rd->index[mid].last_cycle < cycle)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == rd->chunks || serialcomm_archive_decode(rd, lo) < 0)
+    return -1;
+  while (rd->pos < rd->count && !(rd->buf[rd->pos].frame.cycle >= (float)cycle))
+    rd->pos++;
+  return 0;
+} // serialcomm_archive_seek_cycle
+
+extern int serialcomm_archive_seek_time(SerialCommArchiveReader * rd, uint64_t time_ns) {
+  if (!rd)
+    return -1;
+  size_t lo = 0, hi = rd->chunks;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (rd->index[mid].last_ns < time_ns)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == rd->chunks || serialcomm_archive_decode(rd, lo) < 0)
+    return -1;
+  while (rd->pos < rd->count && rd->buf[rd->pos].time_ns < time_ns)
+    rd->pos++;
+  return 0;
+} // serialcomm_archive_seek_time
+
+extern size_t serialcomm_archive_read(SerialCommArchiveReader * rd, SerialCommRecord * buf, size_t n) {
+  if (!rd || !buf)
+    return 0;
+  size_t done = 0;
+  while (done < n) {
+    if (rd->pos == rd->count) {
+      if (rd->next >= rd->chunks || serialcomm_archive_decode(rd, rd->next) < 0)
+        break;
+      continue;
+    }
+    size_t len = rd->count - rd->pos;
+    if (len > n - done)
+      len = n - done;
+    memcpy(buf + done, rd->buf + rd->pos, len * sizeof(SerialCommRecord));
+    rd->pos += len;
+    done += len;
+  }
+  return done;
+} // serialcomm_archive_read
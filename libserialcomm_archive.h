@@ -0,0 +1,193 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_ARCHIVE_H_
+#define LIBSERIALCOMM_ARCHIVE_H_
+
+/** \brief Compressed columnar archive of the received frames
+ *
+ * For long runs, where most of the fields barely change between two frames.
+ * The writer, fed by the listener, collects the frames in chunks of
+ * SERIALCOMM_ARCHIVE_CHUNK frames, each field in its own column, compressed
+ * frame by frame as it arrives:
+ *
+ *  - seq and time_ns: delta of delta, '0' for a constant step, then buckets of
+ *    12, 20, 32 and 64 bits
+ *  - the float fields: XOR with the previous value (Gorilla), '0' for the same
+ *    value, '10' and the meaningful bits if they fit in the previous window of
+ *    leading and trailing zeros, '11', the window (5 + 5 bits) and the bits
+ *    otherwise
+ *  - config, state and error: run length, 8 bits of value and 16 of length
+ *  - the XOR check is not stored, it is evaluated again by the reader
+ *
+ * When a chunk is full a helper thread appends it to the file, after its header
+ * with the ranges of frame numbers, times and cycles, the size of each column
+ * and a CRC-16 of the columns, while the listener encodes the next chunk in a
+ * second set of columns. At close the index of the chunks is appended, with a
+ * trailer pointing to it. The reader seeks to a cycle or a time with a binary
+ * search of the index and decodes a single chunk; a file without the trailer
+ * (writer killed) is indexed again walking the chunk headers, up to the last
+ * complete chunk.
+ *
+ * The frames of a connection go to the archive (serialcomm_archive_start) or to
+ * the recorder of libserialcomm_recorder.h, or to both.
+ */
+
+#include <stdint.h>
+#include "libserialcomm.h"
+
+#define SERIALCOMM_ARCHIVE_MAGIC 0x43524153u   /**< "SARC": archive file signature */
+#define SERIALCOMM_ARCHIVE_VERSION 1           /**< Version of the archive format */
+#define SERIALCOMM_ARCHIVE_CHUNK_MAGIC 0x4B484353u /**< "SCHK": chunk signature */
+#define SERIALCOMM_ARCHIVE_INDEX_MAGIC 0x58444953u /**< "SIDX": trailer signature */
+#define SERIALCOMM_ARCHIVE_HEADER_SIZE 64      /**< Size of the file header (chunks start here) */
+#define SERIALCOMM_ARCHIVE_CHUNK 4096          /**< Frames in a chunk (at most 65535) */
+
+/** \brief Columns of a chunk, in file order */
+typedef enum SerialCommArchiveColumn {
+  SerialCommArchiveSeq = 0,  /**< Frame number */
+  SerialCommArchiveTime,     /**< Reception time */
+  SerialCommArchiveFloat,    /**< First float field, the others follow in DeltaField order */
+  SerialCommArchiveConfig = SerialCommArchiveFloat + DeltaConfig, /**< config */
+  SerialCommArchiveState,    /**< state */
+  SerialCommArchiveError,    /**< error */
+  SerialCommArchiveColumns   /**< Number of columns */
+} SerialCommArchiveColumn;
+
+/** \brief Header at the beginning of the archive file */
+typedef struct SerialCommArchiveHeader {
+  uint32_t magic; /**< SERIALCOMM_ARCHIVE_MAGIC */
+  uint32_t version; /**< SERIALCOMM_ARCHIVE_VERSION */
+  uint32_t header_size; /**< Offset of the first chunk */
+  uint32_t frame_size; /**< Size of the output frame */
+  uint32_t chunk_frames; /**< Frames in a full chunk */
+  uint32_t columns; /**< Columns in a chunk */
+} SerialCommArchiveHeader;
+
+/** \brief Ranges of a chunk, in its header and in the index */
+typedef struct SerialCommArchiveIndex {
+  uint64_t offset; /**< Offset of the chunk header in the file */
+  uint64_t first_seq; /**< Number of the first frame */
+  uint64_t last_seq; /**< Number of the last frame */
+  uint64_t first_ns; /**< Reception time of the first frame */
+  uint64_t last_ns; /**< Reception time of the last frame */
+  uint64_t first_cycle; /**< cycle of the first frame */
+  uint64_t last_cycle; /**< Highest cycle of the chunk */
+  uint32_t frames; /**< Frames in the chunk */
+  uint32_t bytes; /**< Size of the columns after the chunk header */
+} SerialCommArchiveIndex;
+
+/** \brief Header of a chunk, followed by its columns */
+typedef struct SerialCommArchiveChunk {
+  uint32_t magic; /**< SERIALCOMM_ARCHIVE_CHUNK_MAGIC */
+  uint16_t crc; /**< CRC-16 of the columns */
+  uint16_t reserved;
+  SerialCommArchiveIndex range; /**< Ranges of the chunk */
+  uint32_t column[SerialCommArchiveColumns]; /**< Size of each column, in file order */
+} SerialCommArchiveChunk;
+
+/** \brief Trailer at the end of a closed archive, after the index */
+typedef struct SerialCommArchiveTrailer {
+  uint64_t index_offset; /**< Offset of the first SerialCommArchiveIndex */
+  uint64_t chunks; /**< Entries in the index */
+  uint32_t magic; /**< SERIALCOMM_ARCHIVE_INDEX_MAGIC */
+  uint32_t version; /**< SERIALCOMM_ARCHIVE_VERSION */
+} SerialCommArchiveTrailer;
+
+typedef struct SerialCommArchiveReader SerialCommArchiveReader;
+
+/** \brief Creates a new archive file (truncated if existing)
+ *
+ * \param path name of the archive file
+ * \return the archive or NULL on error (errno is set)
+ */
+extern SerialCommArchive * serialcomm_archive_create(const char * path);
+/** \brief Appends a frame to the archive, handing the chunk to the helper thread when full
+ *
+ * \param ar the archive
+ * \param r the frame
+ * \return 0 on success, -1 if a chunk could not be written (errno is set)
+ */
+extern int serialcomm_archive_append(SerialCommArchive * ar, const SerialCommRecord * r);
+/** \brief Writes the last chunk and the index, stops the helper and closes the archive
+ *
+ * \return 0 on success, -1 on write error
+ */
+extern int serialcomm_archive_close(SerialCommArchive * ar);
+/** \brief Frames and bytes written by the archive so far (bytes may be NULL)
+ *
+ * The bytes include the last full chunk, that may still be on its way to the file.
+ */
+extern uint64_t serialcomm_archive_count(const SerialCommArchive * ar, uint64_t * bytes);
+
+/** \brief Starts archiving all the frames received by a connection
+ *
+ * The listener appends each valid frame to the archive. A previous archive
+ * of the same connection is closed.
+ * \param sc a pointer to the communication structure
+ * \param path name of the archive file
+ * \return 0 on success, -1 on error (SerialCommErrCannotArchive is raised)
+ */
+extern int serialcomm_archive_start(SerialComm * sc, const char * path);
+/** \brief Stops archiving the frames of a connection, and closes the archive */
+extern void serialcomm_archive_stop(SerialComm * sc);
+/** \brief Called by the listener for each published frame */
+extern void serialcomm_archive_frame(SerialComm * sc, const SerialCommRecord * r);
+
+/** \brief Opens an archive for reading, positioned at its first frame
+ *
+ * \param path name of the archive file
+ * \return the reader or NULL on error (errno is set, EILSEQ if not an archive)
+ */
+extern SerialCommArchiveReader * serialcomm_archive_load(const char * path);
+/** \brief Closes a reader */
+extern void serialcomm_archive_unload(SerialCommArchiveReader * rd);
+/** \brief Frames in the archive */
+extern uint64_t serialcomm_archive_frames(const SerialCommArchiveReader * rd);
+/** \brief Moves the reader to the first frame with a cycle not lower than cycle
+ *
+ * The index is searched assuming the cycle field never decreases in the run.
+ * \return 0 on success, -1 if no frame reaches the cycle (or a damaged chunk)
+ */
+extern int serialcomm_archive_seek_cycle(SerialCommArchiveReader * rd, unsigned long cycle);
+/** \brief Moves the reader to the first frame received at or after time_ns
+ *
+ * \return 0 on success, -1 if no frame is so recent (or a damaged chunk)
+ */
+extern int serialcomm_archive_seek_time(SerialCommArchiveReader * rd, uint64_t time_ns);
+/** \brief Reads the next frames
+ *
+ * \param rd the reader
+ * \param buf destination array of at least n records
+ * \param n maximum number of records to read
+ * \return the number of records read, 0 at the end of the archive
+ */
+extern size_t serialcomm_archive_read(SerialCommArchiveReader * rd, SerialCommRecord * buf, size_t n);
+
+#endif /* LIBSERIALCOMM_ARCHIVE_H_ */
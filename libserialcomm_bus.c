@@ -0,0 +1,359 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "libserialcomm_bus.h"
+#include "libserialcomm_transport.h"
+
+#define SERIALCOMM_BUS_SIZE (sizeof(SerialCommBusHeader) + SERIALCOMM_BUS_SLOTS * sizeof(SerialCommBusSlot))
+
+/** \brief Shared memory object of a publisher, or mapping of a reader */
+struct SerialCommBus {
+  char port[SERIALCOMM_BUS_NAME_SIZE]; /**< Port name the readers attach to */
+  char name[SERIALCOMM_BUS_NAME_SIZE]; /**< Name of the shared memory object */
+  SerialCommBusHeader * header; /**< Mapping of the object */
+  SerialCommBusSlot * slots; /**< The ring, after the header */
+};
+
+struct SerialCommBusReader {
+  SerialCommBus bus;
+};
+
+extern void serialcomm_bus_name(const char * port, char * name, size_t len) {
+  size_t n = (size_t)snprintf(name, len, "/serialcomm.");
+  for (const char * p = port; *p && n + 1 < len; p++) {
+    char c = *p;
+    int keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+    // Leading separators of the port are not repeated ("/dev/tty" gives ".dev.tty")
+    if (!keep && (n == 0 || name[n - 1] == '.'))
+      continue;
+    name[n++] = keep ? c : '.';
+  }
+  name[n] = '\0';
+} // serialcomm_bus_name
+
+/** \brief Maps the shared memory object of the bus */
+static int serialcomm_bus_map(SerialCommBus * bus, int fd) {
+  void * map = mmap(NULL, SERIALCOMM_BUS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+  bus->header = (SerialCommBusHeader*)map;
+  bus->slots = (SerialCommBusSlot*)((char*)map + sizeof(SerialCommBusHeader));
+  return 0;
+} // serialcomm_bus_map
+
+/** \brief Unmaps the bus and releases it */
+static void serialcomm_bus_free(SerialCommBus * bus) {
+  if (bus->header)
+    munmap((void*)bus->header, SERIALCOMM_BUS_SIZE);
+  free(bus);
+} // serialcomm_bus_free
+
+/** \brief Tells if the object holds the bus of a publisher still running */
+static int serialcomm_bus_alive(const char * name) {
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0)
+    return 0;
+  int alive = 0;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SerialCommBusHeader)) {
+    void * map = mmap(NULL, sizeof(SerialCommBusHeader), PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      SerialCommBusHeader * h = (SerialCommBusHeader*)map;
+      alive = (h->magic == SERIALCOMM_BUS_MAGIC && !atomic_load(&(h->closed)) && h->owner > 0 &&
+               (kill((pid_t)h->owner, 0) == 0 || errno == EPERM));
+      munmap(map, sizeof(SerialCommBusHeader));
+    }
+  }
+  close(fd);
+  return alive;
+} // serialcomm_bus_alive
+
+/** \brief Wakes up all the readers sleeping on the futex */
+static void serialcomm_bus_wake(SerialCommBusHeader * h) {
+  syscall(SYS_futex, &(h->futex), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+} // serialcomm_bus_wake
+
+
+extern int serialcomm_bus_start(SerialComm * sc) {
+  if (!sc)
+    return -1;
+  SerialCommBus * bus = (SerialCommBus*)calloc(1, sizeof(SerialCommBus));
+  if (!bus) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotPublish, sc);
+    return -1;
+  }
+
+  // The stand-in devices of "pty:" and "loopback:" belong to a single connection,
+  // that is told apart by the process id and a counter. A restart keeps the port.
+  static atomic_uint connections;
+  pthread_mutex_lock(&(sc->bus_lock));
+  if (sc->bus)
+    snprintf(bus->port, sizeof(bus->port), "%s", sc->bus->port);
+  else if (sc->transport == &serialcomm_transport_pty || sc->transport == &serialcomm_transport_loopback)
+    snprintf(bus->port, sizeof(bus->port), "%s%d.%u", sc->port, (int)getpid(), atomic_fetch_add(&connections, 1) + 1);
+  else
+    snprintf(bus->port, sizeof(bus->port), "%s", sc->port);
+  int restart = (sc->bus != NULL);
+  pthread_mutex_unlock(&(sc->bus_lock));
+  serialcomm_bus_name(bus->port, bus->name, sizeof(bus->name));
+
+  // Only a stale object (of a publisher that died) is replaced: its readers keep the old mapping
+  if (!restart && serialcomm_bus_alive(bus->name)) {
+    serialcomm_bus_free(bus);
+    errno = EBUSY;
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotPublish, sc);
+    return -1;
+  }
+  shm_unlink(bus->name);
+  int fd = shm_open(bus->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+  if (fd < 0 || ftruncate(fd, (off_t)SERIALCOMM_BUS_SIZE) < 0 || serialcomm_bus_map(bus, fd) < 0) {
+    if (fd >= 0)
+      shm_unlink(bus->name);
+    serialcomm_bus_free(bus);
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotPublish, sc);
+    return -1;
+  }
+
+  // The object is zero filled: slots and counters start empty
+  SerialCommBusHeader * h = bus->header;
+  h->slots = SERIALCOMM_BUS_SLOTS;
+  h->slot_size = sizeof(SerialCommBusSlot);
+  h->owner = (int32_t)getpid();
+  h->version = SERIALCOMM_BUS_VERSION;
+  atomic_thread_fence(memory_order_release);
+  h->magic = SERIALCOMM_BUS_MAGIC;
+
+  pthread_mutex_lock(&(sc->bus_lock));
+  SerialCommBus * old = sc->bus;
+  sc->bus = bus;
+  pthread_mutex_unlock(&(sc->bus_lock));
+
+  if (old) {
+    atomic_store(&(old->header->closed), 1);
+    serialcomm_bus_wake(old->header);
+    serialcomm_bus_free(old);
+  }
+  return 0;
+} // serialcomm_bus_start
+
+extern int serialcomm_bus_port(SerialComm * sc, char * port, size_t len) {
+  if (!sc || !port || len == 0)
+    return -1;
+  pthread_mutex_lock(&(sc->bus_lock));
+  int published = (sc->bus != NULL);
+  if (published)
+    snprintf(port, len, "%s", sc->bus->port);
+  pthread_mutex_unlock(&(sc->bus_lock));
+  return published ? 0 : -1;
+} // serialcomm_bus_port
+
+extern void serialcomm_bus_stop(SerialComm * sc) {
+  if (!sc)
+    return;
+
+  pthread_mutex_lock(&(sc->bus_lock));
+  SerialCommBus * old = sc->bus;
+  sc->bus = NULL;
+  pthread_mutex_unlock(&(sc->bus_lock));
+
+  if (old) {
+    atomic_store(&(old->header->closed), 1);
+    serialcomm_bus_wake(old->header);
+    shm_unlink(old->name);
+    serialcomm_bus_free(old);
+  }
+} // serialcomm_bus_stop
+
+extern void serialcomm_bus_frame(SerialComm * sc, const SerialCommRecord * r) {
+  // The lock is contended only while the bus is started or stopped
+  pthread_mutex_lock(&(sc->bus_lock));
+  SerialCommBus * bus = sc->bus;
+  if (bus) {
+    SerialCommBusHeader * h = bus->header;
+    SerialCommBusSlot * slot = &(bus->slots[r->seq & SERIALCOMM_BUS_MASK]);
+    atomic_store_explicit(&(slot->seq), 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->time_ns = r->time_ns;
+    memcpy((void*)slot->frame.b, (void*)&(r->frame), output_buffer_size);
+    atomic_store_explicit(&(slot->seq), r->seq, memory_order_release);
+    atomic_store_explicit(&(h->head), r->seq, memory_order_release);
+    atomic_store(&(h->futex), (uint32_t)r->seq);
+    if (atomic_load(&(h->waiters)))
+      serialcomm_bus_wake(h);
+  }
+  pthread_mutex_unlock(&(sc->bus_lock));
+} // serialcomm_bus_frame
+
+
+extern SerialCommBusReader * serialcomm_bus_attach(const char * port) {
+  if (!port) {
+    errno = EINVAL;
+    return NULL;
+  }
+  SerialCommBusReader * rd = (SerialCommBusReader*)calloc(1, sizeof(SerialCommBusReader));
+  if (!rd)
+    return NULL;
+  serialcomm_bus_name(port, rd->bus.name, sizeof(rd->bus.name));
+
+  int fd = shm_open(rd->bus.name, O_RDWR | O_CLOEXEC, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < SERIALCOMM_BUS_SIZE) {
+    if (fd >= 0) {
+      close(fd);
+      errno = EAGAIN;
+    }
+    free(rd);
+    return NULL;
+  }
+  if (serialcomm_bus_map(&(rd->bus), fd) < 0) {
+    free(rd);
+    return NULL;
+  }
+  SerialCommBusHeader * h = rd->bus.header;
+  if (h->magic != SERIALCOMM_BUS_MAGIC || h->version != SERIALCOMM_BUS_VERSION ||
+      h->slots != SERIALCOMM_BUS_SLOTS || h->slot_size != sizeof(SerialCommBusSlot)) {
+    munmap((void*)h, SERIALCOMM_BUS_SIZE);
+    free(rd);
+    errno = EPROTO;
+    return NULL;
+  }
+  atomic_thread_fence(memory_order_acquire);
+  return rd;
+} // serialcomm_bus_attach
+
+extern void serialcomm_bus_detach(SerialCommBusReader * rd) {
+  if (rd && rd->bus.header)
+    munmap((void*)rd->bus.header, SERIALCOMM_BUS_SIZE);
+  free(rd);
+} // serialcomm_bus_detach
+
+extern unsigned long serialcomm_bus_frame_number(SerialCommBusReader * rd) {
+  return (unsigned long)atomic_load_explicit(&(rd->bus.header->head), memory_order_acquire);
+} // serialcomm_bus_frame_number
+
+/** \brief Copies frame n from its slot
+ * \return 1 if the copy is coherent, 0 if the slot holds another frame
+ */
+static int serialcomm_bus_copy(SerialCommBusReader * rd, uint64_t n, SerialCommRecord * dst) {
+  SerialCommBusSlot * slot = &(rd->bus.slots[n & SERIALCOMM_BUS_MASK]);
+  if (atomic_load_explicit(&(slot->seq), memory_order_acquire) != n)
+    return 0;
+  dst->seq = (unsigned long)n;
+  dst->time_ns = slot->time_ns;
+  memcpy((void*)&(dst->frame), (void*)slot->frame.b, output_buffer_size);
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&(slot->seq), memory_order_relaxed) == n;
+} // serialcomm_bus_copy
+
+extern unsigned long serialcomm_bus_latest(SerialCommBusReader * rd, output_s * out) {
+  SerialCommRecord rec;
+  uint64_t n;
+  do {
+    n = atomic_load_explicit(&(rd->bus.header->head), memory_order_acquire);
+    if (n == 0)
+      return 0;
+  } while (!serialcomm_bus_copy(rd, n, &rec));
+  memcpy((void*)out, (void*)&(rec.frame), output_buffer_size);
+  return (unsigned long)n;
+} // serialcomm_bus_latest
+
+extern size_t serialcomm_bus_read(SerialCommBusReader * rd, unsigned long since, SerialCommRecord * buf, size_t n) {
+  if (!rd || !buf)
+    return 0;
+  uint64_t head = atomic_load_explicit(&(rd->bus.header->head), memory_order_acquire);
+  uint64_t first = (uint64_t)since + 1;
+  if (head >= SERIALCOMM_BUS_SLOTS && first < head - SERIALCOMM_BUS_SLOTS + 1)
+    first = head - SERIALCOMM_BUS_SLOTS + 1;
+
+  size_t count = 0;
+  for (uint64_t s = first; s <= head && count < n; s++) {
+    if (serialcomm_bus_copy(rd, s, &(buf[count])))
+      count++;
+  }
+  return count;
+} // serialcomm_bus_read
+
+extern unsigned long serialcomm_bus_wait(SerialCommBusReader * rd, unsigned long after, int timeout_ms) {
+  SerialCommBusHeader * h = rd->bus.header;
+  struct timespec deadline, now, left;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  while (1) {
+    // The futex word is read before head: a frame published in between changes it
+    uint32_t word = atomic_load(&(h->futex));
+    uint64_t head = atomic_load_explicit(&(h->head), memory_order_acquire);
+    if (head > after)
+      return (unsigned long)head;
+    if (atomic_load(&(h->closed)))
+      return 0;
+
+    struct timespec * timeout = NULL;
+    if (timeout_ms >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left.tv_sec = deadline.tv_sec - now.tv_sec;
+      left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (left.tv_nsec < 0) {
+        left.tv_sec--;
+        left.tv_nsec += 1000000000L;
+      }
+      if (left.tv_sec < 0)
+        return 0;
+      timeout = &left;
+    }
+    atomic_fetch_add(&(h->waiters), 1);
+    syscall(SYS_futex, &(h->futex), FUTEX_WAIT, word, timeout, NULL, 0);
+    atomic_fetch_sub(&(h->waiters), 1);
+  }
+} // serialcomm_bus_wait
+
+extern int serialcomm_bus_closed(SerialCommBusReader * rd) {
+  SerialCommBusHeader * h = rd->bus.header;
+  if (atomic_load(&(h->closed)))
+    return 1;
+  return (kill((pid_t)h->owner, 0) < 0 && errno == ESRCH) ? 1 : 0;
+} // serialcomm_bus_closed
@@ -0,0 +1,160 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_BUS_H_
+#define LIBSERIALCOMM_BUS_H_
+
+/** \brief Shared memory bus of the received frames
+ *
+ * The owner of the port publishes each valid frame in a ring of
+ * SERIALCOMM_BUS_SLOTS records, in a POSIX shared memory object named after
+ * the port (see serialcomm_bus_name). Any number of local processes attach to
+ * it by port name and read the frames directly from the mapping, without
+ * system calls and without traffic on the serial line. The stand-in devices of
+ * "pty:" and "loopback:" are private to a connection: their bus is published
+ * with the port name followed by the process id and a counter (e.g.
+ * "pty:1234.1", see serialcomm_bus_port).
+ *
+ * Each slot is protected by its own sequence number: the publisher clears it
+ * while writing the record, and sets it to the frame number when done, thus a
+ * reader never blocks the publisher, and retries or skips the slots overwritten
+ * while it was reading them. Readers sleep on a futex in the shared header,
+ * that the publisher wakes only when someone is waiting.
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "libserialcomm.h"
+
+#define SERIALCOMM_BUS_MAGIC 0x53554253u  /**< "SBUS": bus signature */
+#define SERIALCOMM_BUS_VERSION 1          /**< Version of the bus layout */
+#define SERIALCOMM_BUS_SLOTS 1024         /**< Frames kept in the bus (power of two) */
+#define SERIALCOMM_BUS_MASK (SERIALCOMM_BUS_SLOTS - 1)
+#define SERIALCOMM_BUS_NAME_SIZE 256      /**< Maximum length of a bus name */
+
+/** \brief Header of the shared memory object */
+typedef struct SerialCommBusHeader {
+  uint32_t magic; /**< SERIALCOMM_BUS_MAGIC */
+  uint32_t version; /**< SERIALCOMM_BUS_VERSION */
+  uint32_t slots; /**< Number of slots */
+  uint32_t slot_size; /**< Size of each slot */
+  int32_t owner; /**< Process id of the publisher */
+  _Atomic uint32_t closed; /**< The publisher stopped: the readers must attach again */
+  _Atomic uint32_t futex; /**< Low 32 bits of head, the readers sleep on it */
+  _Atomic uint32_t waiters; /**< Readers sleeping on the futex */
+  _Atomic uint64_t head; /**< Number of the last frame published */
+} SerialCommBusHeader;
+
+/** \brief A slot of the ring: frame n is in slot n & SERIALCOMM_BUS_MASK */
+typedef struct SerialCommBusSlot {
+  _Atomic uint64_t seq; /**< Frame number, 0 while the publisher writes the slot */
+  uint64_t time_ns; /**< CLOCK_MONOTONIC reception time in nanoseconds */
+  output_u frame; /**< The frame */
+} SerialCommBusSlot;
+
+typedef struct SerialCommBusReader SerialCommBusReader;
+
+/** \brief Name of the shared memory object of a port
+ *
+ * "/serialcomm" followed by the port name, with the characters other than
+ * letters, digits, '-' and '_' replaced by '.' (e.g. "/serialcomm.dev.ttyACM0").
+ * \param port the port name, as given to serialcomm_open
+ * \param name destination of the name
+ * \param len size of name
+ */
+extern void serialcomm_bus_name(const char * port, char * name, size_t len);
+
+/** \brief Starts publishing all the frames received by a connection
+ *
+ * Creates the shared memory object of the port, and the listener publishes each
+ * valid frame in it. An object left by a publisher that died is replaced, while
+ * the bus of a publisher still running (its owner process exists) is not
+ * touched: the start fails with errno EBUSY. Starting again a published
+ * connection replaces its own bus, with the same port.
+ * \param sc a pointer to the communication structure
+ * \return 0 on success, -1 on error (SerialCommErrCannotPublish is raised)
+ */
+extern int serialcomm_bus_start(SerialComm * sc);
+/** \brief Port name the readers attach to (see serialcomm_bus_attach)
+ *
+ * \param sc a pointer to the communication structure
+ * \param port destination of the port name
+ * \param len size of port
+ * \return 0 on success, -1 if the connection is not published
+ */
+extern int serialcomm_bus_port(SerialComm * sc, char * port, size_t len);
+/** \brief Stops publishing, marks the bus closed for the readers and removes it */
+extern void serialcomm_bus_stop(SerialComm * sc);
+/** \brief Called by the listener for each published frame */
+extern void serialcomm_bus_frame(SerialComm * sc, const SerialCommRecord * r);
+
+/** \brief Attaches to the bus of a port
+ *
+ * \param port the port name, as given to serialcomm_open by the publisher (as
+ *        returned by serialcomm_bus_port for "pty:" and "loopback:")
+ * \return the reader, or NULL if the port is not published (errno is set)
+ */
+extern SerialCommBusReader * serialcomm_bus_attach(const char * port);
+/** \brief Detaches from the bus */
+extern void serialcomm_bus_detach(SerialCommBusReader * rd);
+/** \brief Number of the last frame published (0 if none yet) */
+extern unsigned long serialcomm_bus_frame_number(SerialCommBusReader * rd);
+/** \brief Copies the last frame published
+ *
+ * \param rd the reader
+ * \param out destination of the copy
+ * \return the number of the frame (0 if no frame has been published yet)
+ */
+extern unsigned long serialcomm_bus_latest(SerialCommBusReader * rd, output_s * out);
+/** \brief Copies, in order, the frames published after since, up to n frames
+ *
+ * As serialcomm_read_history: the frames overwritten before they could be copied
+ * are skipped (the gap is visible in the seq field).
+ * \param rd the reader
+ * \param since number of the last frame already known by the caller (0 for all)
+ * \param buf destination of the copy, at least n records
+ * \param n maximum number of records to copy
+ * \return the number of records copied
+ */
+extern size_t serialcomm_bus_read(SerialCommBusReader * rd, unsigned long since, SerialCommRecord * buf, size_t n);
+/** \brief Waits for a frame newer than after
+ *
+ * \param rd the reader
+ * \param after number of the last frame already known by the caller
+ * \param timeout_ms maximum waiting time in milliseconds (negative waits forever)
+ * \return the number of the new frame, or 0 on timeout or when the bus is closed
+ */
+extern unsigned long serialcomm_bus_wait(SerialCommBusReader * rd, unsigned long after, int timeout_ms);
+/** \brief The publisher stopped (or died): the reader must attach again
+ *
+ * \return 1 if the bus is closed
+ */
+extern int serialcomm_bus_closed(SerialCommBusReader * rd);
+
+#endif /* LIBSERIALCOMM_BUS_H_ */
@@ -0,0 +1,125 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <pthread.h>
+#include <string.h>
+#include "libserialcomm_crc.h"
+
+static uint16_t serialcomm_crc_table[4][256];
+static pthread_once_t serialcomm_crc_once = PTHREAD_ONCE_INIT;
+
+/** \brief Fills the tables: table k is the CRC of a byte followed by k zero bytes */
+static void serialcomm_crc_build(void) {
+  for (unsigned int i = 0; i < 256; i++) {
+    uint16_t crc = (uint16_t)(i << 8);
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ FRAME_CRC_POLY) : (uint16_t)(crc << 1);
+    serialcomm_crc_table[0][i] = crc;
+  }
+  for (int k = 1; k < 4; k++) {
+    for (unsigned int i = 0; i < 256; i++) {
+      uint16_t prev = serialcomm_crc_table[k - 1][i];
+      serialcomm_crc_table[k][i] = (uint16_t)((prev << 8) ^ serialcomm_crc_table[0][prev >> 8]);
+    }
+  }
+} // serialcomm_crc_build
+
+extern void serialcomm_crc_init(void) {
+  pthread_once(&serialcomm_crc_once, serialcomm_crc_build);
+} // serialcomm_crc_init
+
+extern uint16_t serialcomm_crc16(uint16_t crc, const void * b, size_t len) {
+  const unsigned char * p = (const unsigned char *)b;
+  while (len >= 4) {
+    crc = serialcomm_crc_table[3][(p[0] ^ (crc >> 8)) & 0xFF] ^
+          serialcomm_crc_table[2][(p[1] ^ crc) & 0xFF] ^
+          serialcomm_crc_table[1][p[2]] ^
+          serialcomm_crc_table[0][p[3]];
+    p += 4;
+    len -= 4;
+  }
+  while (len--)
+    crc = (uint16_t)((crc << 8) ^ serialcomm_crc_table[0][(*p++ ^ (crc >> 8)) & 0xFF]);
+  return crc;
+} // serialcomm_crc16
+
+extern size_t serialcomm_frame_seal(char * f, FrameType type, size_t len) {
+  frame_header_s h = { FRAME_START, FRAME_VERSION, (unsigned char)type, (unsigned char)len };
+  memcpy(f, &h, frame_header_size);
+  uint16_t crc = serialcomm_crc16(FRAME_CRC_INIT, f, frame_header_size + len);
+  f[frame_header_size + len] = (char)(crc & 0xFF);
+  f[frame_header_size + len + 1] = (char)(crc >> 8);
+  return frame_header_size + len + frame_crc_size;
+} // serialcomm_frame_seal
+
+extern SerialCommCommand serialcomm_command_push(SerialCommCommandParser * p, char b, int framed,
+                                                 input_u * in, sequenced_s * seq) {
+  p->in[p->len++] = b;
+  int valid;
+  if ((unsigned char)p->in[0] == FRAME_START && framed) {
+    frame_header_s h;
+    if (p->len < frame_header_size)
+      return SerialCommCommandPartial;
+    memcpy(&h, p->in, frame_header_size);
+    size_t length = (h.type == FrameCommand) ? input_size : ((h.type == FrameCommandSeq) ? sizeof(sequenced_s) : 0);
+    valid = (h.version == FRAME_VERSION && length && h.length == length);
+    if (valid && p->len < frame_header_size + length + frame_crc_size)
+      return SerialCommCommandPartial;
+    if (valid) {
+      uint16_t crc = serialcomm_crc16(FRAME_CRC_INIT, p->in, frame_header_size + length);
+      valid = ((unsigned char)p->in[frame_header_size + length] == (crc & 0xFF) &&
+               (unsigned char)p->in[frame_header_size + length + 1] == (crc >> 8));
+    }
+    if (valid) {
+      p->len = 0;
+      if (h.type == FrameCommandSeq) {
+        memcpy(seq, p->in + frame_header_size, sizeof(sequenced_s));
+        return SerialCommCommandSequenced;
+      }
+      memcpy(in->b, p->in + frame_header_size, input_size);
+      return SerialCommCommandPlain;
+    }
+  } else {
+    if (p->len < input_buffer_size)
+      return SerialCommCommandPartial;
+    memcpy(in->b, p->in, input_buffer_size);
+    char check = 0x00;
+    for (size_t k = 0; k < input_size; k++)
+      check ^= in->b[k];
+    valid = (check == in->s.check);
+    if (valid) {
+      p->len = 0;
+      return SerialCommCommandPlain;
+    }
+  }
+  // Slides by one byte
+  p->len--;
+  memmove(p->in, p->in + 1, p->len);
+  return SerialCommCommandInvalid;
+} // serialcomm_command_push
@@ -0,0 +1,98 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_CRC_H_
+#define LIBSERIALCOMM_CRC_H_
+
+/** \brief CRC-16 and framing of the framed protocol
+ *
+ * CRC-16/CCITT-FALSE (see messages.h), table driven and evaluated four bytes
+ * at a time (slicing-by-4): four tables give the contribution of a byte
+ * followed by 0 to 3 other bytes, so a single step consumes four input bytes.
+ *
+ * The frames are completed with serialcomm_frame_seal, on both the ends. The
+ * commands received by a device (the simulator, or the daemon towards its
+ * clients) are parsed with serialcomm_command_push, as the firmware does.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libserialcomm.h"
+
+/** \brief Outcome of a byte given to serialcomm_command_push */
+typedef enum SerialCommCommand {
+  SerialCommCommandPartial = 0, /**< More bytes are needed */
+  SerialCommCommandInvalid,     /**< No valid command starts at the first byte, that has been dropped */
+  SerialCommCommandPlain,       /**< A command: legacy input_s or FrameCommand */
+  SerialCommCommandSequenced    /**< A sequenced command (FrameCommandSeq) */
+} SerialCommCommand;
+
+/** \brief Partial command received by a device */
+typedef struct SerialCommCommandParser {
+  char in[frame_sequenced_size]; /**< Bytes of the partial command */
+  size_t len; /**< Bytes in the partial command */
+} SerialCommCommandParser;
+
+/** \brief Builds the tables (once per process, thread safe) */
+extern void serialcomm_crc_init(void);
+/** \brief Updates a CRC-16 with len bytes
+ *
+ * \param crc the CRC of the previous bytes, or FRAME_CRC_INIT
+ * \param b the bytes
+ * \param len number of bytes
+ * \return the updated CRC
+ */
+extern uint16_t serialcomm_crc16(uint16_t crc, const void * b, size_t len);
+
+/** \brief Completes a frame of the framed protocol
+ *
+ * Writes the header before the payload, already in place, and the CRC after it.
+ * \param f the frame, at least frame_header_size + len + frame_crc_size bytes
+ * \param type the payload type
+ * \param len the payload bytes
+ * \return the length of the frame
+ */
+extern size_t serialcomm_frame_seal(char * f, FrameType type, size_t len);
+/** \brief Adds a received byte to a partial command
+ *
+ * A command starting with FRAME_START is framed (a legacy command code never
+ * is), when framed is not zero. On a bad check the first byte is dropped, and
+ * the search goes on from the next one, as in the firmware. The parser is empty
+ * after a command, and a zero filled parser is empty.
+ * \param p the partial command
+ * \param b the byte received
+ * \param framed the device accepts the framed commands
+ * \param in receives the command, when SerialCommCommandPlain is returned
+ * \param seq receives the command, when SerialCommCommandSequenced is returned
+ * \return the outcome of the byte
+ */
+extern SerialCommCommand serialcomm_command_push(SerialCommCommandParser * p, char b, int framed,
+                                                 input_u * in, sequenced_s * seq);
+
+#endif /* LIBSERIALCOMM_CRC_H_ */
@@ -0,0 +1,201 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "libserialcomm_cycle.h"
+
+#define SERIALCOMM_CYCLE_MASK (SERIALCOMM_CYCLE_QUEUE - 1)
+
+/** \brief Tracker of the cycles, owned by the listener but for the queue */
+struct SerialCommCycles {
+  atomic_int on; /**< Aggregates computed */
+  int tracking; /**< A cycle is in progress (listener only) */
+  unsigned long last_seq; /**< Number of the last frame of the cycle */
+  float p_set; /**< p_set of the last frame */
+  int rising; /**< Waiting for p_meas to reach 90% of the step */
+  int rise_seen; /**< The rising edge of the cycle has been found */
+  float step_low, step_high; /**< Set points of the rising edge */
+  uint64_t t10_ns; /**< Time p_meas crossed 10% of the step, 0 if not yet */
+  double u_sum; /**< Sum of u_pres */
+  SerialCommCycle cur; /**< The cycle in progress */
+  pthread_mutex_t pop_lock; /**< Serializes the consumers */
+  atomic_ulong head; /**< Records pushed by the listener */
+  atomic_ulong tail; /**< Records taken by the consumers */
+  atomic_ulong dropped; /**< Records dropped with the queue full */
+  SerialCommCycle queue[SERIALCOMM_CYCLE_QUEUE]; /**< Completed cycles, record n in n & SERIALCOMM_CYCLE_MASK */
+};
+
+/** \brief Closes the cycle in progress and pushes it in the queue */
+static void serialcomm_cycle_push(SerialCommCycles * c, uint64_t end_ns) {
+  SerialCommCycle * cur = &(c->cur);
+  cur->duration_ns = end_ns - cur->start_ns;
+  cur->u_mean = (float)(c->u_sum / (double)cur->frames);
+  float step = cur->p_high - cur->p_low;
+  cur->overshoot = (step > 0.0f) ? (cur->p_max - cur->p_high) / step : 0.0f;
+
+  unsigned long head = atomic_load_explicit(&(c->head), memory_order_relaxed);
+  if (head - atomic_load_explicit(&(c->tail), memory_order_acquire) >= SERIALCOMM_CYCLE_QUEUE) {
+    atomic_fetch_add_explicit(&(c->dropped), 1, memory_order_relaxed);
+    return;
+  }
+  c->queue[head & SERIALCOMM_CYCLE_MASK] = *cur;
+  atomic_store_explicit(&(c->head), head + 1, memory_order_release);
+} // serialcomm_cycle_push
+
+/** \brief Starts a new cycle on the frame r */
+static void serialcomm_cycle_begin(SerialCommCycles * c, const SerialCommRecord * r, unsigned int flags) {
+  const output_s * o = &(r->frame);
+  SerialCommCycle * cur = &(c->cur);
+  memset(cur, 0, sizeof(SerialCommCycle));
+  cur->cycle = (unsigned long)o->cycle;
+  cur->start_ns = r->time_ns;
+  cur->p_max = cur->p_min = o->p_meas;
+  cur->p_high = cur->p_low = o->p_set;
+  cur->rise_s = -1.0f;
+  cur->t_start = o->t_meas;
+  cur->flags = flags;
+  c->u_sum = 0.0;
+  c->rise_seen = 0;
+  c->rising = 0;
+  c->tracking = 1;
+} // serialcomm_cycle_begin
+
+extern void serialcomm_cycle_frame(SerialComm * sc, const SerialCommRecord * r) {
+  SerialCommCycles * c = atomic_load_explicit(&(sc->cycles), memory_order_acquire);
+  if (!c)
+    return;
+  if (!atomic_load_explicit(&(c->on), memory_order_relaxed)) {
+    c->tracking = 0;
+    return;
+  }
+
+  const output_s * o = &(r->frame);
+  SerialCommCycle * cur = &(c->cur);
+  if (!c->tracking) {
+    serialcomm_cycle_begin(c, r, SerialCommCyclePartial);
+    c->p_set = o->p_set;
+  } else if ((unsigned long)o->cycle != cur->cycle) {
+    if ((unsigned long)o->cycle != cur->cycle + 1)
+      cur->flags |= SerialCommCycleInterrupted;
+    serialcomm_cycle_push(c, r->time_ns);
+    serialcomm_cycle_begin(c, r, (r->seq != c->last_seq + 1) ? SerialCommCycleGap : 0);
+  } else if (r->seq != c->last_seq + 1) {
+    cur->flags |= SerialCommCycleGap;
+  }
+  c->last_seq = r->seq;
+
+  cur->frames++;
+  if (o->p_meas > cur->p_max)
+    cur->p_max = o->p_meas;
+  if (o->p_meas < cur->p_min)
+    cur->p_min = o->p_meas;
+  if (o->p_set > cur->p_high)
+    cur->p_high = o->p_set;
+  if (o->p_set < cur->p_low)
+    cur->p_low = o->p_set;
+  cur->t_drift = o->t_meas - cur->t_start;
+  c->u_sum += (double)o->u_pres;
+
+  // Rise time on the first rising edge of the set point in the cycle
+  if (!c->rise_seen && o->p_set > c->p_set) {
+    c->rise_seen = 1;
+    c->rising = 1;
+    c->step_low = c->p_set;
+    c->step_high = o->p_set;
+    c->t10_ns = 0;
+  }
+  if (c->rising) {
+    float step = c->step_high - c->step_low;
+    if (!c->t10_ns && o->p_meas >= c->step_low + 0.1f * step)
+      c->t10_ns = r->time_ns;
+    if (o->p_meas >= c->step_low + 0.9f * step) {
+      cur->rise_s = 1e-9f * (float)(r->time_ns - c->t10_ns);
+      c->rising = 0;
+    }
+  }
+  c->p_set = o->p_set;
+} // serialcomm_cycle_frame
+
+extern int serialcomm_cycles_enable(SerialComm * sc, int on) {
+  if (!sc)
+    return -1;
+  SerialCommCycles * c = atomic_load_explicit(&(sc->cycles), memory_order_acquire);
+  if (!c) {
+    if (!on)
+      return 0;
+    c = (SerialCommCycles*)calloc(1, sizeof(SerialCommCycles));
+    if (!c) {
+      if (sc->err_clbk)
+        sc->err_clbk(SerialCommErrAllocErr, sc);
+      return -1;
+    }
+    pthread_mutex_init(&(c->pop_lock), NULL);
+    atomic_init(&(c->on), 0);
+    atomic_init(&(c->head), 0);
+    atomic_init(&(c->tail), 0);
+    atomic_init(&(c->dropped), 0);
+    SerialCommCycles * none = NULL;
+    if (!atomic_compare_exchange_strong(&(sc->cycles), &none, c)) {
+      // Created by another thread in the meanwhile
+      pthread_mutex_destroy(&(c->pop_lock));
+      free(c);
+      c = none;
+    }
+  }
+  atomic_store_explicit(&(c->on), on ? 1 : 0, memory_order_relaxed);
+  return 0;
+} // serialcomm_cycles_enable
+
+extern unsigned long serialcomm_cycles_pop(SerialComm * sc, SerialCommCycle * buf, unsigned long n) {
+  SerialCommCycles * c = sc ? atomic_load_explicit(&(sc->cycles), memory_order_acquire) : NULL;
+  if (!c || !buf)
+    return 0;
+  pthread_mutex_lock(&(c->pop_lock));
+  unsigned long tail = atomic_load_explicit(&(c->tail), memory_order_relaxed);
+  unsigned long avail = atomic_load_explicit(&(c->head), memory_order_acquire) - tail;
+  if (n > avail)
+    n = avail;
+  for (unsigned long i = 0; i < n; i++)
+    buf[i] = c->queue[(tail + i) & SERIALCOMM_CYCLE_MASK];
+  atomic_store_explicit(&(c->tail), tail + n, memory_order_release);
+  pthread_mutex_unlock(&(c->pop_lock));
+  return n;
+} // serialcomm_cycles_pop
+
+extern unsigned long serialcomm_cycles_dropped(SerialComm * sc) {
+  SerialCommCycles * c = sc ? atomic_load_explicit(&(sc->cycles), memory_order_acquire) : NULL;
+  return c ? atomic_load_explicit(&(c->dropped), memory_order_relaxed) : 0;
+} // serialcomm_cycles_dropped
+
+extern void serialcomm_cycles_free(SerialComm * sc) {
+  SerialCommCycles * c = atomic_exchange(&(sc->cycles), NULL);
+  if (c) {
+    pthread_mutex_destroy(&(c->pop_lock));
+    free(c);
+  }
+} // serialcomm_cycles_free
@@ -0,0 +1,104 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_CYCLE_H_
+#define LIBSERIALCOMM_CYCLE_H_
+
+/** \brief Aggregates of each pressure cycle
+ *
+ * The controller runs a square wave of p_set (period, duty_cycle) and counts the
+ * cycles in the cycle field. When enabled, the listener follows the cycle field
+ * of the valid frames and accumulates, frame by frame, the aggregates of the
+ * current cycle; when the field changes the cycle is complete, and one
+ * SerialCommCycle is pushed in a queue of SERIALCOMM_CYCLE_QUEUE records, that
+ * the application empties with serialcomm_cycles_pop. A full queue drops the
+ * new records (see serialcomm_cycles_dropped).
+ *
+ * The rise time is measured on the first rising edge of p_set in the cycle,
+ * from p_meas crossing 10% of the step to p_meas crossing 90% of it. The
+ * overshoot is the peak of p_meas above the high set point, as a fraction of the
+ * step.
+ */
+
+#include <stdint.h>
+#include "libserialcomm.h"
+
+#define SERIALCOMM_CYCLE_QUEUE 1024 /**< Records in the queue, power of two */
+
+/** \brief Flags of a cycle record */
+typedef enum SerialCommCycleFlag {
+  SerialCommCyclePartial = 1,    /**< The beginning of the cycle was not received (first cycle seen) */
+  SerialCommCycleGap = 2,        /**< Frames of the cycle were lost (gap in the frame numbers) */
+  SerialCommCycleInterrupted = 4 /**< The cycle field did not advance by one at the end (reset or stop) */
+} SerialCommCycleFlag;
+
+/** \brief Aggregates of a completed cycle */
+typedef struct SerialCommCycle {
+  unsigned long cycle; /**< Value of the cycle field */
+  unsigned long frames; /**< Frames received in the cycle */
+  uint64_t start_ns; /**< CLOCK_MONOTONIC reception time of the first frame */
+  uint64_t duration_ns; /**< From the first frame to the first frame of the next cycle */
+  float p_max; /**< Peak of p_meas */
+  float p_min; /**< Trough of p_meas */
+  float p_high; /**< Highest p_set */
+  float p_low; /**< Lowest p_set */
+  float rise_s; /**< Rise time of p_meas (s), -1 if p_meas did not reach 90% of the step */
+  float overshoot; /**< (p_max - p_high) / (p_high - p_low), negative if p_set was not reached, 0 without a step */
+  float t_start; /**< t_meas at the first frame */
+  float t_drift; /**< t_meas at the last frame minus t_start */
+  float u_mean; /**< Mean of u_pres */
+  unsigned int flags; /**< SerialCommCycleFlag bits */
+} SerialCommCycle;
+
+/** \brief Starts or stops the computation of the cycle aggregates
+ *
+ * The first cycle after the start is flagged SerialCommCyclePartial, as the
+ * cycle in progress when stopping is discarded. The records in the queue are
+ * kept.
+ * \param sc a pointer to the communication structure
+ * \param on 1 to start, 0 to stop
+ * \return 0 on success, -1 on allocation failure (SerialCommErrAllocErr is raised)
+ */
+extern int serialcomm_cycles_enable(SerialComm * sc, int on);
+/** \brief Takes the oldest completed cycles from the queue
+ *
+ * \param sc a pointer to the communication structure
+ * \param buf destination array of at least n records
+ * \param n maximum number of records to take
+ * \return the number of records taken (0 if the queue is empty)
+ */
+extern unsigned long serialcomm_cycles_pop(SerialComm * sc, SerialCommCycle * buf, unsigned long n);
+/** \brief Number of records dropped with the queue full */
+extern unsigned long serialcomm_cycles_dropped(SerialComm * sc);
+/** \brief Called by the listener for each valid frame */
+extern void serialcomm_cycle_frame(SerialComm * sc, const SerialCommRecord * r);
+/** \brief Frees the cycle tracker (at close, after the listener stopped) */
+extern void serialcomm_cycles_free(SerialComm * sc);
+
+#endif /* LIBSERIALCOMM_CYCLE_H_ */
@@ -0,0 +1,639 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "libserialcomm_daemon.h"
+#include "libserialcomm_crc.h"
+
+#define SERIALCOMM_DAEMON_EVENTS 64             /**< Events handled for each epoll_wait() */
+#define SERIALCOMM_DAEMON_IDLE_MS 250           /**< Wait of the fan-out thread for a frame, when no hearthbeat is due */
+#define SERIALCOMM_DAEMON_BATCH 64              /**< Frames read from the history at once */
+#define SERIALCOMM_DAEMON_LISTEN ((uint64_t)-1) /**< epoll tag of the listening socket */
+#define SERIALCOMM_DAEMON_WAKEUP ((uint64_t)-2) /**< epoll tag of the stop event */
+
+/** \brief A client, that sees the daemon as the remote device */
+typedef struct SerialCommClient {
+  int fd; /**< Connected socket */
+  unsigned int gen; /**< Generation of the client, to match the acknowledgements after a reconnection */
+  char synced; /**< The signature has been received */
+  char want; /**< A hearthbeat is waiting for its frame */
+  char dead; /**< A write failed: the client is closed by the I/O thread */
+  unsigned char version; /**< Protocol version of the frames sent to the client */
+  unsigned int stream_ms; /**< Stream period requested by the client, 0 if not streaming */
+  uint64_t stream_ns; /**< Reception time of the last streamed frame delivered */
+  char seq_valid; /**< A sequenced command has been received from the client */
+  unsigned char seq_epoch; /**< Epoch of the sequenced commands of the client */
+  uint16_t seq_last; /**< Last sequenced command forwarded to the device */
+  uint16_t seq_acked; /**< Last sequenced command acknowledged to the client */
+  SerialCommCommandParser in; /**< Partial command received */
+  size_t out_len; /**< Bytes waiting in the backlog */
+  char out[SERIALCOMM_DAEMON_BUFFER]; /**< Backlog of the bytes the socket did not accept */
+} SerialCommClient;
+
+/** \brief A sequenced command forwarded to the device for a client */
+typedef struct SerialCommDaemonAck {
+  uint16_t seq; /**< Sequence number on the connection (serialcomm_send_acked) */
+  uint16_t client_seq; /**< Sequence number of the client */
+  unsigned char epoch; /**< Epoch of the client */
+  unsigned int client; /**< Slot of the client */
+  unsigned int gen; /**< Generation of the client */
+} SerialCommDaemonAck;
+
+struct SerialCommDaemon {
+  SerialComm * sc; /**< The connection served */
+  char path[sizeof(((struct sockaddr_un*)0)->sun_path)]; /**< Path of the socket */
+  int listener; /**< Listening socket */
+  int epoll; /**< epoll set of the I/O thread */
+  int wakeup; /**< Event that stops the I/O thread */
+  pthread_t io; /**< Accepts the clients and reads their commands */
+  pthread_t fanout; /**< Copies the frames to the clients */
+  pthread_t acker; /**< Forwards the acknowledgements of the device */
+  atomic_int exit; /**< Request for quit the threads */
+  pthread_mutex_t lock; /**< Lock on everything below, and on the clients */
+  pthread_cond_t ack_cond; /**< Signaled when a sequenced command is forwarded */
+  SerialCommClient * clients[SERIALCOMM_DAEMON_MAX_CLIENTS]; /**< Clients, NULL for a free slot */
+  size_t count; /**< Clients connected */
+  unsigned int gen; /**< Generation of the last client connected */
+  unsigned int stream_ms; /**< Period of the device stream, 0 if not streaming */
+  uint64_t heartbeat_ns; /**< Time of the hearthbeat waiting for a frame, 0 if none */
+  SerialCommDaemonAck acks[SERIALCOMM_ACK_WINDOW]; /**< Forwarded commands, in order */
+  unsigned int ack_head; /**< Oldest forwarded command */
+  unsigned int ack_tail; /**< Next forwarded command */
+  unsigned long dropped; /**< Frames not delivered to slow clients */
+};
+
+static uint64_t serialcomm_daemon_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+} // serialcomm_daemon_now
+
+/** \brief Sets the events watched on the socket of a client */
+static void serialcomm_daemon_watch(SerialCommDaemon * d, unsigned int i, int op) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (d->clients[i]->out_len ? EPOLLOUT : 0);
+  ev.data.u64 = i;
+  epoll_ctl(d->epoll, op, d->clients[i]->fd, &ev);
+} // serialcomm_daemon_watch
+
+/** \brief Sends bytes to a client without blocking
+ *
+ * What the socket does not accept goes in the backlog of the client. Bytes
+ * that do not fit in the backlog are dropped as a whole: the client never
+ * receives a truncated frame.
+ * \return 0 when sent or queued, -1 when dropped
+ */
+static int serialcomm_daemon_write(SerialCommDaemon * d, unsigned int i, const char * b, size_t len) {
+  SerialCommClient * c = d->clients[i];
+  if (c->dead)
+    return -1;
+  if (c->out_len) {
+    if (c->out_len + len > SERIALCOMM_DAEMON_BUFFER) {
+      d->dropped++;
+      return -1;
+    }
+    memcpy(c->out + c->out_len, b, len);
+    c->out_len += len;
+    return 0;
+  }
+
+  ssize_t n = send(c->fd, b, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      c->dead = 1;
+      return -1;
+    }
+    n = 0;
+  }
+  if ((size_t)n < len) {
+    memcpy(c->out, b + n, len - (size_t)n);
+    c->out_len = len - (size_t)n;
+    serialcomm_daemon_watch(d, i, EPOLL_CTL_MOD);
+  }
+  return 0;
+} // serialcomm_daemon_write
+
+/** \brief Sends the backlog of a client, when its socket accepts data again */
+static void serialcomm_daemon_flush(SerialCommDaemon * d, unsigned int i) {
+  SerialCommClient * c = d->clients[i];
+  ssize_t n = send(c->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      c->dead = 1;
+    return;
+  }
+  c->out_len -= (size_t)n;
+  memmove(c->out, c->out + n, c->out_len);
+  if (!c->out_len)
+    serialcomm_daemon_watch(d, i, EPOLL_CTL_MOD);
+} // serialcomm_daemon_flush
+
+/** \brief Completes a frame of the framed protocol and sends it to a client */
+static int serialcomm_daemon_framed(SerialCommDaemon * d, unsigned int i, FrameType type, char * f, size_t len) {
+  return serialcomm_daemon_write(d, i, f, serialcomm_frame_seal(f, type, len));
+} // serialcomm_daemon_framed
+
+/** \brief Sends a frame to a client, in its protocol */
+static void serialcomm_daemon_output(SerialCommDaemon * d, unsigned int i, const output_s * frame) {
+  char f[frame_output_size];
+  if (d->clients[i]->version == FRAME_VERSION) {
+    memcpy(f + frame_header_size, (const void*)frame, output_size);
+    serialcomm_daemon_framed(d, i, FrameOutput, f, output_size);
+    return;
+  }
+  char check = 0x00;
+  memcpy(f, (const void*)frame, output_size);
+  for (size_t k = 0; k < output_size; k++)
+    check ^= f[k];
+  f[output_size] = check;
+  serialcomm_daemon_write(d, i, f, output_buffer_size);
+} // serialcomm_daemon_output
+
+/** \brief Acknowledges to a client its sequenced commands up to seq */
+static void serialcomm_daemon_ack(SerialCommDaemon * d, unsigned int i, unsigned char epoch, uint16_t seq) {
+  char f[frame_ack_size];
+  ack_s ack = { epoch, seq };
+  memcpy(f + frame_header_size, &ack, sizeof(ack_s));
+  serialcomm_daemon_framed(d, i, FrameAck, f, sizeof(ack_s));
+} // serialcomm_daemon_ack
+
+/** \brief Streams the device at the shortest period requested by the clients */
+static void serialcomm_daemon_stream(SerialCommDaemon * d) {
+  unsigned int period_ms = 0;
+  for (unsigned int i = 0; i < SERIALCOMM_DAEMON_MAX_CLIENTS; i++) {
+    SerialCommClient * c = d->clients[i];
+    if (c && c->stream_ms && (!period_ms || c->stream_ms < period_ms))
+      period_ms = c->stream_ms;
+  }
+  // A legacy device cannot stream: its frames are requested by hearthbeats
+  if (serialcomm_protocol(d->sc) != SerialCommProtocolFramed)
+    period_ms = 0;
+  if (period_ms != d->stream_ms) {
+    d->stream_ms = period_ms;
+    serialcomm_stream(d->sc, period_ms);
+  }
+} // serialcomm_daemon_stream
+
+/** \brief The command only shapes the telemetry of a client (see serialcomm_daemon_local) */
+static int serialcomm_daemon_is_local(char command) {
+  return (command == cmdHearthbeat || command == cmdStreamTelemetry ||
+          command == cmdProtocolVersion || command == cmdCompactTelemetry);
+} // serialcomm_daemon_is_local
+
+/** \brief Serves the commands that only shape the telemetry of a client
+ *
+ * \return 1 if the command has been served, 0 if it must be forwarded to the device
+ */
+static int serialcomm_daemon_local(SerialCommDaemon * d, unsigned int i, char command, float value) {
+  SerialCommClient * c = d->clients[i];
+  switch ((CommandCode)command) {
+    case cmdHearthbeat:
+      c->want = 1;
+      // A stream faster than a hearthbeat retry answers anyway
+      if (!d->heartbeat_ns && (!d->stream_ms || d->stream_ms > SERIALCOMM_DAEMON_HEARTBEAT_MS)) {
+        d->heartbeat_ns = serialcomm_daemon_now();
+        serialcomm_send(d->sc, cmdHearthbeat, 0.0f);
+      }
+      return 1;
+    case cmdStreamTelemetry:
+      c->stream_ms = (value > 0.0f) ? (unsigned int)value : 0;
+      c->stream_ns = 0;
+      serialcomm_daemon_stream(d);
+      return 1;
+    case cmdProtocolVersion:
+      if (value == 1.0f || value == (float)FRAME_VERSION)
+        c->version = (unsigned char)value;
+      return 1;
+    case cmdCompactTelemetry:
+      return 1;
+    default:
+      return 0;
+  }
+} // serialcomm_daemon_local
+
+/** \brief Forwards a sequenced command of a client once and in order
+ *
+ * The command is acknowledged to the client when the device acknowledges it
+ * (see serialcomm_daemon_acker). The retransmissions of the client of a command
+ * already forwarded are ignored, those of a command already acknowledged are
+ * acknowledged again.
+ */
+static void serialcomm_daemon_sequenced(SerialCommDaemon * d, unsigned int i, const sequenced_s * p) {
+  SerialCommClient * c = d->clients[i];
+  if (!c->seq_valid || p->epoch != c->seq_epoch) {
+    c->seq_valid = 1;
+    c->seq_epoch = p->epoch;
+    c->seq_last = (uint16_t)(p->seq - 1);
+    c->seq_acked = c->seq_last;
+  }
+
+  if (p->seq == (uint16_t)(c->seq_last + 1)) {
+    if (serialcomm_daemon_is_local(p->command)) {
+      // Acknowledged with the forwarded commands before it, as the device would
+      if (c->seq_acked != c->seq_last)
+        return;
+      serialcomm_daemon_local(d, i, p->command, p->value);
+    } else if (serialcomm_protocol(d->sc) == SerialCommProtocolFramed) {
+      if (d->ack_tail - d->ack_head >= SERIALCOMM_ACK_WINDOW)
+        return;
+      long seq = serialcomm_send_acked(d->sc, (CommandCode)p->command, p->value);
+      if (seq < 0)
+        return;
+      SerialCommDaemonAck * a = &(d->acks[d->ack_tail++ % SERIALCOMM_ACK_WINDOW]);
+      a->seq = (uint16_t)seq;
+      a->client_seq = p->seq;
+      a->epoch = p->epoch;
+      a->client = i;
+      a->gen = c->gen;
+      c->seq_last = p->seq;
+      pthread_cond_signal(&(d->ack_cond));
+      return;
+    } else {
+      // A legacy device does not acknowledge: the command is confirmed once sent
+      serialcomm_send(d->sc, (CommandCode)p->command, p->value);
+    }
+    c->seq_last = p->seq;
+    c->seq_acked = p->seq;
+  } else if ((int16_t)(p->seq - c->seq_acked) > 0) {
+    return; // Forwarded and not yet acknowledged, or after a gap
+  }
+  serialcomm_daemon_ack(d, i, c->seq_epoch, c->seq_acked);
+} // serialcomm_daemon_sequenced
+
+/** \brief Parses the bytes received from a client, as the device does */
+static void serialcomm_daemon_input(SerialCommDaemon * d, unsigned int i, const char * b, size_t len) {
+  SerialCommClient * c = d->clients[i];
+  for (size_t k = 0; k < len; k++) {
+    if (c->in.len == 0 && b[k] == SIGNATURE_MESSAGE) {
+      // A new session: the telemetry of the client restarts from the defaults
+      c->synced = 1;
+      c->version = 1;
+      c->want = 0;
+      c->seq_valid = 0;
+      if (c->stream_ms) {
+        c->stream_ms = 0;
+        serialcomm_daemon_stream(d);
+      }
+      continue;
+    }
+    if (!c->synced)
+      continue;
+
+    input_u in;
+    sequenced_s p;
+    switch (serialcomm_command_push(&(c->in), b[k], 1, &in, &p)) {
+      case SerialCommCommandPlain:
+        if (!serialcomm_daemon_local(d, i, in.s.command, in.s.value))
+          serialcomm_send(d->sc, (CommandCode)in.s.command, in.s.value);
+        break;
+      case SerialCommCommandSequenced:
+        serialcomm_daemon_sequenced(d, i, &p);
+        break;
+      default:
+        break;
+    }
+  }
+} // serialcomm_daemon_input
+
+/** \brief Accepts the clients waiting on the listening socket */
+static void serialcomm_daemon_accept(SerialCommDaemon * d) {
+  int fd;
+  while ((fd = accept4(d->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    unsigned int i = 0;
+    while (i < SERIALCOMM_DAEMON_MAX_CLIENTS && d->clients[i])
+      i++;
+    SerialCommClient * c = (i < SERIALCOMM_DAEMON_MAX_CLIENTS) ? (SerialCommClient*)calloc(1, sizeof(SerialCommClient)) : NULL;
+    if (!c) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->gen = ++(d->gen);
+    c->version = 1;
+    d->clients[i] = c;
+    d->count++;
+    serialcomm_daemon_watch(d, i, EPOLL_CTL_ADD);
+  }
+} // serialcomm_daemon_accept
+
+/** \brief Disconnects a client */
+static void serialcomm_daemon_drop(SerialCommDaemon * d, unsigned int i) {
+  SerialCommClient * c = d->clients[i];
+  epoll_ctl(d->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  d->clients[i] = NULL;
+  d->count--;
+  if (c->stream_ms)
+    serialcomm_daemon_stream(d);
+  free(c);
+} // serialcomm_daemon_drop
+
+/** \brief I/O thread: accepts the clients and executes their commands in arrival order */
+static void * serialcomm_daemon_io(void * d_v) {
+  SerialCommDaemon * d = (SerialCommDaemon*)d_v;
+  struct epoll_event events[SERIALCOMM_DAEMON_EVENTS];
+  char b[256];
+
+  while (1) {
+    int n = epoll_wait(d->epoll, events, SERIALCOMM_DAEMON_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return NULL;
+    }
+    pthread_mutex_lock(&(d->lock));
+    for (int k = 0; k < n; k++) {
+      uint64_t tag = events[k].data.u64;
+      if (tag == SERIALCOMM_DAEMON_WAKEUP) {
+        pthread_mutex_unlock(&(d->lock));
+        return NULL;
+      }
+      if (tag == SERIALCOMM_DAEMON_LISTEN) {
+        serialcomm_daemon_accept(d);
+        continue;
+      }
+
+      unsigned int i = (unsigned int)tag;
+      if (!d->clients[i])
+        continue;
+      if (events[k].events & EPOLLOUT)
+        serialcomm_daemon_flush(d, i);
+      int closed = d->clients[i]->dead;
+      if (!closed && (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        ssize_t len = recv(d->clients[i]->fd, b, sizeof(b), MSG_DONTWAIT);
+        if (len > 0)
+          serialcomm_daemon_input(d, i, b, (size_t)len);
+        else if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+          closed = 1;
+      }
+      if (closed || d->clients[i]->dead)
+        serialcomm_daemon_drop(d, i);
+    }
+    pthread_mutex_unlock(&(d->lock));
+  }
+} // serialcomm_daemon_io
+
+/** \brief Delivers a frame to the clients that wait for it */
+static void serialcomm_daemon_deliver(SerialCommDaemon * d, const SerialCommRecord * r) {
+  uint64_t half_ns = (uint64_t)d->stream_ms * 500000ULL;
+  for (unsigned int i = 0; i < SERIALCOMM_DAEMON_MAX_CLIENTS; i++) {
+    SerialCommClient * c = d->clients[i];
+    if (!c || !c->synced)
+      continue;
+    int due = c->want;
+    if (c->stream_ms && r->time_ns + half_ns - c->stream_ns >= (uint64_t)c->stream_ms * 1000000ULL) {
+      c->stream_ns = r->time_ns;
+      due = 1;
+    }
+    if (due) {
+      c->want = 0;
+      serialcomm_daemon_output(d, i, &(r->frame));
+    }
+  }
+} // serialcomm_daemon_deliver
+
+/** \brief Fan-out thread: copies the new frames of the history to the clients */
+static void * serialcomm_daemon_fanout(void * d_v) {
+  SerialCommDaemon * d = (SerialCommDaemon*)d_v;
+  SerialCommRecord recs[SERIALCOMM_DAEMON_BATCH];
+  unsigned long last = serialcomm_frame_number(d->sc);
+
+  while (!atomic_load(&(d->exit))) {
+    pthread_mutex_lock(&(d->lock));
+    int wait_ms = d->heartbeat_ns ? SERIALCOMM_DAEMON_HEARTBEAT_MS : SERIALCOMM_DAEMON_IDLE_MS;
+    pthread_mutex_unlock(&(d->lock));
+    unsigned long frame = serialcomm_frame_wait(d->sc, last, wait_ms);
+
+    pthread_mutex_lock(&(d->lock));
+    if (frame) {
+      size_t n;
+      while ((n = serialcomm_read_history(d->sc, last, recs, SERIALCOMM_DAEMON_BATCH)) > 0) {
+        for (size_t k = 0; k < n; k++)
+          serialcomm_daemon_deliver(d, &(recs[k]));
+        last = recs[n - 1].seq;
+        if (n < SERIALCOMM_DAEMON_BATCH)
+          break;
+      }
+      d->heartbeat_ns = 0;
+    }
+    // The device did not answer the coalesced hearthbeat: asks again for the clients still waiting
+    uint64_t now = serialcomm_daemon_now();
+    if (d->heartbeat_ns && now - d->heartbeat_ns >= (uint64_t)SERIALCOMM_DAEMON_HEARTBEAT_MS * 1000000ULL) {
+      d->heartbeat_ns = now;
+      serialcomm_send(d->sc, cmdHearthbeat, 0.0f);
+    }
+    pthread_mutex_unlock(&(d->lock));
+  }
+  return NULL;
+} // serialcomm_daemon_fanout
+
+/** \brief State of a sequenced command of the connection */
+static SerialCommAckState serialcomm_daemon_ack_state(SerialComm * sc, uint16_t seq) {
+  pthread_mutex_lock(&(sc->ack_lock));
+  SerialCommAck * a = &(sc->acks[seq & SERIALCOMM_ACK_MASK]);
+  SerialCommAckState state = (a->seq == seq) ? a->state : SerialCommAckFailed;
+  pthread_mutex_unlock(&(sc->ack_lock));
+  return state;
+} // serialcomm_daemon_ack_state
+
+/** \brief Ack thread: acknowledges to the clients the commands the device acknowledged
+ *
+ * The forwarded commands are resolved in order. When the device does not answer,
+ * all the commands in flight are lost together: the client retransmits them, and
+ * they are forwarded again from the first one lost.
+ */
+static void * serialcomm_daemon_acker(void * d_v) {
+  SerialCommDaemon * d = (SerialCommDaemon*)d_v;
+  pthread_mutex_lock(&(d->lock));
+  while (1) {
+    while (d->ack_head == d->ack_tail && !atomic_load(&(d->exit)))
+      pthread_cond_wait(&(d->ack_cond), &(d->lock));
+    if (atomic_load(&(d->exit)))
+      break;
+
+    uint16_t seq = d->acks[d->ack_head % SERIALCOMM_ACK_WINDOW].seq;
+    pthread_mutex_unlock(&(d->lock));
+    serialcomm_wait_ack(d->sc, seq, SERIALCOMM_ACK_TIMEOUT_MS * (SERIALCOMM_ACK_RETRIES + 2), NULL);
+    pthread_mutex_lock(&(d->lock));
+
+    while (d->ack_head != d->ack_tail) {
+      SerialCommDaemonAck * a = &(d->acks[d->ack_head % SERIALCOMM_ACK_WINDOW]);
+      SerialCommAckState state = serialcomm_daemon_ack_state(d->sc, a->seq);
+      if (state == SerialCommAckPending)
+        break;
+      d->ack_head++;
+
+      SerialCommClient * c = d->clients[a->client];
+      if (!c || c->gen != a->gen || !c->seq_valid || c->seq_epoch != a->epoch)
+        continue;
+      if (state == SerialCommAckDone) {
+        c->seq_acked = a->client_seq;
+        serialcomm_daemon_ack(d, a->client, a->epoch, a->client_seq);
+      } else if ((int16_t)(c->seq_last - (uint16_t)(a->client_seq - 1)) > 0) {
+        c->seq_last = (uint16_t)(a->client_seq - 1);
+      }
+    }
+  }
+  pthread_mutex_unlock(&(d->lock));
+  return NULL;
+} // serialcomm_daemon_acker
+
+
+extern SerialCommDaemon * serialcomm_daemon_start(SerialComm * sc, const char * path) {
+  if (!sc || !path || strlen(path) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  SerialCommDaemon * d = (SerialCommDaemon*)calloc(1, sizeof(SerialCommDaemon));
+  if (!d)
+    return NULL;
+  d->sc = sc;
+  strcpy(d->path, path);
+  atomic_init(&(d->exit), 0);
+  pthread_mutex_init(&(d->lock), NULL);
+  pthread_cond_init(&(d->ack_cond), NULL);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // A socket left by a daemon that died is replaced: nobody accepts on it.
+  // The socket of a live daemon, or any other file, is kept
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int refused = (probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno == ECONNREFUSED);
+    int live = (probe >= 0 && !refused);
+    if (probe >= 0)
+      close(probe);
+    if (live) {
+      pthread_cond_destroy(&(d->ack_cond));
+      pthread_mutex_destroy(&(d->lock));
+      free(d);
+      errno = EADDRINUSE;
+      return NULL;
+    }
+    unlink(path);
+  }
+  d->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  d->epoll = epoll_create1(EPOLL_CLOEXEC);
+  d->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int bound = (d->listener >= 0 && bind(d->listener, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  int ok = bound && listen(d->listener, SOMAXCONN) == 0 && d->epoll >= 0 && d->wakeup >= 0;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u64 = SERIALCOMM_DAEMON_LISTEN;
+  ok = ok && epoll_ctl(d->epoll, EPOLL_CTL_ADD, d->listener, &ev) == 0;
+  ev.data.u64 = SERIALCOMM_DAEMON_WAKEUP;
+  ok = ok && epoll_ctl(d->epoll, EPOLL_CTL_ADD, d->wakeup, &ev) == 0;
+
+  int started = 0;
+  if (ok && pthread_create(&(d->io), NULL, serialcomm_daemon_io, (void*)d) == 0) {
+    started++;
+    if (pthread_create(&(d->fanout), NULL, serialcomm_daemon_fanout, (void*)d) == 0) {
+      started++;
+      if (pthread_create(&(d->acker), NULL, serialcomm_daemon_acker, (void*)d) == 0)
+        return d;
+    }
+  }
+
+  int err = errno;
+  atomic_store(&(d->exit), 1);
+  uint64_t one = 1;
+  if (started && write(d->wakeup, &one, sizeof(one)) == sizeof(one))
+    pthread_join(d->io, NULL);
+  if (started > 1)
+    pthread_join(d->fanout, NULL);
+  if (d->listener >= 0)
+    close(d->listener);
+  if (bound)
+    unlink(path);
+  if (d->epoll >= 0)
+    close(d->epoll);
+  if (d->wakeup >= 0)
+    close(d->wakeup);
+  pthread_cond_destroy(&(d->ack_cond));
+  pthread_mutex_destroy(&(d->lock));
+  free(d);
+  errno = err;
+  return NULL;
+} // serialcomm_daemon_start
+
+extern void serialcomm_daemon_stop(SerialCommDaemon * d) {
+  if (!d)
+    return;
+  atomic_store(&(d->exit), 1);
+  uint64_t one = 1;
+  if (write(d->wakeup, &one, sizeof(one)) == sizeof(one))
+    pthread_join(d->io, NULL);
+  pthread_mutex_lock(&(d->lock));
+  pthread_cond_broadcast(&(d->ack_cond));
+  pthread_mutex_unlock(&(d->lock));
+  pthread_join(d->acker, NULL);
+  pthread_join(d->fanout, NULL);
+
+  for (unsigned int i = 0; i < SERIALCOMM_DAEMON_MAX_CLIENTS; i++) {
+    if (d->clients[i]) {
+      close(d->clients[i]->fd);
+      free(d->clients[i]);
+    }
+  }
+  if (d->stream_ms)
+    serialcomm_stream(d->sc, 0);
+  close(d->listener);
+  unlink(d->path);
+  close(d->epoll);
+  close(d->wakeup);
+  pthread_cond_destroy(&(d->ack_cond));
+  pthread_mutex_destroy(&(d->lock));
+  free(d);
+} // serialcomm_daemon_stop
+
+extern size_t serialcomm_daemon_clients(SerialCommDaemon * d) {
+  pthread_mutex_lock(&(d->lock));
+  size_t count = d->count;
+  pthread_mutex_unlock(&(d->lock));
+  return count;
+} // serialcomm_daemon_clients
+
+extern unsigned long serialcomm_daemon_dropped(SerialCommDaemon * d) {
+  pthread_mutex_lock(&(d->lock));
+  unsigned long dropped = d->dropped;
+  pthread_mutex_unlock(&(d->lock));
+  return dropped;
+} // serialcomm_daemon_dropped
@@ -0,0 +1,90 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_DAEMON_H_
+#define LIBSERIALCOMM_DAEMON_H_
+
+/** \brief Multiplexer of a connection among local clients
+ *
+ * The daemon owns a connection and serves any number of clients on a
+ * Unix-domain stream socket. Towards each client it behaves as the remote
+ * device does on the serial line (messages.h), so a client is a normal
+ * connection opened on the "unix:<socket>" transport, and the whole library
+ * API works on it unchanged.
+ *
+ * The frames received from the device are read from the history by a fan-out
+ * thread, never by the listener, and copied to the clients without blocking:
+ * a client that does not drain its socket loses the frames that do not fit in
+ * its SERIALCOMM_DAEMON_BUFFER bytes of backlog, without delaying the others.
+ * Everything that only shapes the telemetry of a client is served by the
+ * daemon, without serial traffic:
+ *
+ *  - the signature and cmdProtocolVersion select the frame format of the
+ *    client (legacy or framed, whatever the device speaks)
+ *  - cmdHearthbeat requests are coalesced: a single request is sent to the
+ *    device for all the clients waiting a frame, none while it streams
+ *  - cmdStreamTelemetry sets the period of the client: the device streams at
+ *    the shortest period requested, and each client receives the frames at
+ *    its own period
+ *  - cmdCompactTelemetry is accepted and ignored (the socket is not the bottleneck)
+ *
+ * All the other commands are forwarded, in the order they are received, to
+ * serialcomm_send. The sequenced commands of a client are forwarded with
+ * serialcomm_send_acked, and acknowledged to the client when the device
+ * acknowledges them.
+ */
+
+#include "libserialcomm.h"
+
+#define SERIALCOMM_DAEMON_MAX_CLIENTS 64   /**< Maximum clients connected at once */
+#define SERIALCOMM_DAEMON_BUFFER 16384     /**< Backlog of each client, in bytes */
+#define SERIALCOMM_DAEMON_HEARTBEAT_MS 50  /**< A coalesced hearthbeat not answered in this time is sent again */
+
+typedef struct SerialCommDaemon SerialCommDaemon;
+
+/** \brief Starts serving a connection on a Unix-domain socket
+ *
+ * The connection must be synced and served (serialcomm_start_listener, or
+ * attached to a manager); it must stay open until serialcomm_daemon_stop.
+ * \param sc a pointer to the communication structure
+ * \param path path of the socket (the socket left by a daemon that died is replaced)
+ * \return the daemon, or NULL on error (errno is set, EADDRINUSE if a live daemon serves path)
+ */
+extern SerialCommDaemon * serialcomm_daemon_start(SerialComm * sc, const char * path);
+/** \brief Disconnects the clients, removes the socket and frees the daemon
+ *
+ * The telemetry stream started for the clients is stopped.
+ */
+extern void serialcomm_daemon_stop(SerialCommDaemon * d);
+/** \brief Number of clients connected */
+extern size_t serialcomm_daemon_clients(SerialCommDaemon * d);
+/** \brief Frames not delivered to clients that did not drain their socket */
+extern unsigned long serialcomm_daemon_dropped(SerialCommDaemon * d);
+
+#endif /* LIBSERIALCOMM_DAEMON_H_ */
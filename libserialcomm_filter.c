@@ -0,0 +1,235 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "libserialcomm_filter.h"
+
+/** \brief State of the filter of a field */
+typedef struct SerialCommFilterStage {
+  SerialCommFilterKind kind; /**< The filter */
+  float alpha; /**< Coefficient of the exponential moving average */
+  unsigned int window; /**< Samples in the ring (one more than the distance, for the derivative) */
+  unsigned int count; /**< Samples received, up to window */
+  unsigned int pos; /**< Slot of the next sample in the ring */
+  double sum; /**< Sum of the samples in the ring (moving average) */
+  float y; /**< Last filtered value */
+  float x[SERIALCOMM_FILTER_WINDOW + 1]; /**< Ring of the last samples */
+  uint64_t t[SERIALCOMM_FILTER_WINDOW + 1]; /**< Reception times of the samples (derivative) */
+  float sorted[SERIALCOMM_FILTER_WINDOW]; /**< The samples of the ring in order (median) */
+} SerialCommFilterStage;
+
+struct SerialCommFilter {
+  pthread_mutex_t lock; /**< Lock on the stages, held by the listener while filtering */
+  SerialCommFilterStage stage[SERIALCOMM_FILTER_FIELDS]; /**< Filter of each field */
+  unsigned int decimate; /**< Frames between two publications */
+  unsigned int skipped; /**< Frames filtered since the last publication */
+  atomic_ulong seq; /**< Seqlock on out: odd while the listener is writing */
+  SerialCommFiltered out; /**< Last filtered values published */
+};
+
+/** \brief Removes a sample from the sorted window of n samples */
+static void serialcomm_filter_sorted_remove(float * sorted, unsigned int n, float x) {
+  unsigned int k = 0;
+  while (k < n - 1 && sorted[k] != x)
+    k++;
+  memmove(sorted + k, sorted + k + 1, (n - 1 - k) * sizeof(float));
+} // serialcomm_filter_sorted_remove
+
+/** \brief Inserts a sample in the sorted window of n samples */
+static void serialcomm_filter_sorted_insert(float * sorted, unsigned int n, float x) {
+  unsigned int k = n;
+  while (k > 0 && sorted[k - 1] > x) {
+    sorted[k] = sorted[k - 1];
+    k--;
+  }
+  sorted[k] = x;
+} // serialcomm_filter_sorted_insert
+
+/** \brief Feeds a sample to a filter
+ * \return the filtered value
+ */
+static float serialcomm_filter_step(SerialCommFilterStage * s, float x, uint64_t t) {
+  float old = s->x[s->pos];
+  int full = (s->count == s->window);
+  if (s->kind >= SerialCommFilterMean) {
+    s->x[s->pos] = x;
+    s->t[s->pos] = t;
+    s->pos = (s->pos + 1) % s->window;
+    if (!full)
+      s->count++;
+  }
+
+  switch (s->kind) {
+    case SerialCommFilterEma:
+      s->y = s->count ? s->y + s->alpha * (x - s->y) : x;
+      s->count = 1;
+      break;
+    case SerialCommFilterMean:
+      s->sum += (double)x - (full ? (double)old : 0.0);
+      // The running sum is computed again once per window, so rounding errors never build up
+      if (s->pos == 0) {
+        s->sum = 0.0;
+        for (unsigned int k = 0; k < s->count; k++)
+          s->sum += (double)s->x[k];
+      }
+      s->y = (float)(s->sum / (double)s->count);
+      break;
+    case SerialCommFilterMedian: {
+      unsigned int n = s->count;
+      if (full)
+        serialcomm_filter_sorted_remove(s->sorted, n, old);
+      serialcomm_filter_sorted_insert(s->sorted, n - 1, x);
+      s->y = (n & 1) ? s->sorted[n / 2] : 0.5f * (s->sorted[n / 2 - 1] + s->sorted[n / 2]);
+      break;
+    }
+    case SerialCommFilterDerivative: {
+      // The oldest sample of the ring is the next one to be overwritten, or the first one
+      unsigned int first = (s->count == s->window) ? s->pos : 0;
+      uint64_t dt = t - s->t[first];
+      if (s->count > 1 && dt)
+        s->y = (x - s->x[first]) / (1e-9f * (float)dt);
+      break;
+    }
+    case SerialCommFilterNone:
+    default:
+      s->y = x;
+      break;
+  }
+  return s->y;
+} // serialcomm_filter_step
+
+/** \brief The filtering stage of the connection, created on first use */
+static SerialCommFilter * serialcomm_filter_get(SerialComm * sc) {
+  SerialCommFilter * f = atomic_load_explicit(&(sc->filter), memory_order_acquire);
+  if (f)
+    return f;
+
+  f = (SerialCommFilter*)calloc(1, sizeof(SerialCommFilter));
+  if (!f) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrAllocErr, sc);
+    return NULL;
+  }
+  pthread_mutex_init(&(f->lock), NULL);
+  f->decimate = 1;
+  atomic_init(&(f->seq), 0);
+
+  SerialCommFilter * none = NULL;
+  if (!atomic_compare_exchange_strong(&(sc->filter), &none, f)) {
+    // Created by another thread in the meanwhile
+    pthread_mutex_destroy(&(f->lock));
+    free(f);
+    return none;
+  }
+  return f;
+} // serialcomm_filter_get
+
+extern int serialcomm_filter_set(SerialComm * sc, DeltaField field, SerialCommFilterKind kind, float param) {
+  if (!sc || (int)field < 0 || field >= SERIALCOMM_FILTER_FIELDS ||
+      (int)kind < 0 || kind > SerialCommFilterDerivative)
+    return -1;
+  if (kind == SerialCommFilterEma && !(param > 0.0f && param <= 1.0f))
+    return -1;
+  if (kind >= SerialCommFilterMean && !(param >= 1.0f && param <= (float)SERIALCOMM_FILTER_WINDOW))
+    return -1;
+  SerialCommFilter * f = serialcomm_filter_get(sc);
+  if (!f)
+    return -1;
+
+  pthread_mutex_lock(&(f->lock));
+  SerialCommFilterStage * s = &(f->stage[field]);
+  memset(s, 0, sizeof(SerialCommFilterStage));
+  s->kind = kind;
+  if (kind == SerialCommFilterEma)
+    s->alpha = param;
+  else if (kind >= SerialCommFilterMean)
+    s->window = (unsigned int)param + (kind == SerialCommFilterDerivative ? 1 : 0);
+  pthread_mutex_unlock(&(f->lock));
+  return 0;
+} // serialcomm_filter_set
+
+extern void serialcomm_filter_decimate(SerialComm * sc, unsigned int n) {
+  if (!sc)
+    return;
+  SerialCommFilter * f = serialcomm_filter_get(sc);
+  if (!f)
+    return;
+  pthread_mutex_lock(&(f->lock));
+  f->decimate = n ? n : 1;
+  f->skipped = 0;
+  pthread_mutex_unlock(&(f->lock));
+} // serialcomm_filter_decimate
+
+extern void serialcomm_filter_frame(SerialComm * sc, const SerialCommRecord * r) {
+  SerialCommFilter * f = atomic_load_explicit(&(sc->filter), memory_order_acquire);
+  if (!f)
+    return;
+
+  // The float fields come first in output_s, in DeltaField order
+  float v[SERIALCOMM_FILTER_FIELDS];
+  memcpy(v, (const void*)&(r->frame), sizeof(v));
+  pthread_mutex_lock(&(f->lock));
+  for (int i = 0; i < SERIALCOMM_FILTER_FIELDS; i++)
+    v[i] = serialcomm_filter_step(&(f->stage[i]), v[i], r->time_ns);
+  int publish = (++(f->skipped) >= f->decimate);
+  if (publish)
+    f->skipped = 0;
+  pthread_mutex_unlock(&(f->lock));
+  if (!publish)
+    return;
+
+  unsigned long seq = atomic_load_explicit(&(f->seq), memory_order_relaxed);
+  atomic_store_explicit(&(f->seq), seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  f->out.seq = r->seq;
+  f->out.time_ns = r->time_ns;
+  memcpy(f->out.value, v, sizeof(v));
+  atomic_store_explicit(&(f->seq), seq + 2, memory_order_release);
+} // serialcomm_filter_frame
+
+extern unsigned long serialcomm_read_filtered(SerialComm * sc, SerialCommFiltered * out) {
+  SerialCommFilter * f = sc ? atomic_load_explicit(&(sc->filter), memory_order_acquire) : NULL;
+  if (!f || !out)
+    return 0;
+  unsigned long begin, end;
+  do {
+    begin = atomic_load_explicit(&(f->seq), memory_order_acquire);
+    memcpy((void*)out, (void*)&(f->out), sizeof(SerialCommFiltered));
+    atomic_thread_fence(memory_order_acquire);
+    end = atomic_load_explicit(&(f->seq), memory_order_relaxed);
+  } while ((begin & 1) || begin != end);
+  return out->seq;
+} // serialcomm_read_filtered
+
+extern void serialcomm_filter_free(SerialComm * sc) {
+  SerialCommFilter * f = atomic_exchange(&(sc->filter), NULL);
+  if (f) {
+    pthread_mutex_destroy(&(f->lock));
+    free(f);
+  }
+} // serialcomm_filter_free
@@ -0,0 +1,100 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_FILTER_H_
+#define LIBSERIALCOMM_FILTER_H_
+
+/** \brief Filtering stage of the received frames
+ *
+ * Each float field of output_s (indexed as DeltaField, from DeltaTMeas to
+ * DeltaMaxCycle) can be given a filter, that the listener updates on every
+ * valid frame, at the full frame rate:
+ *
+ *  - SerialCommFilterEma: exponential moving average, y += alpha * (x - y)
+ *  - SerialCommFilterMean: average of the last window samples (running sum)
+ *  - SerialCommFilterMedian: median of the last window samples (a sorted copy
+ *    of the window is kept, each sample costs one shift of at most window values)
+ *  - SerialCommFilterDerivative: slope per second between the last sample and
+ *    the one window samples before, on the reception times
+ *
+ * The state of each filter is fixed in size (at most SERIALCOMM_FILTER_WINDOW
+ * samples), and updated incrementally. The filtered values are published with
+ * a sequence lock, as the output: serialcomm_read_filtered never blocks the
+ * listener. With a decimation of n the values are published every n frames,
+ * the filters still see all of them.
+ */
+
+#include <stdint.h>
+#include "libserialcomm.h"
+
+#define SERIALCOMM_FILTER_FIELDS DeltaConfig /**< Float fields of output_s that can be filtered */
+#define SERIALCOMM_FILTER_WINDOW 32          /**< Longest window of the filters */
+
+/** \brief Filter of a field */
+typedef enum SerialCommFilterKind {
+  SerialCommFilterNone = 0, /**< The raw value */
+  SerialCommFilterEma,      /**< Exponential moving average, param is alpha (0, 1] */
+  SerialCommFilterMean,     /**< Moving average, param is the window (samples) */
+  SerialCommFilterMedian,   /**< Moving median, param is the window (samples) */
+  SerialCommFilterDerivative /**< Derivative (units per second), param is the distance of the samples */
+} SerialCommFilterKind;
+
+/** \brief Filtered values of a frame */
+typedef struct SerialCommFiltered {
+  unsigned long seq; /**< Number of the last frame filtered, 0 if none yet */
+  uint64_t time_ns; /**< CLOCK_MONOTONIC reception time of the frame */
+  float value[SERIALCOMM_FILTER_FIELDS]; /**< Filtered value of each field (DeltaField order) */
+} SerialCommFiltered;
+
+/** \brief Sets the filter of a field
+ *
+ * The state of the filter restarts from the next frame. The first call enables
+ * the filtering stage of the connection.
+ * \param sc a pointer to the communication structure
+ * \param field the field (DeltaTMeas ... DeltaMaxCycle)
+ * \param kind the filter
+ * \param param alpha for SerialCommFilterEma, the window (1 ... SERIALCOMM_FILTER_WINDOW) otherwise
+ * \return 0 on success, -1 on invalid arguments or allocation failure (SerialCommErrAllocErr is raised)
+ */
+extern int serialcomm_filter_set(SerialComm * sc, DeltaField field, SerialCommFilterKind kind, float param);
+/** \brief Publishes the filtered values every n frames (1 for all the frames) */
+extern void serialcomm_filter_decimate(SerialComm * sc, unsigned int n);
+/** \brief Reads a coherent copy of the last filtered values
+ *
+ * \param sc a pointer to the communication structure
+ * \param out destination of the copy
+ * \return the number of the last frame filtered (0 if the stage is not enabled, or no frame yet)
+ */
+extern unsigned long serialcomm_read_filtered(SerialComm * sc, SerialCommFiltered * out);
+/** \brief Called by the listener for each valid frame */
+extern void serialcomm_filter_frame(SerialComm * sc, const SerialCommRecord * r);
+/** \brief Frees the filtering stage (at close, after the listener stopped) */
+extern void serialcomm_filter_free(SerialComm * sc);
+
+#endif /* LIBSERIALCOMM_FILTER_H_ */
@@ -52,6 +52,9 @@ const char * SerialCommStateString[5] = {
   "System is in Serial Setup"
 };
 
+const int serialcomm_err_timeout = SerialCommErrTimeout;
+const int serialcomm_err_cannot_schedule = SerialCommErrCannotSchedule;
+
 int serialcomm_last_error = 0;
 void _serialcomm_update_last_error(SerialCommErr err, SerialComm *sc) {
   serialcomm_last_error = (int)err;
@@ -59,12 +62,35 @@ void _serialcomm_update_last_error(SerialCommErr err, SerialComm *sc) {
 }
 
 extern void *serialcomm_initialize(const char *port) {
-  void *sc_v = (void *)serialcomm_open(port, _serialcomm_update_last_error);
-  sleep(2);
-  serialcomm_sync((SerialComm *)sc_v);
-  sleep(1);
-  serialcomm_start_listener((SerialComm *)sc_v);
-  return sc_v;
+  return serialcomm_initialize_timeout(port, SERIALCOMM_CONNECT_TIMEOUT_MS);
+}
+
+extern void *serialcomm_initialize_timeout(const char *port, int timeout_ms) {
+  return serialcomm_initialize_ex(port, 0, 0, 0, 0, 0, timeout_ms);
+}
+
+extern void *serialcomm_initialize_ex(const char *port, unsigned int baud, int low_latency,
+                                      int rt_priority, unsigned long cpu_mask, int protocol,
+                                      int timeout_ms) {
+  SerialCommOptions opt;
+  memset(&opt, 0, sizeof(opt));
+  opt.baud = baud;
+  opt.low_latency = low_latency;
+  opt.rt_priority = rt_priority;
+  opt.cpu_mask = cpu_mask;
+  opt.protocol = (SerialCommProtocol)protocol;
+  serialcomm_last_error = 0;
+  SerialComm *sc = serialcomm_open_ex(port, &opt, _serialcomm_update_last_error);
+  if (!sc)
+    return NULL;
+  serialcomm_sync(sc);
+  serialcomm_start_listener(sc);
+  if (!sc->listener_running || serialcomm_handshake(sc, timeout_ms) < 0) {
+    // The error raised tells why (SerialCommErrTimeout if the device did not answer)
+    serialcomm_close(sc);
+    return NULL;
+  }
+  return (void *)sc;
 }
 
 extern void serialcomm_destroy(void *sc) { 
@@ -79,136 +105,322 @@ extern void serialcomm_update(void *sc) {
   serialcomm_send((SerialComm *)sc, cmdHearthbeat, 0.0);
 }
 
-extern float serialcomm_get_t_meas(void *sc) { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.t_meas; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern long serialcomm_update_wait(void *sc, int timeout_ms) {
+  // A frame that is being published now was received before the request
+  unsigned long last = (atomic_load(&(((SerialComm *)sc)->output_seq)) + 1) >> 1;
+  serialcomm_update(sc);
+  unsigned long frame = serialcomm_wait_frame((SerialComm *)sc, last, timeout_ms);
+  return frame ? (long)frame : -1;
+}
+
+extern void serialcomm_stream_start(void *sc, unsigned int period_ms) {
+  serialcomm_stream((SerialComm *)sc, period_ms);
+}
+
+extern void serialcomm_stream_stop(void *sc) {
+  serialcomm_stream((SerialComm *)sc, 0);
+}
+
+extern void serialcomm_compact_telemetry(void *sc, unsigned int key_interval) {
+  serialcomm_compact((SerialComm *)sc, key_interval);
+}
+
+extern long serialcomm_send_command_acked(void *sc, int cmd, float value) {
+  return serialcomm_send_acked((SerialComm *)sc, (CommandCode)cmd, value);
+}
+
+extern double serialcomm_wait_command_ack(void *sc, long seq, int timeout_ms) {
+  uint64_t latency_ns;
+  if (seq < 0 || serialcomm_wait_ack((SerialComm *)sc, (unsigned int)seq, timeout_ms, &latency_ns) < 0)
+    return -1.0;
+  return 1e-9 * (double)latency_ns;
+}
+
+extern unsigned long serialcomm_get_stream_missed(void *sc) {
+  return atomic_load_explicit(&(((SerialComm *)sc)->stream_missed), memory_order_relaxed);
+}
+
+extern unsigned long serialcomm_get_stream_duplicated(void *sc) {
+  return atomic_load_explicit(&(((SerialComm *)sc)->stream_duplicated), memory_order_relaxed);
+}
+
+extern double serialcomm_get_listener_cpu_time(void *sc) {
+  return serialcomm_listener_cpu_time((SerialComm *)sc);
+}
+
+extern unsigned long serialcomm_get_resync_count(void *sc) {
+  return atomic_load_explicit(&(((SerialComm *)sc)->rx_resyncs), memory_order_relaxed);
+}
+
+extern unsigned long serialcomm_get_discarded_bytes(void *sc) {
+  return atomic_load_explicit(&(((SerialComm *)sc)->rx_discarded), memory_order_relaxed);
+}
+
+extern int serialcomm_get_protocol(void *sc) {
+  return (int)serialcomm_protocol((SerialComm *)sc);
+}
+
+extern void serialcomm_stats_read(void *sc, SerialCommStats *stats) {
+  serialcomm_get_stats((SerialComm *)sc, stats);
+}
+
+/** \brief Coherent copy of the last frame, without locks */
+static output_s serialcomm_snapshot(void *sc) {
+  output_s out;
+  serialcomm_read_output((SerialComm *)sc, &out);
+  return out;
+}
+
+extern unsigned long serialcomm_get_snapshot(void *sc, output_s *out) {
+  return serialcomm_read_output((SerialComm *)sc, out);
+}
+
+extern long serialcomm_update_snapshot(void *sc, int timeout_ms, output_s *out) {
+  if (serialcomm_update_wait(sc, timeout_ms) < 0)
+    return -1;
+  return (long)serialcomm_read_output((SerialComm *)sc, out);
+}
+
+extern unsigned long serialcomm_wait_snapshot(void *sc, unsigned long after, int timeout_ms, output_s *out) {
+  if (!serialcomm_wait_frame((SerialComm *)sc, after, timeout_ms))
+    return 0;
+  return serialcomm_read_output((SerialComm *)sc, out);
+}
+
+extern unsigned long serialcomm_history_read(void *sc, unsigned long since_seq, SerialCommRecord *buf, unsigned long n) {
+  return serialcomm_read_history((SerialComm *)sc, since_seq, buf, n);
+}
+
+extern int serialcomm_recorder_start(void *sc, const char *path, unsigned long max_bytes) {
+  return serialcomm_record_start((SerialComm *)sc, path, (size_t)max_bytes);
+}
+
+extern void serialcomm_recorder_stop(void *sc) {
+  serialcomm_record_stop((SerialComm *)sc);
+}
+
+extern int serialcomm_archive_record(void *sc, const char *path) {
+  return serialcomm_archive_start((SerialComm *)sc, path);
+}
+
+extern void serialcomm_archive_record_stop(void *sc) {
+  serialcomm_archive_stop((SerialComm *)sc);
+}
+
+extern void *serialcomm_archive_reader_open(const char *path) {
+  return (void *)serialcomm_archive_load(path);
+}
+
+extern void serialcomm_archive_reader_close(void *rd) {
+  serialcomm_archive_unload((SerialCommArchiveReader *)rd);
+}
+
+extern unsigned long serialcomm_archive_reader_frames(void *rd) {
+  return (unsigned long)serialcomm_archive_frames((SerialCommArchiveReader *)rd);
+}
+
+extern int serialcomm_archive_reader_seek_cycle(void *rd, unsigned long cycle) {
+  return serialcomm_archive_seek_cycle((SerialCommArchiveReader *)rd, cycle);
+}
+
+extern int serialcomm_archive_reader_seek_time(void *rd, uint64_t time_ns) {
+  return serialcomm_archive_seek_time((SerialCommArchiveReader *)rd, time_ns);
+}
+
+extern unsigned long serialcomm_archive_reader_read(void *rd, SerialCommRecord *buf, unsigned long n) {
+  return serialcomm_archive_read((SerialCommArchiveReader *)rd, buf, n);
 }
 
-extern float serialcomm_get_p_meas(void *sc) { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.p_meas; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern int serialcomm_bus_publish(void *sc) {
+  return serialcomm_bus_start((SerialComm *)sc);
 }
 
-extern float serialcomm_get_q_meas(void *sc)  { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.q_meas; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern void serialcomm_bus_unpublish(void *sc) {
+  serialcomm_bus_stop((SerialComm *)sc);
 }
 
-extern float serialcomm_get_ki(void *sc) { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.ki; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern int serialcomm_bus_published_port(void *sc, char *port, unsigned long len) {
+  return serialcomm_bus_port((SerialComm *)sc, port, (size_t)len);
 }
 
-extern float serialcomm_get_kp(void *sc) { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.kp; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern void *serialcomm_bus_reader_open(const char *port) {
+  return (void *)serialcomm_bus_attach(port);
 }
 
-extern float serialcomm_get_t_set(void *sc) { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.t_set; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern void serialcomm_bus_reader_close(void *rd) {
+  serialcomm_bus_detach((SerialCommBusReader *)rd);
 }
 
-extern float serialcomm_get_p_set(void *sc) { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.p_set; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern unsigned long serialcomm_bus_reader_wait_snapshot(void *rd, unsigned long after, int timeout_ms, output_s *out) {
+  SerialCommBusReader * r = (SerialCommBusReader *)rd;
+  if (!r || !out)
+    return 0;
+  if (serialcomm_bus_wait(r, after, timeout_ms) == 0)
+    return 0;
+  return serialcomm_bus_latest(r, out);
 }
 
-extern float serialcomm_get_u_pres(void *sc) { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.u_pres; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern unsigned long serialcomm_bus_reader_history(void *rd, unsigned long since_seq, SerialCommRecord *buf, unsigned long n) {
+  return serialcomm_bus_read((SerialCommBusReader *)rd, since_seq, buf, n);
 }
 
-extern float serialcomm_get_period(void *sc) { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.period; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern int serialcomm_bus_reader_closed(void *rd) {
+  return serialcomm_bus_closed((SerialCommBusReader *)rd);
 }
 
-extern float serialcomm_get_duty_cycle(void *sc)  { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.duty_cycle; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern int serialcomm_filter_field(void *sc, int field, int kind, float param) {
+  return serialcomm_filter_set((SerialComm *)sc, (DeltaField)field, (SerialCommFilterKind)kind, param);
 }
 
-extern float serialcomm_get_cycle(void *sc)  { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.cycle; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern void serialcomm_filter_decimation(void *sc, unsigned int n) {
+  serialcomm_filter_decimate((SerialComm *)sc, n);
 }
 
-extern float serialcomm_get_cycle_max(void *sc) { 
-  float v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = ((SerialComm *)sc)->output.s.max_cycle; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern unsigned long serialcomm_filtered_read(void *sc, SerialCommFiltered *out) {
+  return serialcomm_read_filtered((SerialComm *)sc, out);
 }
 
-extern int serialcomm_get_actuator_config(void *sc) { 
-  int v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = (int)((SerialComm *)sc)->output.s.config & CtrlEnPActuator; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern int serialcomm_cycles_track(void *sc, int on) {
+  return serialcomm_cycles_enable((SerialComm *)sc, on);
 }
 
-extern int serialcomm_get_chiller_config(void *sc) { 
-  int v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = (int)((SerialComm *)sc)->output.s.config & CtrlEnChiller; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern unsigned long serialcomm_cycles_take(void *sc, SerialCommCycle *buf, unsigned long n) {
+  return serialcomm_cycles_pop((SerialComm *)sc, buf, n);
 }
 
-extern int serialcomm_get_resistance_config(void *sc) { 
-  int v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = (int)((SerialComm *)sc)->output.s.config & CtrlEnResistance; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern unsigned long serialcomm_get_cycles_dropped(void *sc) {
+  return serialcomm_cycles_dropped((SerialComm *)sc);
 }
 
-extern int serialcomm_get_state(void *sc) { 
-  int v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = (int)((SerialComm *)sc)->output.s.state; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern int serialcomm_replay_finished(void *sc) {
+  return serialcomm_replay_done((SerialComm *)sc);
+}
+
+extern double serialcomm_get_replay_rate(void *sc) {
+  return serialcomm_replay_rate((SerialComm *)sc);
+}
+
+extern void *serialcomm_manager_new(unsigned int threads) {
+  return (void *)serialcomm_manager_create(threads);
+}
+
+extern void serialcomm_manager_free(void *mgr) {
+  SerialCommManager *m = (SerialCommManager *)mgr;
+  SerialComm *sc;
+  while ((sc = serialcomm_manager_device(m, 0))) {
+    serialcomm_manager_detach(m, sc);
+    serialcomm_close(sc);
+  }
+  serialcomm_manager_destroy(m);
+}
+
+extern void *serialcomm_manager_add(void *mgr, const char *port, unsigned int group) {
+  SerialComm *sc = serialcomm_open(port, _serialcomm_update_last_error);
+  if (!sc)
+    return NULL;
+  serialcomm_sync(sc);
+  if (serialcomm_manager_attach((SerialCommManager *)mgr, sc, group) < 0) {
+    serialcomm_close(sc);
+    return NULL;
+  }
+  if (serialcomm_handshake(sc, SERIALCOMM_CONNECT_TIMEOUT_MS) < 0) {
+    // As serialcomm_initialize_ex: a device that does not answer is not returned
+    serialcomm_manager_detach((SerialCommManager *)mgr, sc);
+    serialcomm_close(sc);
+    return NULL;
+  }
+  return (void *)sc;
+}
+
+extern void serialcomm_manager_remove(void *mgr, void *sc) {
+  if (serialcomm_manager_detach((SerialCommManager *)mgr, (SerialComm *)sc) == 0)
+    serialcomm_close((SerialComm *)sc);
+}
+
+extern unsigned long serialcomm_manager_send_group(void *mgr, unsigned int group, int cmd, float value) {
+  return serialcomm_manager_send((SerialCommManager *)mgr, group, (CommandCode)cmd, value);
+}
+
+extern int serialcomm_manager_online(void *mgr, void *sc) {
+  SerialCommDeviceInfo info;
+  if (serialcomm_manager_info((SerialCommManager *)mgr, (SerialComm *)sc, &info) < 0)
+    return 0;
+  return info.online;
+}
+
+extern double serialcomm_manager_get_cpu_time(void *mgr) {
+  return serialcomm_manager_cpu_time((SerialCommManager *)mgr);
+}
+
+extern float serialcomm_get_t_meas(void *sc) {
+  return serialcomm_snapshot(sc).t_meas;
+}
+
+extern float serialcomm_get_p_meas(void *sc) {
+  return serialcomm_snapshot(sc).p_meas;
+}
+
+extern float serialcomm_get_q_meas(void *sc) {
+  return serialcomm_snapshot(sc).q_meas;
+}
+
+extern float serialcomm_get_ki(void *sc) {
+  return serialcomm_snapshot(sc).ki;
+}
+
+extern float serialcomm_get_kp(void *sc) {
+  return serialcomm_snapshot(sc).kp;
+}
+
+extern float serialcomm_get_t_set(void *sc) {
+  return serialcomm_snapshot(sc).t_set;
+}
+
+extern float serialcomm_get_p_set(void *sc) {
+  return serialcomm_snapshot(sc).p_set;
+}
+
+extern float serialcomm_get_u_pres(void *sc) {
+  return serialcomm_snapshot(sc).u_pres;
+}
+
+extern float serialcomm_get_period(void *sc) {
+  return serialcomm_snapshot(sc).period;
+}
+
+extern float serialcomm_get_duty_cycle(void *sc) {
+  return serialcomm_snapshot(sc).duty_cycle;
+}
+
+extern float serialcomm_get_cycle(void *sc) {
+  return serialcomm_snapshot(sc).cycle;
+}
+
+extern float serialcomm_get_cycle_max(void *sc) {
+  return serialcomm_snapshot(sc).max_cycle;
+}
+
+extern int serialcomm_get_actuator_config(void *sc) {
+  return (int)serialcomm_snapshot(sc).config & CtrlEnPActuator;
+}
+
+extern int serialcomm_get_chiller_config(void *sc) {
+  return (int)serialcomm_snapshot(sc).config & CtrlEnChiller;
+}
+
+extern int serialcomm_get_resistance_config(void *sc) {
+  return (int)serialcomm_snapshot(sc).config & CtrlEnResistance;
+}
+
+extern int serialcomm_get_state(void *sc) {
+  return (int)serialcomm_snapshot(sc).state;
 }
 
 extern const char * serialcomm_get_state_string(void *sc) { 
-  int st = serialcomm_get_state(sc);
+  return serialcomm_state_string(serialcomm_get_state(sc));
+}
+
+extern const char * serialcomm_state_string(int st) {
   switch(st) {
     case StateAlarm:
       return SerialCommStateString[0];
@@ -229,17 +441,18 @@ extern const char * serialcomm_get_state_string(void *sc) {
   }
 }
 
-extern int serialcomm_get_error(void *sc) { 
-  int v;
-  pthread_mutex_lock(&(((SerialComm *)sc)->output_lock));
-  v = (int)((SerialComm *)sc)->output.s.error; 
-  pthread_mutex_unlock(&(((SerialComm *)sc)->output_lock));
-  return v;
+extern int serialcomm_get_error(void *sc) {
+  return (int)serialcomm_snapshot(sc).error;
 }
 
 extern const char *serialcomm_get_error_string(void *sc) {
-  char e = serialcomm_get_error(sc);
-  return SerialCommErrString[(size_t)e];
+  return serialcomm_error_string(serialcomm_get_error(sc));
+}
+
+extern const char *serialcomm_error_string(int err) {
+  if (err < 0 || err >= ErrMessageCount)
+    return SerialCommErrString[ErrMsgSerialCheck];
+  return SerialCommErrString[(size_t)err];
 }
 
 extern void serialcomm_set_temp(void *sc, float value) {
@@ -42,14 +42,42 @@
  */
 
 #include "libserialcomm.h"
+#include "libserialcomm_archive.h"
+#include "libserialcomm_bus.h"
+#include "libserialcomm_cycle.h"
+#include "libserialcomm_filter.h"
+#include "libserialcomm_recorder.h"
+#include "libserialcomm_replay.h"
+#include "libserialcomm_manager.h"
 #include "messages.h"
 
 /** \brief Launches the connection on the serial port
  *
+ * The port can also be a replay source, "replay:<file>[@<speed>]", that plays
+ * back a recorded session (see libserialcomm_replay.h).
+ * The function returns as soon as the device answers (see serialcomm_handshake).
+ * If the port cannot be opened, or the device does not answer in
+ * SERIALCOMM_CONNECT_TIMEOUT_MS, the connection is closed and NULL is returned:
+ * serialcomm_check_errors then tells the reason (SerialCommErrTimeout for no
+ * answer). The error is reset at the start of each call.
  * \param port the serial port string
- * \return a pointer for preserving the state of the serial port
+ * \return a pointer for preserving the state of the serial port, or NULL
  */
 extern void *serialcomm_initialize(const char *port);
+/** \brief As serialcomm_initialize, waiting the device answer up to timeout_ms */
+extern void *serialcomm_initialize_timeout(const char *port, int timeout_ms);
+/** \brief As serialcomm_initialize_timeout, with the options of serialcomm_open_ex
+ *
+ * \param baud line speed (0 for the default)
+ * \param low_latency requests the low latency mode of the serial driver
+ * \param rt_priority SCHED_FIFO priority of the listener and writer (0 for normal scheduling)
+ * \param cpu_mask CPUs of the listener and writer (0 for all)
+ * \param protocol 0 or 1 for the legacy protocol, 2 for the framed one, 3 to request the
+ *        framed one and follow the device answer (see SerialCommProtocol)
+ */
+extern void *serialcomm_initialize_ex(const char *port, unsigned int baud, int low_latency,
+                                      int rt_priority, unsigned long cpu_mask, int protocol,
+                                      int timeout_ms);
 /** \brief Closes the connection and detaches the listener
  *
  * \param sc pointer to memory that saves the state of the serial port
@@ -61,6 +89,9 @@ extern void serialcomm_destroy(void *sc);
  * thus it do not depend on the serial port opened.
  */
 extern int serialcomm_check_errors(void);
+/** \brief Values of SerialCommErrTimeout and SerialCommErrCannotSchedule, for the bindings */
+extern const int serialcomm_err_timeout;
+extern const int serialcomm_err_cannot_schedule;
 /** \brief Request an update from the remote endpoint
  *
  * The remote sends an update for the state only when requested
@@ -68,6 +99,230 @@ extern int serialcomm_check_errors(void);
  * \param sc pointer to memory that saves the state of the serial port.
  */
 extern void serialcomm_update(void *sc);
+/** \brief Request an update and waits for the answer of the remote endpoint
+ *
+ * Sends an hearthbeat, then blocks until the first frame received after
+ * the request, instead of sleeping for a guessed time.
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param timeout_ms maximum waiting time in milliseconds
+ * \return the number of the received frame, or -1 on timeout
+ */
+extern long serialcomm_update_wait(void *sc, int timeout_ms);
+/** \brief Asks the remote endpoint to stream its state
+ *
+ * The remote sends an update every period_ms milliseconds, without
+ * hearthbeats. Use serialcomm_stream_stop to return to requested updates.
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param period_ms period of the updates in milliseconds
+ */
+extern void serialcomm_stream_start(void *sc, unsigned int period_ms);
+extern void serialcomm_stream_stop(void *sc);
+/** \brief Streamed updates missed and received twice since the port was opened */
+extern unsigned long serialcomm_get_stream_missed(void *sc);
+extern unsigned long serialcomm_get_stream_duplicated(void *sc);
+/** \brief Asks the remote endpoint for the compact telemetry (framed protocol only)
+ *
+ * Only the changed fields are sent, with a full update every key_interval updates
+ * (0 returns to full updates). Measurements are rounded to 0.01.
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param key_interval updates between two full updates
+ */
+extern void serialcomm_compact_telemetry(void *sc, unsigned int key_interval);
+/** \brief Sends a command acknowledged by the remote endpoint (framed protocol only)
+ *
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param cmd command code (CommandCode of messages.h)
+ * \param value value of the command
+ * \return the sequence number, -1 if the command is sent without acknowledgement
+ */
+extern long serialcomm_send_command_acked(void *sc, int cmd, float value);
+/** \brief Waits for the acknowledgement of a command, and of all the previous ones
+ *
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param seq sequence number returned by serialcomm_send_command_acked
+ * \param timeout_ms maximum waiting time in milliseconds
+ * \return the acknowledgement latency in seconds, or -1.0 if the command has been lost
+ */
+extern double serialcomm_wait_command_ack(void *sc, long seq, int timeout_ms);
+/** \brief CPU time (in seconds) consumed by the listener thread
+ *
+ * \param sc pointer to memory that saves the state of the serial port.
+ */
+extern double serialcomm_get_listener_cpu_time(void *sc);
+/** \brief Number of times the receiver lost and searched again the frame alignment
+ *
+ * \param sc pointer to memory that saves the state of the serial port.
+ */
+extern unsigned long serialcomm_get_resync_count(void *sc);
+/** \brief Number of received bytes discarded while searching the frame alignment
+ *
+ * \param sc pointer to memory that saves the state of the serial port.
+ */
+extern unsigned long serialcomm_get_discarded_bytes(void *sc);
+/** \brief Protocol spoken by the device: 1 legacy, 2 framed, 0 not known yet
+ *
+ * \param sc pointer to memory that saves the state of the serial port.
+ */
+extern int serialcomm_get_protocol(void *sc);
+/** \brief Copies the counters and latency histograms of the connection
+ *
+ * Bytes and frames in and out, checksum failures, resyncs, dropped commands, and
+ * the hearthbeat and acknowledgement latencies (see SerialCommStats). The
+ * quantiles of a histogram are given by serialcomm_histogram_quantile.
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param stats destination of the copy
+ */
+extern void serialcomm_stats_read(void *sc, SerialCommStats *stats);
+
+/** \brief Copies the whole last frame received, in a single coherent read
+ *
+ * All the fields belong to the same frame. The read is lock free and never
+ * blocks the listener.
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param out the structure that receives the copy of the frame
+ * \return the number of the frame copied (0 if no frame has been received yet)
+ */
+extern unsigned long serialcomm_get_snapshot(void *sc, output_s *out);
+/** \brief Requests an update and copies it, as serialcomm_update_wait followed by serialcomm_get_snapshot
+ *
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param timeout_ms maximum waiting time in milliseconds
+ * \param out the structure that receives the copy of the frame
+ * \return the number of the frame copied, or -1 on timeout (out is not changed)
+ */
+extern long serialcomm_update_snapshot(void *sc, int timeout_ms, output_s *out);
+/** \brief Waits for a frame newer than after (e.g. from the stream) and copies it
+ *
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param after number of the last frame already known by the caller
+ * \param timeout_ms maximum waiting time in milliseconds
+ * \param out the structure that receives the copy of the frame
+ * \return the number of the frame copied, or 0 on timeout (out is not changed)
+ */
+extern unsigned long serialcomm_wait_snapshot(void *sc, unsigned long after, int timeout_ms, output_s *out);
+/** \brief Copies the frames received after since_seq, with their reception time
+ *
+ * The last SERIALCOMM_HISTORY_SIZE frames are kept by the library, each with its
+ * number and CLOCK_MONOTONIC reception time, so no frame is lost between two
+ * calls if the caller reads at least once every SERIALCOMM_HISTORY_SIZE frames.
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param since_seq number of the last frame already read (0 for all the history)
+ * \param buf destination array of at least n records
+ * \param n maximum number of records to copy
+ * \return the number of records copied
+ */
+extern unsigned long serialcomm_history_read(void *sc, unsigned long since_seq, SerialCommRecord *buf, unsigned long n);
+/** \brief Records all the received frames in binary log files
+ *
+ * Each frame is appended, with its number and reception time, to a memory-mapped
+ * file named path.0000; when the file reaches max_bytes the next one (path.0001,
+ * ...) is started. See libserialcomm_recorder.h for the file format.
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param path base name of the log files
+ * \param max_bytes size of each log file
+ * \return 0 on success, -1 on error
+ */
+extern int serialcomm_recorder_start(void *sc, const char *path, unsigned long max_bytes);
+extern void serialcomm_recorder_stop(void *sc);
+/** \brief Archives all the received frames in a compressed columnar file
+ *
+ * The frames are compressed column by column, in chunks indexed by cycle and
+ * reception time (see libserialcomm_archive.h). The archive is complete once
+ * serialcomm_archive_record_stop (or serialcomm_destroy) is called.
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \param path name of the archive file
+ * \return 0 on success, -1 on error
+ */
+extern int serialcomm_archive_record(void *sc, const char *path);
+extern void serialcomm_archive_record_stop(void *sc);
+/** \brief Reader of an archive
+ *
+ * serialcomm_archive_reader_open returns NULL if the file is not an archive.
+ * serialcomm_archive_reader_seek_cycle and serialcomm_archive_reader_seek_time
+ * move to the first frame of a cycle or received from a time, with a search in
+ * the index (0 on success, -1 past the end); serialcomm_archive_reader_read
+ * copies the next n frames at most, and returns their number.
+ */
+extern void *serialcomm_archive_reader_open(const char *path);
+extern void serialcomm_archive_reader_close(void *rd);
+extern unsigned long serialcomm_archive_reader_frames(void *rd);
+extern int serialcomm_archive_reader_seek_cycle(void *rd, unsigned long cycle);
+extern int serialcomm_archive_reader_seek_time(void *rd, uint64_t time_ns);
+extern unsigned long serialcomm_archive_reader_read(void *rd, SerialCommRecord *buf, unsigned long n);
+/** \brief Publishes all the received frames to the other local processes
+ *
+ * The frames are written in a shared memory ring named after the port (see
+ * libserialcomm_bus.h), where any number of processes read them with the
+ * serialcomm_bus_reader functions, without touching the serial line.
+ * \param sc pointer to memory that saves the state of the serial port.
+ * \return 0 on success, -1 on error
+ */
+extern int serialcomm_bus_publish(void *sc);
+extern void serialcomm_bus_unpublish(void *sc);
+/** \brief Port name to open a reader on, 0 on success, -1 if not published (see serialcomm_bus_port) */
+extern int serialcomm_bus_published_port(void *sc, char *port, unsigned long len);
+/** \brief Reader of the frames published by another process on a port
+ *
+ * serialcomm_bus_reader_open returns NULL if the port is not published.
+ * serialcomm_bus_reader_wait_snapshot and serialcomm_bus_reader_history work as
+ * serialcomm_wait_snapshot and serialcomm_history_read on the published frames;
+ * serialcomm_bus_reader_closed returns 1 once the publisher has stopped, and the
+ * reader must be opened again.
+ */
+extern void *serialcomm_bus_reader_open(const char *port);
+extern void serialcomm_bus_reader_close(void *rd);
+extern unsigned long serialcomm_bus_reader_wait_snapshot(void *rd, unsigned long after, int timeout_ms, output_s *out);
+extern unsigned long serialcomm_bus_reader_history(void *rd, unsigned long since_seq, SerialCommRecord *buf, unsigned long n);
+extern int serialcomm_bus_reader_closed(void *rd);
+/** \brief Filters the fields of the received frames in the listener
+ *
+ * serialcomm_filter_field sets the filter of a field (DeltaField index) with a
+ * SerialCommFilterKind and its parameter (alpha for the EMA, the window in
+ * samples otherwise), returns 0 or -1 on invalid arguments.
+ * serialcomm_filter_decimation publishes the filtered values every n frames,
+ * serialcomm_filtered_read copies the last ones and returns their frame number
+ * (see libserialcomm_filter.h).
+ */
+extern int serialcomm_filter_field(void *sc, int field, int kind, float param);
+extern void serialcomm_filter_decimation(void *sc, unsigned int n);
+extern unsigned long serialcomm_filtered_read(void *sc, SerialCommFiltered *out);
+/** \brief Aggregates of each pressure cycle, computed by the listener
+ *
+ * serialcomm_cycles_track starts (on = 1) or stops the tracking of the cycle
+ * field, serialcomm_cycles_take moves the completed cycles from the queue to
+ * buf and returns their number, serialcomm_get_cycles_dropped counts the
+ * records lost with the queue full (see libserialcomm_cycle.h).
+ */
+extern int serialcomm_cycles_track(void *sc, int on);
+extern unsigned long serialcomm_cycles_take(void *sc, SerialCommCycle *buf, unsigned long n);
+extern unsigned long serialcomm_get_cycles_dropped(void *sc);
+/** \brief Replay state, when the port is a replay source
+ *
+ * serialcomm_replay_finished returns 1 once the whole recorded session has been
+ * played, serialcomm_get_replay_rate the frames per second received.
+ */
+extern int serialcomm_replay_finished(void *sc);
+extern double serialcomm_get_replay_rate(void *sc);
+/** \brief Device manager: many connections served by a pool of I/O threads
+ *
+ * serialcomm_manager_add opens and syncs the port as serialcomm_initialize, and
+ * attaches it to the manager in place of its own listener (NULL if the device
+ * does not answer to the handshake); the returned pointer
+ * works with all the other functions, but must be closed with
+ * serialcomm_manager_remove. serialcomm_manager_send_group sends a command to
+ * all the devices of a group (SERIALCOMM_GROUP_ALL for all) and returns their
+ * number. serialcomm_manager_free closes the devices still attached.
+ */
+extern void *serialcomm_manager_new(unsigned int threads);
+extern void serialcomm_manager_free(void *mgr);
+extern void *serialcomm_manager_add(void *mgr, const char *port, unsigned int group);
+extern void serialcomm_manager_remove(void *mgr, void *sc);
+extern unsigned long serialcomm_manager_send_group(void *mgr, unsigned int group, int cmd, float value);
+extern int serialcomm_manager_online(void *mgr, void *sc);
+extern double serialcomm_manager_get_cpu_time(void *mgr);
+/** \brief Description strings for state and error codes of a frame */
+extern const char *serialcomm_state_string(int state);
+extern const char *serialcomm_error_string(int err);
 
 /** \brief Receiving information function (to run after an update) */
 extern float serialcomm_get_t_meas(void *sc);
@@ -0,0 +1,468 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "libserialcomm_manager.h"
+#include "libserialcomm_transport.h"
+
+#define SERIALCOMM_MANAGER_EVENTS 64 /**< Events handled for each epoll_wait() */
+
+/* The epoll events carry the id of the device, never its address: an event
+ * collected before a detach finds no device, instead of a freed one. The lowest
+ * bit tells the writer wakeup event from the serial descriptor, and 0 is the
+ * wakeup of the loop itself. */
+#define SERIALCOMM_WATCH_RX(id) ((id) << 1)
+#define SERIALCOMM_WATCH_TX(id) (((id) << 1) | 1)
+
+/** \brief A device attached to the manager */
+typedef struct SerialCommDevice {
+  SerialComm * sc; /**< The connection */
+  uint64_t id; /**< Identifier of the device in the epoll events, never reused */
+  unsigned int group; /**< Group of the device */
+  unsigned int thread; /**< Index of the I/O thread */
+  int online; /**< The descriptors are in the epoll set */
+  int writing; /**< The serial descriptor is watched for EPOLLOUT, with commands left to write */
+} SerialCommDevice;
+
+/** \brief An I/O thread with its epoll set */
+typedef struct SerialCommLoop {
+  int epoll; /**< The epoll set */
+  int wakeup; /**< Event used to stop the thread */
+  pthread_t thread; /**< The I/O thread */
+  char running; /**< The thread has been started and must be joined */
+  atomic_int exit; /**< Request for quit the thread */
+  double cpu; /**< CPU time (s) consumed by the thread, stored at its exit */
+  pthread_mutex_t lock; /**< Held by the thread while it handles the events */
+  SerialCommDevice * devices[SERIALCOMM_MANAGER_MAX_DEVICES]; /**< Devices served */
+  size_t count; /**< Number of devices served */
+} SerialCommLoop;
+
+struct SerialCommManager {
+  SerialCommLoop loops[SERIALCOMM_MANAGER_MAX_THREADS]; /**< The I/O threads */
+  unsigned int threads; /**< Number of I/O threads */
+  uint64_t next_id; /**< Identifier of the next attached device */
+  pthread_mutex_t lock; /**< Serializes attach, detach and the device lookups */
+};
+
+/** \brief Current CLOCK_MONOTONIC time in nanoseconds */
+static uint64_t serialcomm_manager_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+} // serialcomm_manager_now
+
+/** \brief Device of the loop with the given id, or NULL (the loop lock must be held) */
+static SerialCommDevice * serialcomm_loop_lookup(const SerialCommLoop * loop, uint64_t id) {
+  for (size_t i = 0; i < loop->count; i++) {
+    if (loop->devices[i]->id == id)
+      return loop->devices[i];
+  }
+  return NULL;
+} // serialcomm_loop_lookup
+
+/** \brief Position of a device in the loop, or -1 (the loop lock must be held) */
+static long serialcomm_loop_find(const SerialCommLoop * loop, const SerialCommDevice * dev) {
+  for (size_t i = 0; i < loop->count; i++) {
+    if (loop->devices[i] == dev)
+      return (long)i;
+  }
+  return -1;
+} // serialcomm_loop_find
+
+/** \brief Removes the descriptors of a device from the epoll set (the loop lock must be held) */
+static void serialcomm_loop_unwatch(SerialCommLoop * loop, SerialCommDevice * dev) {
+  if (!dev->online)
+    return;
+  epoll_ctl(loop->epoll, EPOLL_CTL_DEL, dev->sc->serial, NULL);
+  epoll_ctl(loop->epoll, EPOLL_CTL_DEL, dev->sc->writer_wakeup, NULL);
+  dev->online = 0;
+  dev->writing = 0;
+} // serialcomm_loop_unwatch
+
+/** \brief Writes the queued commands without blocking, watching the serial
+ * descriptor for EPOLLOUT while some are left (the loop lock must be held)
+ */
+static void serialcomm_loop_write(SerialCommLoop * loop, SerialCommDevice * dev) {
+  int writing = (serialcomm_send_ready(dev->sc) > 0);
+  if (writing == dev->writing)
+    return;
+  struct epoll_event ev;
+  ev.events = writing ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+  ev.data.u64 = SERIALCOMM_WATCH_RX(dev->id);
+  if (epoll_ctl(loop->epoll, EPOLL_CTL_MOD, dev->sc->serial, &ev) == 0)
+    dev->writing = writing;
+} // serialcomm_loop_write
+
+/** \brief Handles an event of a device (the loop lock must be held) */
+static void serialcomm_loop_event(SerialCommLoop * loop, uint64_t watch, uint32_t events) {
+  // The device may have been detached after the event was collected
+  SerialCommDevice * dev = serialcomm_loop_lookup(loop, watch >> 1);
+  if (!dev || !dev->online)
+    return;
+  SerialComm * sc = dev->sc;
+
+  if (watch == SERIALCOMM_WATCH_RX(dev->id)) {
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+        serialcomm_receive_ready(sc, events & EPOLLIN, events & (EPOLLERR | EPOLLHUP)) < 0) {
+      serialcomm_loop_unwatch(loop, dev);
+      return;
+    }
+    if (dev->writing && (events & EPOLLOUT))
+      serialcomm_loop_write(loop, dev);
+    return;
+  }
+
+  // As for the writer thread: declares the idle state, then drains the queue
+  uint64_t count;
+  if (read(sc->writer_wakeup, &count, sizeof(count)) < 0 && errno != EAGAIN && sc->err_clbk)
+    sc->err_clbk(SerialCommErrCannotWakeup, sc);
+  atomic_store(&(sc->writer_idle), 1);
+  // With a full output buffer the writing goes on at EPOLLOUT
+  if (!dev->writing)
+    serialcomm_loop_write(loop, dev);
+} // serialcomm_loop_event
+
+/** \brief Drops the partial frames after a silence on the line, retransmits the
+ * commands not acknowledged in time, and drops the commands stalled on a full
+ * output buffer for SERIALCOMM_TX_STALL_MS (the loop lock must be held)
+ * \return the time (ms) to the next check, -1 if nothing is pending
+ */
+static int serialcomm_loop_timers(SerialCommLoop * loop) {
+  int timeout = -1;
+  uint64_t now = serialcomm_manager_now();
+  for (size_t i = 0; i < loop->count; i++) {
+    SerialCommDevice * dev = loop->devices[i];
+    SerialComm * sc = dev->sc;
+    if (!dev->online)
+      continue;
+    if (dev->writing && sc->tx.stall_ns) {
+      uint64_t stall = now - sc->tx.stall_ns;
+      if (stall >= (uint64_t)SERIALCOMM_TX_STALL_MS * 1000000ULL) {
+        serialcomm_loop_write(loop, dev);
+      } else {
+        int left = (int)(((uint64_t)SERIALCOMM_TX_STALL_MS * 1000000ULL - stall) / 1000000ULL) + 1;
+        if (timeout < 0 || left < timeout)
+          timeout = left;
+      }
+    }
+    int ack = serialcomm_ack_timer(sc);
+    if (ack >= 0 && (timeout < 0 || ack < timeout))
+      timeout = ack;
+    if (sc->rx.head == sc->rx.tail)
+      continue;
+    if (now - atomic_load_explicit(&(sc->rx_time_ns), memory_order_relaxed) >= (uint64_t)SERIALCOMM_RX_GAP_MS * 1000000ULL)
+      serialcomm_receive_gap(sc);
+    else if (timeout < 0 || timeout > SERIALCOMM_RX_GAP_MS)
+      timeout = SERIALCOMM_RX_GAP_MS;
+  }
+  return timeout;
+} // serialcomm_loop_timers
+
+/** \brief I/O thread: serves the devices of a loop */
+static void * serialcomm_loop_thread(void * loop_v) {
+  SerialCommLoop * loop = (SerialCommLoop*)loop_v;
+  struct epoll_event events[SERIALCOMM_MANAGER_EVENTS];
+  int timeout = -1;
+
+  while (!atomic_load(&(loop->exit))) {
+    // With a partial frame pending, a silence on the line marks a frame boundary
+    int n = epoll_wait(loop->epoll, events, SERIALCOMM_MANAGER_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    pthread_mutex_lock(&(loop->lock));
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.u64)
+        serialcomm_loop_event(loop, events[i].data.u64, events[i].events);
+    }
+    timeout = serialcomm_loop_timers(loop);
+    pthread_mutex_unlock(&(loop->lock));
+  }
+
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    loop->cpu = (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+  return NULL;
+} // serialcomm_loop_thread
+
+
+extern SerialCommManager * serialcomm_manager_create(unsigned int threads) {
+  if (threads < 1 || threads > SERIALCOMM_MANAGER_MAX_THREADS)
+    return NULL;
+  SerialCommManager * mgr = (SerialCommManager*)malloc(sizeof(SerialCommManager));
+  if (!mgr)
+    return NULL;
+  pthread_mutex_init(&(mgr->lock), NULL);
+  mgr->threads = 0;
+  mgr->next_id = 1;
+
+  for (unsigned int t = 0; t < threads; t++) {
+    SerialCommLoop * loop = &(mgr->loops[t]);
+    loop->count = 0;
+    loop->cpu = 0.0;
+    loop->running = 0;
+    atomic_init(&(loop->exit), 0);
+    pthread_mutex_init(&(loop->lock), NULL);
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    loop->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    mgr->threads++;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    if (loop->epoll < 0 || loop->wakeup < 0 ||
+        epoll_ctl(loop->epoll, EPOLL_CTL_ADD, loop->wakeup, &ev) < 0 ||
+        pthread_create(&(loop->thread), NULL, serialcomm_loop_thread, (void*)loop)) {
+      serialcomm_manager_destroy(mgr);
+      return NULL;
+    }
+    loop->running = 1;
+  }
+  return mgr;
+} // serialcomm_manager_create
+
+extern void serialcomm_manager_destroy(SerialCommManager * mgr) {
+  if (!mgr)
+    return;
+  for (unsigned int t = 0; t < mgr->threads; t++) {
+    SerialCommLoop * loop = &(mgr->loops[t]);
+    while (loop->count > 0)
+      serialcomm_manager_detach(mgr, loop->devices[loop->count - 1]->sc);
+    if (loop->running) {
+      uint64_t one = 1;
+      atomic_store(&(loop->exit), 1);
+      if (write(loop->wakeup, &one, sizeof(one)) == sizeof(one))
+        pthread_join(loop->thread, NULL);
+    }
+    if (loop->epoll >= 0)
+      close(loop->epoll);
+    if (loop->wakeup >= 0)
+      close(loop->wakeup);
+    pthread_mutex_destroy(&(loop->lock));
+  }
+  pthread_mutex_destroy(&(mgr->lock));
+  free(mgr);
+} // serialcomm_manager_destroy
+
+/** \brief Finds an attached connection (the manager lock must be held) */
+static SerialCommDevice * serialcomm_manager_find(SerialCommManager * mgr, const SerialComm * sc) {
+  for (unsigned int t = 0; t < mgr->threads; t++) {
+    SerialCommLoop * loop = &(mgr->loops[t]);
+    for (size_t i = 0; i < loop->count; i++) {
+      if (loop->devices[i]->sc == sc)
+        return loop->devices[i];
+    }
+  }
+  return NULL;
+} // serialcomm_manager_find
+
+extern int serialcomm_manager_attach(SerialCommManager * mgr, SerialComm * sc, unsigned int group) {
+  if (!mgr || !sc)
+    return -1;
+  if (sc->state != SerialStateSync || sc->listener_running || sc->writer_running) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrNotSynced, sc);
+    return -1;
+  }
+
+  pthread_mutex_lock(&(mgr->lock));
+  SerialCommDevice * dev = NULL;
+  if (serialcomm_manager_find(mgr, sc) || !(dev = (SerialCommDevice*)malloc(sizeof(SerialCommDevice)))) {
+    pthread_mutex_unlock(&(mgr->lock));
+    return -1;
+  }
+
+  // The least loaded thread serves the new device
+  unsigned int t = 0;
+  for (unsigned int i = 1; i < mgr->threads; i++) {
+    if (mgr->loops[i].count < mgr->loops[t].count)
+      t = i;
+  }
+  SerialCommLoop * loop = &(mgr->loops[t]);
+  dev->sc = sc;
+  dev->id = mgr->next_id++;
+  dev->group = group;
+  dev->thread = t;
+  dev->online = 1;
+  dev->writing = 0;
+
+  // Flushed before serving the device, as in serialcomm_start_listener
+  sc->transport->flush(sc);
+  atomic_store(&(sc->writer_idle), 1);
+
+  pthread_mutex_lock(&(loop->lock));
+  struct epoll_event rx, tx;
+  rx.events = EPOLLIN;
+  rx.data.u64 = SERIALCOMM_WATCH_RX(dev->id);
+  tx.events = EPOLLIN;
+  tx.data.u64 = SERIALCOMM_WATCH_TX(dev->id);
+  int ret = -1;
+  if (loop->count < SERIALCOMM_MANAGER_MAX_DEVICES &&
+      epoll_ctl(loop->epoll, EPOLL_CTL_ADD, sc->serial, &rx) == 0) {
+    if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, sc->writer_wakeup, &tx) == 0) {
+      loop->devices[loop->count++] = dev;
+      ret = 0;
+    } else {
+      epoll_ctl(loop->epoll, EPOLL_CTL_DEL, sc->serial, NULL);
+    }
+  }
+  pthread_mutex_unlock(&(loop->lock));
+  pthread_mutex_unlock(&(mgr->lock));
+
+  if (ret < 0) {
+    atomic_store(&(sc->writer_idle), 0);
+    free(dev);
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrReceivePthread, sc);
+    return -1;
+  }
+
+  // Commands queued before the attach are written now
+  uint64_t one = 1;
+  if (write(sc->writer_wakeup, &one, sizeof(one)) < 0 && errno != EAGAIN && sc->err_clbk)
+    sc->err_clbk(SerialCommErrCannotWakeup, sc);
+  return 0;
+} // serialcomm_manager_attach
+
+extern int serialcomm_manager_detach(SerialCommManager * mgr, SerialComm * sc) {
+  if (!mgr || !sc)
+    return -1;
+  pthread_mutex_lock(&(mgr->lock));
+  SerialCommDevice * dev = serialcomm_manager_find(mgr, sc);
+  if (!dev) {
+    pthread_mutex_unlock(&(mgr->lock));
+    return -1;
+  }
+  SerialCommLoop * loop = &(mgr->loops[dev->thread]);
+  pthread_mutex_lock(&(loop->lock));
+  int online = dev->online;
+  serialcomm_loop_unwatch(loop, dev);
+  long i = serialcomm_loop_find(loop, dev);
+  loop->devices[i] = loop->devices[--loop->count];
+  pthread_mutex_unlock(&(loop->lock));
+  pthread_mutex_unlock(&(mgr->lock));
+
+  // No longer served by the loop: the commands left may wait for the line here
+  if (online)
+    serialcomm_send_drain(sc);
+  atomic_store(&(sc->writer_idle), 0);
+  free(dev);
+  return 0;
+} // serialcomm_manager_detach
+
+extern size_t serialcomm_manager_count(SerialCommManager * mgr) {
+  if (!mgr)
+    return 0;
+  size_t count = 0;
+  pthread_mutex_lock(&(mgr->lock));
+  for (unsigned int t = 0; t < mgr->threads; t++)
+    count += mgr->loops[t].count;
+  pthread_mutex_unlock(&(mgr->lock));
+  return count;
+} // serialcomm_manager_count
+
+extern SerialComm * serialcomm_manager_device(SerialCommManager * mgr, size_t i) {
+  if (!mgr)
+    return NULL;
+  SerialComm * sc = NULL;
+  pthread_mutex_lock(&(mgr->lock));
+  for (unsigned int t = 0; t < mgr->threads && !sc; t++) {
+    if (i < mgr->loops[t].count)
+      sc = mgr->loops[t].devices[i]->sc;
+    else
+      i -= mgr->loops[t].count;
+  }
+  pthread_mutex_unlock(&(mgr->lock));
+  return sc;
+} // serialcomm_manager_device
+
+extern int serialcomm_manager_info(SerialCommManager * mgr, SerialComm * sc, SerialCommDeviceInfo * info) {
+  if (!mgr || !sc || !info)
+    return -1;
+  pthread_mutex_lock(&(mgr->lock));
+  SerialCommDevice * dev = serialcomm_manager_find(mgr, sc);
+  if (dev) {
+    SerialCommLoop * loop = &(mgr->loops[dev->thread]);
+    pthread_mutex_lock(&(loop->lock));
+    info->port = sc->port;
+    info->group = dev->group;
+    info->thread = dev->thread;
+    info->online = dev->online;
+    info->state = sc->state;
+    info->frames = serialcomm_frame_number(sc);
+    info->resyncs = atomic_load_explicit(&(sc->rx_resyncs), memory_order_relaxed);
+    uint64_t rx_ns = atomic_load_explicit(&(sc->rx_time_ns), memory_order_relaxed);
+    info->idle_s = rx_ns ? 1e-9 * (double)(serialcomm_manager_now() - rx_ns) : -1.0;
+    pthread_mutex_unlock(&(loop->lock));
+  }
+  pthread_mutex_unlock(&(mgr->lock));
+  return dev ? 0 : -1;
+} // serialcomm_manager_info
+
+extern size_t serialcomm_manager_send(SerialCommManager * mgr, unsigned int group, CommandCode cmd, float value) {
+  if (!mgr)
+    return 0;
+  size_t sent = 0;
+  pthread_mutex_lock(&(mgr->lock));
+  for (unsigned int t = 0; t < mgr->threads; t++) {
+    SerialCommLoop * loop = &(mgr->loops[t]);
+    pthread_mutex_lock(&(loop->lock));
+    for (size_t i = 0; i < loop->count; i++) {
+      SerialCommDevice * dev = loop->devices[i];
+      if (!dev->online || (group != SERIALCOMM_GROUP_ALL && dev->group != group))
+        continue;
+      serialcomm_send(dev->sc, cmd, value);
+      sent++;
+    }
+    pthread_mutex_unlock(&(loop->lock));
+  }
+  pthread_mutex_unlock(&(mgr->lock));
+  return sent;
+} // serialcomm_manager_send
+
+extern double serialcomm_manager_cpu_time(SerialCommManager * mgr) {
+  if (!mgr)
+    return 0.0;
+  double cpu = 0.0;
+  for (unsigned int t = 0; t < mgr->threads; t++) {
+    SerialCommLoop * loop = &(mgr->loops[t]);
+    clockid_t cid;
+    struct timespec ts;
+    if (atomic_load(&(loop->exit)) || pthread_getcpuclockid(loop->thread, &cid) || clock_gettime(cid, &ts))
+      cpu += loop->cpu;
+    else
+      cpu += (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+  }
+  return cpu;
+} // serialcomm_manager_cpu_time
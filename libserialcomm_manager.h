@@ -0,0 +1,115 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_MANAGER_H_
+#define LIBSERIALCOMM_MANAGER_H_
+
+/** \brief Device manager: many connections served by a few event loops
+ *
+ * Each connection started with serialcomm_start_listener owns a listener and a
+ * writer thread. A manager instead serves all its connections from a fixed
+ * pool of I/O threads: each thread waits in epoll_wait() on the serial and
+ * writer wakeup descriptors of its devices, and runs the same read and parse
+ * code of the dedicated threads (serialcomm_receive_ready). The commands are
+ * written without blocking (serialcomm_send_ready): a full output buffer is
+ * watched for EPOLLOUT, so a stalled port does not hold the other devices of
+ * its thread. The devices are spread over the threads when attached.
+ *
+ * A connection is attached after serialcomm_sync, in place of
+ * serialcomm_start_listener, and must be detached before serialcomm_close.
+ * Everything else (send, read_output, wait_frame, history, recorder) works as
+ * for a connection with its own threads. Each device belongs to a group, and a
+ * command can be sent to all the devices of a group at once.
+ */
+
+#include <limits.h>
+#include "libserialcomm.h"
+
+#define SERIALCOMM_MANAGER_MAX_THREADS 16   /**< Maximum I/O threads of a manager */
+#define SERIALCOMM_MANAGER_MAX_DEVICES 256  /**< Maximum devices of a manager */
+#define SERIALCOMM_GROUP_ALL UINT_MAX       /**< Group that selects all the devices */
+
+typedef struct SerialCommManager SerialCommManager;
+
+/** \brief State of a managed device */
+typedef struct SerialCommDeviceInfo {
+  const char * port; /**< Port name */
+  unsigned int group; /**< Group of the device */
+  unsigned int thread; /**< I/O thread serving the device */
+  int online; /**< 0 after the remote end closed the port */
+  SerialState state; /**< State of the connection */
+  unsigned long frames; /**< Number of the last frame received */
+  unsigned long resyncs; /**< Resynchronizations of the receive stream */
+  double idle_s; /**< Time (s) since the last bytes were received, -1 if never */
+} SerialCommDeviceInfo;
+
+/** \brief Creates a manager and starts its I/O threads
+ *
+ * \param threads number of I/O threads (at least 1, at most SERIALCOMM_MANAGER_MAX_THREADS)
+ * \return the manager, or NULL on error
+ */
+extern SerialCommManager * serialcomm_manager_create(unsigned int threads);
+/** \brief Stops the I/O threads and frees the manager
+ *
+ * The devices still attached are detached (not closed).
+ */
+extern void serialcomm_manager_destroy(SerialCommManager * mgr);
+/** \brief Attaches a synchronized connection to the least loaded I/O thread
+ *
+ * \param mgr the manager
+ * \param sc a connection in SerialStateSync, whose listener has not been started
+ * \param group group of the device
+ * \return 0 on success, -1 on error
+ */
+extern int serialcomm_manager_attach(SerialCommManager * mgr, SerialComm * sc, unsigned int group);
+/** \brief Detaches a connection, after its queued commands are written
+ *
+ * After the detach the connection can be closed with serialcomm_close.
+ * \return 0 on success, -1 if the connection is not attached
+ */
+extern int serialcomm_manager_detach(SerialCommManager * mgr, SerialComm * sc);
+/** \brief Number of attached devices */
+extern size_t serialcomm_manager_count(SerialCommManager * mgr);
+/** \brief Returns the i-th attached device, or NULL */
+extern SerialComm * serialcomm_manager_device(SerialCommManager * mgr, size_t i);
+/** \brief Reads the state of an attached device
+ *
+ * \return 0 on success, -1 if the connection is not attached
+ */
+extern int serialcomm_manager_info(SerialCommManager * mgr, SerialComm * sc, SerialCommDeviceInfo * info);
+/** \brief Sends a command to all the online devices of a group
+ *
+ * \param group the group, or SERIALCOMM_GROUP_ALL
+ * \return the number of devices the command has been queued for
+ */
+extern size_t serialcomm_manager_send(SerialCommManager * mgr, unsigned int group, CommandCode cmd, float value);
+/** \brief CPU time (s) consumed by all the I/O threads */
+extern double serialcomm_manager_cpu_time(SerialCommManager * mgr);
+
+#endif /* LIBSERIALCOMM_MANAGER_H_ */
@@ -0,0 +1,323 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libserialcomm_recorder.h"
+
+/** \brief State of a recorder */
+struct SerialCommRecorder {
+  char * path; /**< Base name of the log files */
+  size_t max_bytes; /**< Size of each log file */
+  uint32_t index; /**< Number of the current file */
+  int fd; /**< Current file descriptor */
+  char * map; /**< Mapping of the current file */
+  size_t capacity; /**< Records in each file */
+  size_t count; /**< Records written in the current file */
+  uint64_t total; /**< Records written in all the files */
+  pthread_t helper; /**< Prepares the next file and finishes the full ones */
+  pthread_mutex_t lock; /**< Lock on index and on the fields below */
+  pthread_cond_t cond; /**< Signaled on a new job for the helper, and when a job is done */
+  int next_fd; /**< Next file, ready for the rollover (-1 if not yet) */
+  char * next_map; /**< Mapping of the next file */
+  int next_err; /**< errno of the failed preparation of the next file, 0 if none */
+  int old_fd; /**< Full file to unmap and truncate (-1 if none) */
+  char * old_map; /**< Mapping of the full file */
+  size_t old_count; /**< Records in the full file */
+  int exit; /**< Request for quit the helper */
+  atomic_int errors; /**< Files that could not be truncated, not yet reported */
+};
+
+/** \brief Name of the file index of the sequence */
+static void serialcomm_recorder_name(const SerialCommRecorder * rec, uint32_t index, char * name, size_t size) {
+  snprintf(name, size, "%s.%04u", rec->path, index);
+} // serialcomm_recorder_name
+
+/** \brief Creates, preallocates and maps the file index of the sequence
+ * \return 0 on success, -1 on error (errno is set)
+ */
+static int serialcomm_recorder_create(const SerialCommRecorder * rec, uint32_t index, int * fd_out, char ** map_out) {
+  char name[4096];
+  serialcomm_recorder_name(rec, index, name, sizeof(name));
+
+  int fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  int err = posix_fallocate(fd, 0, (off_t)rec->max_bytes);
+  if (err) {
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  char * map = (char*)mmap(NULL, rec->max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  SerialCommLogHeader * h = (SerialCommLogHeader*)map;
+  h->magic = SERIALCOMM_LOG_MAGIC;
+  h->version = SERIALCOMM_LOG_VERSION;
+  h->header_size = SERIALCOMM_LOG_HEADER_SIZE;
+  h->record_size = sizeof(SerialCommLogRecord);
+  h->index = index;
+  h->frame_size = output_buffer_size;
+  *fd_out = fd;
+  *map_out = map;
+  return 0;
+} // serialcomm_recorder_create
+
+/** \brief Unmaps a file and truncates it to its records
+ * \return 0 on success, -1 if the file cannot be truncated
+ */
+static int serialcomm_recorder_finish(const SerialCommRecorder * rec, int fd, char * map, size_t count) {
+  int res = 0;
+  if (map)
+    munmap(map, rec->max_bytes);
+  if (fd >= 0) {
+    if (ftruncate(fd, (off_t)(SERIALCOMM_LOG_HEADER_SIZE + count * sizeof(SerialCommLogRecord))) < 0)
+      res = -1;
+    close(fd);
+  }
+  return res;
+} // serialcomm_recorder_finish
+
+/** \brief Helper thread: finishes the full files, and prepares the next one in advance */
+static void * serialcomm_recorder_thread(void * rec_v) {
+  SerialCommRecorder * rec = (SerialCommRecorder*)rec_v;
+  pthread_mutex_lock(&(rec->lock));
+  while (1) {
+    if (rec->old_fd >= 0) {
+      int fd = rec->old_fd;
+      char * map = rec->old_map;
+      size_t count = rec->old_count;
+      pthread_mutex_unlock(&(rec->lock));
+      if (serialcomm_recorder_finish(rec, fd, map, count) < 0)
+        atomic_fetch_add(&(rec->errors), 1);
+      pthread_mutex_lock(&(rec->lock));
+      rec->old_fd = -1;
+      rec->old_map = NULL;
+      pthread_cond_broadcast(&(rec->cond));
+      continue;
+    }
+    if (rec->exit)
+      break;
+    if (rec->next_fd < 0 && !rec->next_err) {
+      uint32_t index = rec->index + 1;
+      int fd;
+      char * map;
+      pthread_mutex_unlock(&(rec->lock));
+      int res = serialcomm_recorder_create(rec, index, &fd, &map);
+      int err = errno;
+      pthread_mutex_lock(&(rec->lock));
+      if (res < 0) {
+        rec->next_err = err ? err : EIO;
+      } else {
+        rec->next_fd = fd;
+        rec->next_map = map;
+      }
+      pthread_cond_broadcast(&(rec->cond));
+      continue;
+    }
+    pthread_cond_wait(&(rec->cond), &(rec->lock));
+  }
+  pthread_mutex_unlock(&(rec->lock));
+  return NULL;
+} // serialcomm_recorder_thread
+
+extern SerialCommRecorder * serialcomm_recorder_open(const char * path, size_t max_bytes) {
+  if (!path) {
+    errno = EINVAL;
+    return NULL;
+  }
+  SerialCommRecorder * rec = (SerialCommRecorder*)malloc(sizeof(SerialCommRecorder));
+  if (!rec)
+    return NULL;
+
+  rec->path = strdup(path);
+  rec->max_bytes = (max_bytes < SERIALCOMM_LOG_MIN_SIZE) ? SERIALCOMM_LOG_MIN_SIZE : max_bytes;
+  rec->index = 0;
+  rec->fd = -1;
+  rec->map = NULL;
+  rec->capacity = (rec->max_bytes - SERIALCOMM_LOG_HEADER_SIZE) / sizeof(SerialCommLogRecord);
+  rec->count = 0;
+  rec->total = 0;
+  rec->next_fd = -1;
+  rec->next_map = NULL;
+  rec->next_err = 0;
+  rec->old_fd = -1;
+  rec->old_map = NULL;
+  rec->old_count = 0;
+  rec->exit = 0;
+  atomic_init(&(rec->errors), 0);
+  if (!rec->path || serialcomm_recorder_create(rec, 0, &(rec->fd), &(rec->map)) < 0) {
+    free(rec->path);
+    free(rec);
+    return NULL;
+  }
+
+  pthread_mutex_init(&(rec->lock), NULL);
+  pthread_cond_init(&(rec->cond), NULL);
+  int err = pthread_create(&(rec->helper), NULL, serialcomm_recorder_thread, (void*)rec);
+  if (err) {
+    pthread_cond_destroy(&(rec->cond));
+    pthread_mutex_destroy(&(rec->lock));
+    serialcomm_recorder_finish(rec, rec->fd, rec->map, 0);
+    free(rec->path);
+    free(rec);
+    errno = err;
+    return NULL;
+  }
+  return rec;
+} // serialcomm_recorder_open
+
+extern int serialcomm_recorder_append(SerialCommRecorder * rec, const SerialCommRecord * r) {
+  if (rec->count >= rec->capacity) {
+    // The next file is usually ready: the rollover only swaps the mappings
+    pthread_mutex_lock(&(rec->lock));
+    while ((rec->next_fd < 0 && !rec->next_err) || rec->old_fd >= 0)
+      pthread_cond_wait(&(rec->cond), &(rec->lock));
+    if (rec->next_fd < 0) {
+      errno = rec->next_err;
+      pthread_mutex_unlock(&(rec->lock));
+      return -1;
+    }
+    rec->old_fd = rec->fd;
+    rec->old_map = rec->map;
+    rec->old_count = rec->count;
+    rec->fd = rec->next_fd;
+    rec->map = rec->next_map;
+    rec->next_fd = -1;
+    rec->next_map = NULL;
+    rec->index++;
+    rec->count = 0;
+    pthread_cond_broadcast(&(rec->cond));
+    pthread_mutex_unlock(&(rec->lock));
+  }
+
+  // Written in place in the mapping, the commit word goes last
+  SerialCommLogRecord * dst = (SerialCommLogRecord*)(rec->map + SERIALCOMM_LOG_HEADER_SIZE) + rec->count;
+  dst->seq = r->seq;
+  dst->time_ns = r->time_ns;
+  memcpy((void*)dst->frame.b, (void*)&(r->frame), output_buffer_size);
+  atomic_thread_fence(memory_order_release);
+  dst->commit = SERIALCOMM_LOG_COMMIT;
+  rec->count++;
+  rec->total++;
+  return 0;
+} // serialcomm_recorder_append
+
+extern int serialcomm_recorder_close(SerialCommRecorder * rec) {
+  if (!rec)
+    return 0;
+
+  pthread_mutex_lock(&(rec->lock));
+  rec->exit = 1;
+  pthread_cond_broadcast(&(rec->cond));
+  pthread_mutex_unlock(&(rec->lock));
+  pthread_join(rec->helper, NULL);
+
+  int res = serialcomm_recorder_finish(rec, rec->fd, rec->map, rec->count);
+  if (atomic_load(&(rec->errors)))
+    res = -1;
+  if (rec->next_fd >= 0) {
+    // Prepared but never used
+    char name[4096];
+    serialcomm_recorder_name(rec, rec->index + 1, name, sizeof(name));
+    munmap(rec->next_map, rec->max_bytes);
+    close(rec->next_fd);
+    unlink(name);
+  }
+  pthread_cond_destroy(&(rec->cond));
+  pthread_mutex_destroy(&(rec->lock));
+  free(rec->path);
+  free(rec);
+  return res;
+} // serialcomm_recorder_close
+
+extern uint64_t serialcomm_recorder_count(const SerialCommRecorder * rec) {
+  return rec ? rec->total : 0;
+} // serialcomm_recorder_count
+
+
+extern int serialcomm_record_start(SerialComm * sc, const char * path, size_t max_bytes) {
+  if (!sc)
+    return -1;
+
+  SerialCommRecorder * rec = serialcomm_recorder_open(path, max_bytes);
+  if (!rec) {
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotRecord, sc);
+    return -1;
+  }
+
+  pthread_mutex_lock(&(sc->recorder_lock));
+  SerialCommRecorder * old = sc->recorder;
+  sc->recorder = rec;
+  pthread_mutex_unlock(&(sc->recorder_lock));
+
+  if (serialcomm_recorder_close(old) < 0 && sc->err_clbk)
+    sc->err_clbk(SerialCommErrCannotRecord, sc);
+  return 0;
+} // serialcomm_record_start
+
+extern void serialcomm_record_stop(SerialComm * sc) {
+  if (!sc)
+    return;
+
+  pthread_mutex_lock(&(sc->recorder_lock));
+  SerialCommRecorder * old = sc->recorder;
+  sc->recorder = NULL;
+  pthread_mutex_unlock(&(sc->recorder_lock));
+
+  if (serialcomm_recorder_close(old) < 0 && sc->err_clbk)
+    sc->err_clbk(SerialCommErrCannotRecord, sc);
+} // serialcomm_record_stop
+
+extern void serialcomm_record_frame(SerialComm * sc, const SerialCommRecord * r) {
+  // The lock is contended only while a recorder is started or stopped
+  pthread_mutex_lock(&(sc->recorder_lock));
+  if (sc->recorder && serialcomm_recorder_append(sc->recorder, r) < 0) {
+    serialcomm_recorder_close(sc->recorder);
+    sc->recorder = NULL;
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotRecord, sc);
+  } else if (sc->recorder && atomic_load_explicit(&(sc->recorder->errors), memory_order_relaxed)) {
+    // A full file could not be truncated by the helper: its records are intact
+    atomic_store(&(sc->recorder->errors), 0);
+    if (sc->err_clbk)
+      sc->err_clbk(SerialCommErrCannotRecord, sc);
+  }
+  pthread_mutex_unlock(&(sc->recorder_lock));
+} // serialcomm_record_frame
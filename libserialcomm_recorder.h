@@ -0,0 +1,117 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_RECORDER_H_
+#define LIBSERIALCOMM_RECORDER_H_
+
+/** \brief Append-only binary recorder of the received frames
+ *
+ * The recorder writes each valid frame, with its number and reception time,
+ * in a preallocated memory-mapped file. The record is written directly in the
+ * mapping (no intermediate buffer, no system call per frame), and its commit
+ * word is written last: after a crash of the process the kernel still writes
+ * back the mapped pages, and a reader stops at the first record without the
+ * commit word, thus the earlier records are never corrupted.
+ *
+ * When a file is full the recorder rolls over to the next one: the files are
+ * named <path>.0000, <path>.0001, ... and each is truncated to the size of its
+ * records when it is closed. A helper thread creates, preallocates and maps the
+ * next file in advance, and unmaps and truncates the full ones: the rollover
+ * on the listener only swaps the mappings.
+ */
+
+#include <stdint.h>
+#include "libserialcomm.h"
+
+#define SERIALCOMM_LOG_MAGIC 0x474F4C53u   /**< "SLOG": log file signature */
+#define SERIALCOMM_LOG_VERSION 1           /**< Version of the log file format */
+#define SERIALCOMM_LOG_COMMIT 0x54494D43u  /**< "CMIT": written last in a complete record */
+#define SERIALCOMM_LOG_HEADER_SIZE 64      /**< Size of the file header (records start here) */
+#define SERIALCOMM_LOG_MIN_SIZE (1 << 16)  /**< Minimum size of a log file */
+
+/** \brief Header at the beginning of each log file */
+typedef struct SerialCommLogHeader {
+  uint32_t magic; /**< SERIALCOMM_LOG_MAGIC */
+  uint32_t version; /**< SERIALCOMM_LOG_VERSION */
+  uint32_t header_size; /**< Offset of the first record */
+  uint32_t record_size; /**< Size of each record */
+  uint32_t index; /**< Number of the file in the rollover sequence */
+  uint32_t frame_size; /**< Size of the output frame in the records */
+} SerialCommLogHeader;
+
+/** \brief A record in the log file */
+typedef struct SerialCommLogRecord {
+  uint64_t seq; /**< Frame number */
+  uint64_t time_ns; /**< CLOCK_MONOTONIC reception time in nanoseconds */
+  output_u frame; /**< The frame, as received */
+  uint32_t commit; /**< SERIALCOMM_LOG_COMMIT when the record is complete */
+} SerialCommLogRecord;
+
+/** \brief Opens a new recorder
+ *
+ * Creates and preallocates the first file of the sequence, and maps it in memory.
+ * \param path base name of the log files
+ * \param max_bytes size of each log file (at least SERIALCOMM_LOG_MIN_SIZE)
+ * \return the recorder or NULL on error (errno is set)
+ */
+extern SerialCommRecorder * serialcomm_recorder_open(const char * path, size_t max_bytes);
+/** \brief Appends a frame to the recorder, rolling over to a new file when full
+ *
+ * \param rec the recorder
+ * \param r the frame to record
+ * \return 0 on success, -1 if the next file cannot be created
+ */
+extern int serialcomm_recorder_append(SerialCommRecorder * rec, const SerialCommRecord * r);
+/** \brief Closes the recorder, truncating the last file to its records
+ *
+ * \return 0 on success, -1 if a file could not be truncated (its records are intact)
+ */
+extern int serialcomm_recorder_close(SerialCommRecorder * rec);
+/** \brief Number of frames written by the recorder */
+extern uint64_t serialcomm_recorder_count(const SerialCommRecorder * rec);
+
+/** \brief Starts recording all the frames received by a connection
+ *
+ * The listener appends each valid frame to the recorder. A previous recorder
+ * of the same connection is closed.
+ * \param sc a pointer to the communication structure
+ * \param path base name of the log files
+ * \param max_bytes size of each log file before the rollover
+ * \return 0 on success, -1 on error (SerialCommErrCannotRecord is raised)
+ */
+extern int serialcomm_record_start(SerialComm * sc, const char * path, size_t max_bytes);
+/** \brief Stops recording the frames of a connection, and closes the recorder
+ *
+ * SerialCommErrCannotRecord is raised if a file could not be truncated.
+ */
+extern void serialcomm_record_stop(SerialComm * sc);
+/** \brief Called by the listener for each published frame */
+extern void serialcomm_record_frame(SerialComm * sc, const SerialCommRecord * r);
+
+#endif /* LIBSERIALCOMM_RECORDER_H_ */
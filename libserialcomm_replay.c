@@ -0,0 +1,317 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "libserialcomm_replay.h"
+#include "libserialcomm_recorder.h"
+#include "libserialcomm_transport.h"
+
+/** \brief State of a replay */
+typedef struct SerialCommReplay {
+  char * path; /**< File being played */
+  double speed; /**< Multiplier of the recorded timing, 0 to play as fast as possible */
+  unsigned int baud; /**< Line speed used to pace raw byte streams */
+  int fd; /**< Replay end of the socket pair */
+  pthread_t thread; /**< Replay thread */
+  atomic_int exit; /**< Request for quit the replay thread */
+  atomic_int done; /**< The whole source has been played */
+  uint64_t start_ns; /**< Time at which the playback started */
+} SerialCommReplay;
+
+/** \brief Current CLOCK_MONOTONIC time in nanoseconds */
+static uint64_t serialcomm_replay_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+} // serialcomm_replay_now
+
+/** \brief Discards the commands sent by the library
+ * \return -1 if the library closed its end
+ */
+static int serialcomm_replay_discard(SerialCommReplay * rp) {
+  char sink[256];
+  ssize_t n;
+  while ((n = recv(rp->fd, sink, sizeof(sink), MSG_DONTWAIT)) > 0)
+    ;
+  return (n == 0) ? -1 : 0;
+} // serialcomm_replay_discard
+
+/** \brief Sleeps until target, discarding the incoming commands
+ * \return -1 if the replay must stop
+ */
+static int serialcomm_replay_wait(SerialCommReplay * rp, uint64_t target) {
+  struct pollfd pfd;
+  pfd.fd = rp->fd;
+  pfd.events = POLLIN;
+  while (!atomic_load(&(rp->exit))) {
+    uint64_t now = serialcomm_replay_now();
+    if (now >= target)
+      return 0;
+    struct timespec ts;
+    ts.tv_sec = (time_t)((target - now) / 1000000000ULL);
+    ts.tv_nsec = (long)((target - now) % 1000000000ULL);
+    if (ppoll(&pfd, 1, &ts, NULL) > 0 && serialcomm_replay_discard(rp) < 0)
+      return -1;
+  }
+  return -1;
+} // serialcomm_replay_wait
+
+/** \brief Writes a buffer to the library
+ * \return -1 if the replay must stop
+ */
+static int serialcomm_replay_write(SerialCommReplay * rp, const char * b, size_t len) {
+  if (serialcomm_replay_discard(rp) < 0)
+    return -1;
+  while (len > 0 && !atomic_load(&(rp->exit))) {
+    ssize_t n = send(rp->fd, b, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    b += n;
+    len -= (size_t)n;
+  }
+  return (len > 0) ? -1 : 0;
+} // serialcomm_replay_write
+
+/** \brief Moves path to the next file of a rollover sequence
+ *
+ * The names are those of the recorder ("%s.%04u"): at least four digits, more
+ * after the file 9999.
+ * \return 0 if the path has no sequence number (or no memory for the next name)
+ */
+static int serialcomm_replay_next(char ** path) {
+  size_t len = strlen(*path);
+  size_t digits = 0;
+  while (digits < len && (*path)[len - 1 - digits] >= '0' && (*path)[len - 1 - digits] <= '9')
+    digits++;
+  if (digits < 4 || digits > 9 || digits == len || (*path)[len - 1 - digits] != '.')
+    return 0;
+  unsigned int index = (unsigned int)strtoul(*path + len - digits, NULL, 10);
+  char * next = (char*)malloc(len + 2);
+  if (!next)
+    return 0;
+  snprintf(next, len + 2, "%.*s%04u", (int)(len - digits), *path, index + 1);
+  free(*path);
+  *path = next;
+  return 1;
+} // serialcomm_replay_next
+
+/** \brief Plays the recorder logs, paced by the recorded reception times */
+static void serialcomm_replay_log(SerialCommReplay * rp, FILE * f) {
+  uint64_t first_ns = 0;
+  int have_first = 0;
+
+  while (f) {
+    SerialCommLogHeader h;
+    SerialCommLogRecord r;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != SERIALCOMM_LOG_MAGIC ||
+        h.record_size != sizeof(SerialCommLogRecord) || fseek(f, h.header_size, SEEK_SET) < 0)
+      break;
+
+    while (fread(&r, sizeof(r), 1, f) == 1 && r.commit == SERIALCOMM_LOG_COMMIT) {
+      if (!have_first) {
+        first_ns = r.time_ns;
+        have_first = 1;
+      }
+      if (rp->speed > 0.0 &&
+          serialcomm_replay_wait(rp, rp->start_ns + (uint64_t)((double)(r.time_ns - first_ns) / rp->speed)) < 0)
+        break;
+      if (serialcomm_replay_write(rp, r.frame.b, output_buffer_size) < 0)
+        break;
+    }
+    fclose(f);
+    f = NULL;
+    if (!atomic_load(&(rp->exit)) && serialcomm_replay_next(&(rp->path)))
+      f = fopen(rp->path, "rb");
+  }
+  if (f)
+    fclose(f);
+} // serialcomm_replay_log
+
+/** \brief Plays a raw byte stream, paced at the serial line speed */
+static void serialcomm_replay_raw(SerialCommReplay * rp, FILE * f) {
+  const double byte_ns = 1e9 * 10.0 / (double)rp->baud; // 8N1: 10 bits per byte
+  char chunk[SERIALCOMM_REPLAY_CHUNK];
+  uint64_t sent = 0;
+  size_t n;
+
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+    if (rp->speed > 0.0 &&
+        serialcomm_replay_wait(rp, rp->start_ns + (uint64_t)((double)sent * byte_ns / rp->speed)) < 0)
+      break;
+    if (serialcomm_replay_write(rp, chunk, n) < 0)
+      break;
+    sent += n;
+  }
+  fclose(f);
+} // serialcomm_replay_raw
+
+/** \brief Replay thread: the playback starts when the library sends its first byte */
+static void * serialcomm_replay_thread(void * rp_v) {
+  SerialCommReplay * rp = (SerialCommReplay*)rp_v;
+
+  // Waits for the signature (as the device), so nothing is lost before the sync
+  struct pollfd pfd;
+  pfd.fd = rp->fd;
+  pfd.events = POLLIN;
+  while (!atomic_load(&(rp->exit)) && poll(&pfd, 1, -1) <= 0)
+    ;
+  rp->start_ns = serialcomm_replay_now();
+
+  FILE * f = fopen(rp->path, "rb");
+  if (f) {
+    uint32_t magic = 0;
+    if (fread(&magic, sizeof(magic), 1, f) == 1 && magic == SERIALCOMM_LOG_MAGIC) {
+      rewind(f);
+      serialcomm_replay_log(rp, f);
+    } else {
+      rewind(f);
+      serialcomm_replay_raw(rp, f);
+    }
+  }
+  atomic_store(&(rp->done), 1);
+  return NULL;
+} // serialcomm_replay_thread
+
+/** \brief Starts the replay of source (the port name without prefix) */
+static int serialcomm_replay_open(SerialComm * sc, const char * source) {
+  if (!sc || !source)
+    return -1;
+
+  SerialCommReplay * rp = (SerialCommReplay*)malloc(sizeof(SerialCommReplay));
+  if (!rp)
+    return -1;
+  rp->path = strdup(source);
+  rp->speed = 1.0;
+  rp->baud = sc->options.baud;
+  rp->start_ns = 0;
+  atomic_init(&(rp->exit), 0);
+  atomic_init(&(rp->done), 0);
+  if (!rp->path) {
+    free(rp);
+    return -1;
+  }
+
+  // Optional speed suffix: file@4 plays at 4x, file@max as fast as possible
+  char * at = strrchr(rp->path, '@');
+  if (at) {
+    char * end;
+    double speed = strtod(at + 1, &end);
+    if (strcmp(at + 1, "max") == 0) {
+      rp->speed = 0.0;
+      *at = '\0';
+    } else if (end != at + 1 && *end == '\0' && speed > 0.0) {
+      rp->speed = speed;
+      *at = '\0';
+    }
+  }
+
+  if (access(rp->path, R_OK) < 0) {
+    free(rp->path);
+    free(rp);
+    return -1;
+  }
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+    free(rp->path);
+    free(rp);
+    return -1;
+  }
+  rp->fd = sv[1];
+  if (serialcomm_fd_nonblock(sv[0]) < 0 || pthread_create(&(rp->thread), NULL, serialcomm_replay_thread, (void*)rp)) {
+    close(sv[0]);
+    close(sv[1]);
+    free(rp->path);
+    free(rp);
+    return -1;
+  }
+  sc->transport_data = rp;
+  return sv[0];
+} // serialcomm_replay_open
+
+/** \brief Stops the replay, then closes the descriptor */
+static void serialcomm_replay_close(SerialComm * sc) {
+  SerialCommReplay * rp = (SerialCommReplay*)sc->transport_data;
+  if (!rp) {
+    close(sc->serial);
+    return;
+  }
+
+  // Shutting down the library end wakes up the replay thread
+  atomic_store(&(rp->exit), 1);
+  shutdown(sc->serial, SHUT_RDWR);
+  pthread_join(rp->thread, NULL);
+  close(rp->fd);
+  free(rp->path);
+  free(rp);
+  sc->transport_data = NULL;
+  close(sc->serial);
+} // serialcomm_replay_close
+
+const SerialCommTransport serialcomm_transport_replay = {
+  "replay",
+  serialcomm_replay_open,
+  serialcomm_fd_flush,
+  serialcomm_fd_read,
+  serialcomm_fd_writev,
+  serialcomm_replay_close
+};
+
+/** \brief Replay state of sc, or NULL if it is not a replay */
+static SerialCommReplay * serialcomm_replay_of(SerialComm * sc) {
+  if (!sc || sc->transport != &serialcomm_transport_replay)
+    return NULL;
+  return (SerialCommReplay*)sc->transport_data;
+} // serialcomm_replay_of
+
+extern int serialcomm_replay_done(SerialComm * sc) {
+  SerialCommReplay * rp = serialcomm_replay_of(sc);
+  return rp ? atomic_load(&(rp->done)) : 0;
+} // serialcomm_replay_done
+
+extern double serialcomm_replay_rate(SerialComm * sc) {
+  if (!serialcomm_replay_of(sc))
+    return 0.0;
+  // The last frame is copied as serialcomm_read_history does, the listener may be overwriting the ring
+  SerialCommRecord last;
+  unsigned long frames = serialcomm_frame_number(sc);
+  if (frames < 2 || serialcomm_read_history(sc, frames - 1, &last, 1) != 1)
+    return 0.0;
+  uint64_t first_ns = atomic_load_explicit(&(sc->rx_first_ns), memory_order_relaxed);
+  if (last.time_ns <= first_ns)
+    return 0.0;
+  return (double)(last.seq - 1) * 1e9 / (double)(last.time_ns - first_ns);
+} // serialcomm_replay_rate
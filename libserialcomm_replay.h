@@ -0,0 +1,62 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_REPLAY_H_
+#define LIBSERIALCOMM_REPLAY_H_
+
+/** \brief Replay of recorded sessions through the receive path
+ *
+ * The "replay" transport (see libserialcomm_transport.h) does not open a serial
+ * device: the recorded session is played back by a thread on one end of a
+ * local socket pair, while the other end is used by the library as the serial
+ * descriptor. Thus the frames go through the same listener, parser and
+ * consumers of a real connection, and the commands sent are discarded.
+ *
+ * The port name is "replay:<file>[@<speed>]", where the speed is a multiplier
+ * of the recorded timing (1 if omitted) or "max" to play as fast as the
+ * listener reads. The file can be a log of the recorder (see
+ * libserialcomm_recorder.h, paced by the recorded reception times; the
+ * following files of the rollover sequence are played too) or a raw byte
+ * stream captured from the serial (paced at the baud of the options, 115200 by
+ * default).
+ */
+
+#include "libserialcomm.h"
+
+#define SERIALCOMM_REPLAY_CHUNK 64         /**< Bytes written at once from raw byte streams */
+
+/** \brief Returns 1 when the whole source has been played */
+extern int serialcomm_replay_done(SerialComm * sc);
+/** \brief Throughput of the replay
+ *
+ * \return frames per second received by the listener since the replay started
+ */
+extern double serialcomm_replay_rate(SerialComm * sc);
+
+#endif /* LIBSERIALCOMM_REPLAY_H_ */
@@ -32,14 +32,203 @@ if not require 'ffi'
   raise RuntimeError, "Please install ffi: sudo apt install ruby-ffi"
 end
 
+# Mirror of output_s (messages.h), filled by a single call
+class SerialCommOutput < FFI::Struct
+  pack 1
+  layout :t_meas, :float,
+         :p_meas, :float,
+         :q_meas, :float,
+         :kp, :float,
+         :ki, :float,
+         :t_set, :float,
+         :p_set, :float,
+         :u_pres, :float,
+         :period, :float,
+         :duty_cycle, :float,
+         :cycle, :float,
+         :max_cycle, :float,
+         :config, :char,
+         :state, :char,
+         :error, :char,
+         :check, :char
+
+  members.each { |m| define_method(m) { self[m] } }
+
+  def to_h
+    members.each_with_object({}) { |m, h| h[m] = self[m] }
+  end
+end
+
+# Mirror of SerialCommRecord (libserialcomm.h): a frame of the history
+class SerialCommRecord < FFI::Struct
+  layout :seq, :ulong,
+         :time_ns, :uint64,
+         :frame, SerialCommOutput
+
+  def seq
+    self[:seq]
+  end
+
+  def time_ns
+    self[:time_ns]
+  end
+
+  def frame
+    self[:frame]
+  end
+end
+
+# Mirror of SerialCommFiltered (libserialcomm_filter.h): filtered values of the float fields
+class SerialCommFiltered < FFI::Struct
+  FIELDS = [:t_meas, :p_meas, :q_meas, :kp, :ki, :t_set, :p_set,
+            :u_pres, :period, :duty_cycle, :cycle, :max_cycle].freeze
+  KINDS = [:none, :ema, :mean, :median, :derivative].freeze
+
+  layout :seq, :ulong,
+         :time_ns, :uint64,
+         :value, [:float, FIELDS.size]
+
+  def to_h
+    h = { seq: self[:seq], time_ns: self[:time_ns] }
+    FIELDS.each_with_index { |f, i| h[f] = self[:value][i] }
+    h
+  end
+end
+
+# Mirror of SerialCommCycle (libserialcomm_cycle.h): aggregates of a completed pressure cycle
+class SerialCommCycle < FFI::Struct
+  FLAGS = { 1 => :partial, 2 => :gap, 4 => :interrupted }.freeze
+
+  layout :cycle, :ulong,
+         :frames, :ulong,
+         :start_ns, :uint64,
+         :duration_ns, :uint64,
+         :p_max, :float,
+         :p_min, :float,
+         :p_high, :float,
+         :p_low, :float,
+         :rise_s, :float,
+         :overshoot, :float,
+         :t_start, :float,
+         :t_drift, :float,
+         :u_mean, :float,
+         :flags, :uint
+
+  def to_h
+    h = members.each_with_object({}) { |m, acc| acc[m] = self[m] }
+    h[:flags] = FLAGS.select { |bit, _| (self[:flags] & bit) != 0 }.values
+    h
+  end
+end
+
+# Mirror of SerialCommHistogram (libserialcomm.h): latencies in power of two buckets of microseconds
+class SerialCommHistogram < FFI::Struct
+  BUCKETS = 24
+
+  layout :count, :ulong,
+         :sum_ns, :uint64,
+         :max_ns, :uint64,
+         :buckets, [:ulong, BUCKETS]
+
+  # Count, mean, max and quantiles (the upper bound of their bucket), in seconds
+  def to_h
+    n = self[:count]
+    {
+      count: n,
+      mean: n > 0 ? 1e-9 * self[:sum_ns] / n : 0.0,
+      max: 1e-9 * self[:max_ns],
+      p50: SerialCommInterface.serialcomm_histogram_quantile(self, 0.5),
+      p99: SerialCommInterface.serialcomm_histogram_quantile(self, 0.99)
+    }
+  end
+end
+
+# Mirror of SerialCommStats (libserialcomm.h)
+class SerialCommStats < FFI::Struct
+  layout :bytes_in, :ulong,
+         :bytes_out, :ulong,
+         :frames_ok, :ulong,
+         :frames_bad, :ulong,
+         :resyncs, :ulong,
+         :discarded, :ulong,
+         :delta_dropped, :ulong,
+         :commands_sent, :ulong,
+         :commands_dropped, :ulong,
+         :ack_retransmits, :ulong,
+         :ack_failures, :ulong,
+         :stream_missed, :ulong,
+         :stream_duplicated, :ulong,
+         :heartbeat, SerialCommHistogram,
+         :ack, SerialCommHistogram
+
+  def to_h
+    members.each_with_object({}) { |m, h| h[m] = self[m].respond_to?(:to_h) ? self[m].to_h : self[m] }
+  end
+end
+
 module SerialCommInterface
   extend FFI::Library
   ffi_lib "./libserialcomm.so"
 
   attach_function :serialcomm_initialize, [:string], :pointer
+  attach_function :serialcomm_initialize_timeout, [:string, :int], :pointer, blocking: true
+  attach_function :serialcomm_initialize_ex, [:string, :uint, :int, :int, :ulong, :int, :int], :pointer, blocking: true
   attach_function :serialcomm_destroy, [:pointer], :void
   attach_function :serialcomm_check_errors, [], :int
+  attach_variable :serialcomm_err_timeout, :int
+  attach_variable :serialcomm_err_cannot_schedule, :int
   attach_function :serialcomm_update, [:pointer], :void
+  attach_function :serialcomm_update_wait, [:pointer, :int], :long, blocking: true
+  attach_function :serialcomm_stream_start, [:pointer, :uint], :void
+  attach_function :serialcomm_stream_stop, [:pointer], :void
+  attach_function :serialcomm_get_stream_missed, [:pointer], :ulong
+  attach_function :serialcomm_get_stream_duplicated, [:pointer], :ulong
+  attach_function :serialcomm_compact_telemetry, [:pointer, :uint], :void
+  attach_function :serialcomm_send_command_acked, [:pointer, :int, :float], :long
+  attach_function :serialcomm_wait_command_ack, [:pointer, :long, :int], :double, blocking: true
+  attach_function :serialcomm_get_listener_cpu_time, [:pointer], :double
+  attach_function :serialcomm_recorder_start, [:pointer, :string, :ulong], :int
+  attach_function :serialcomm_recorder_stop, [:pointer], :void
+  attach_function :serialcomm_archive_record, [:pointer, :string], :int
+  attach_function :serialcomm_archive_record_stop, [:pointer], :void
+  attach_function :serialcomm_archive_reader_open, [:string], :pointer
+  attach_function :serialcomm_archive_reader_close, [:pointer], :void
+  attach_function :serialcomm_archive_reader_frames, [:pointer], :ulong
+  attach_function :serialcomm_archive_reader_seek_cycle, [:pointer, :ulong], :int
+  attach_function :serialcomm_archive_reader_seek_time, [:pointer, :uint64], :int
+  attach_function :serialcomm_archive_reader_read, [:pointer, :pointer, :ulong], :ulong
+  attach_function :serialcomm_bus_publish, [:pointer], :int
+  attach_function :serialcomm_bus_unpublish, [:pointer], :void
+  attach_function :serialcomm_bus_published_port, [:pointer, :pointer, :ulong], :int
+  attach_function :serialcomm_bus_reader_open, [:string], :pointer
+  attach_function :serialcomm_bus_reader_close, [:pointer], :void
+  attach_function :serialcomm_bus_reader_wait_snapshot, [:pointer, :ulong, :int, :pointer], :ulong, blocking: true
+  attach_function :serialcomm_bus_reader_history, [:pointer, :ulong, :pointer, :ulong], :ulong
+  attach_function :serialcomm_bus_reader_closed, [:pointer], :int
+  attach_function :serialcomm_replay_finished, [:pointer], :int
+  attach_function :serialcomm_get_replay_rate, [:pointer], :double
+  attach_function :serialcomm_get_resync_count, [:pointer], :ulong
+  attach_function :serialcomm_get_discarded_bytes, [:pointer], :ulong
+  attach_function :serialcomm_get_protocol, [:pointer], :int
+  attach_function :serialcomm_stats_read, [:pointer, :pointer], :void
+  attach_function :serialcomm_histogram_quantile, [:pointer, :double], :double
+  attach_function :serialcomm_filter_field, [:pointer, :int, :int, :float], :int
+  attach_function :serialcomm_filter_decimation, [:pointer, :uint], :void
+  attach_function :serialcomm_filtered_read, [:pointer, :pointer], :ulong
+  attach_function :serialcomm_cycles_track, [:pointer, :int], :int
+  attach_function :serialcomm_cycles_take, [:pointer, :pointer, :ulong], :ulong
+  attach_function :serialcomm_get_cycles_dropped, [:pointer], :ulong
+  attach_function :serialcomm_get_snapshot, [:pointer, :pointer], :ulong
+  attach_function :serialcomm_update_snapshot, [:pointer, :int, :pointer], :long, blocking: true
+  attach_function :serialcomm_wait_snapshot, [:pointer, :ulong, :int, :pointer], :ulong, blocking: true
+  attach_function :serialcomm_history_read, [:pointer, :ulong, :pointer, :ulong], :ulong
+  attach_function :serialcomm_manager_new, [:uint], :pointer
+  attach_function :serialcomm_manager_free, [:pointer], :void
+  attach_function :serialcomm_manager_add, [:pointer, :string, :uint], :pointer, blocking: true
+  attach_function :serialcomm_manager_remove, [:pointer, :pointer], :void
+  attach_function :serialcomm_manager_send_group, [:pointer, :uint, :int, :float], :ulong
+  attach_function :serialcomm_manager_online, [:pointer, :pointer], :int
+  attach_function :serialcomm_manager_get_cpu_time, [:pointer], :double
   
   [
     :serialcomm_get_t_meas,
@@ -107,14 +296,50 @@ class SerialComm
   include SerialCommInterface
   include ObjectSpace
 
-  def initialize(port)
+  ERR_TIMEOUT = SerialCommInterface.serialcomm_err_timeout
+
+  ERR_CANNOT_SCHEDULE = SerialCommInterface.serialcomm_err_cannot_schedule
+
+  # Command codes of the parameters (CommandCode in messages.h), for configure
+  CONFIG_COMMANDS = {
+    t_set: 9,
+    p_high: 10,
+    p_low: 11,
+    p_set: 12,
+    PI_kp: 14,
+    PI_ki: 15,
+    cycle_max: 16,
+    cycle: 17,
+    period: 18,
+    duty_cycle: 19
+  }
+
+  # Values of the protocol option (SerialCommProtocol)
+  PROTOCOLS = { legacy: 1, framed: 2, negotiate: 3 }
+
+  # Options: baud: line speed, low_latency: true for the driver low latency mode,
+  # rt_priority: SCHED_FIFO priority of the listener and writer, cpus: their CPUs,
+  # protocol: :legacy, :framed, or :negotiate to request the framed one if supported
+  def initialize(port, timeout_ms = 5000, baud: 0, low_latency: false, rt_priority: 0, cpus: [], protocol: :legacy)
     raise ArgumentError, "port must be a string" unless port.is_a? String
-    raise ArgumentError, "Serial connection #{port} does not exist" unless File.exist? port
+    raise ArgumentError, "Unknown protocol #{protocol}" unless PROTOCOLS.key? protocol
+    unless port =~ /^(pty|loopback):/
+      path = port.sub(/^(termios|wiringpi):/, '').sub(/^replay:(.*?)(@[^@]*)?$/, '\\1')
+      raise ArgumentError, "Serial connection #{port} does not exist" unless File.exist? path
+    end
 
     @port = port
-    @sc = serialcomm_initialize(port)
-    if serialcomm_check_errors() != 0
-     raise RuntimeError, "Connection error for SerialComm class"
+    cpu_mask = cpus.inject(0) { |m, c| m | (1 << c) }
+    @sc = serialcomm_initialize_ex(port, baud, low_latency ? 1 : 0, rt_priority, cpu_mask, PROTOCOLS[protocol], timeout_ms)
+    err = serialcomm_check_errors()
+    if @sc.null?
+      raise RuntimeError, "No answer from #{port} in #{timeout_ms} ms" if err == ERR_TIMEOUT
+      raise RuntimeError, "Connection error for SerialComm class"
+    elsif err == ERR_CANNOT_SCHEDULE
+      warn "SerialComm: cannot apply real time priority or CPU affinity on #{port}"
+    elsif err != 0
+      serialcomm_destroy(@sc)
+      raise RuntimeError, "Connection error for SerialComm class"
     end
   end
 
@@ -122,6 +347,163 @@ class SerialComm
     serialcomm_update(@sc)
   end
 
+  def update_wait(timeout_ms = 100)
+    frame = serialcomm_update_wait(@sc, timeout_ms)
+    frame < 0 ? nil : frame
+  end
+
+  # The whole last frame, read with a single call (all the fields of the same frame)
+  def snapshot
+    s = SerialCommOutput.new
+    serialcomm_get_snapshot(@sc, s)
+    s
+  end
+
+  # Requests an update and returns it (nil on timeout), with a single call that
+  # releases the interpreter lock while waiting
+  def update_snapshot(timeout_ms = 100)
+    s = SerialCommOutput.new
+    serialcomm_update_snapshot(@sc, timeout_ms, s) < 0 ? nil : s
+  end
+
+  # Waits for a frame newer than after (e.g. while streaming): returns [number, frame],
+  # or nil on timeout. Other threads keep running while waiting.
+  def wait_snapshot(after, timeout_ms = 100)
+    s = SerialCommOutput.new
+    n = serialcomm_wait_snapshot(@sc, after, timeout_ms, s)
+    n == 0 ? nil : [n, s]
+  end
+
+  # The frames received after since (up to n), as SerialCommRecord
+  def history(since = 0, n = 256)
+    buf = FFI::MemoryPointer.new(SerialCommRecord, n)
+    count = serialcomm_history_read(@sc, since, buf, n)
+    (0...count).map { |i| SerialCommRecord.new(buf + i * SerialCommRecord.size) }
+  end
+
+  def stream(period_ms)
+    raise ArgumentError, "period must be a positive integer" unless period_ms.is_a? Integer and period_ms > 0
+    raise RuntimeError, "Streaming needs the framed protocol" unless protocol == :framed
+    serialcomm_stream_start(@sc, period_ms)
+  end
+
+  def stream_stop
+    serialcomm_stream_stop(@sc) if protocol == :framed
+  end
+
+  def stream_missed
+    serialcomm_get_stream_missed(@sc)
+  end
+
+  def stream_duplicated
+    serialcomm_get_stream_duplicated(@sc)
+  end
+
+  def compact(key_interval = 50)
+    raise ArgumentError, "key interval must be a non negative integer" unless key_interval.is_a? Integer and key_interval >= 0
+    raise RuntimeError, "Compact telemetry needs the framed protocol" unless protocol == :framed
+    serialcomm_compact_telemetry(@sc, key_interval)
+  end
+
+  def record(path, max_bytes = 64 * 1024 * 1024)
+    raise ArgumentError, "path must be a string" unless path.is_a? String
+    raise RuntimeError, "Cannot record on #{path}" if serialcomm_recorder_start(@sc, path, max_bytes) != 0
+  end
+
+  def record_stop
+    serialcomm_recorder_stop(@sc)
+  end
+
+  # Archives the received frames in a compressed columnar file (see SerialCommArchive)
+  def archive(path)
+    raise RuntimeError, "Cannot archive on #{path}" if serialcomm_archive_record(@sc, path) != 0
+  end
+
+  def archive_stop
+    serialcomm_archive_record_stop(@sc)
+  end
+
+  # Shares the received frames with the other local processes (see SerialCommBus),
+  # returns the port name to open them with
+  def publish
+    raise RuntimeError, "Cannot publish the frames" if serialcomm_bus_publish(@sc) != 0
+    buf = FFI::MemoryPointer.new(:char, 256)
+    serialcomm_bus_published_port(@sc, buf, buf.size) == 0 ? buf.read_string : nil
+  end
+
+  def unpublish
+    serialcomm_bus_unpublish(@sc)
+  end
+
+  def replay_finished?
+    serialcomm_replay_finished(@sc) != 0
+  end
+
+  def replay_rate
+    serialcomm_get_replay_rate(@sc)
+  end
+
+  def listener_cpu_time
+    serialcomm_get_listener_cpu_time(@sc)
+  end
+
+  def resync_count
+    serialcomm_get_resync_count(@sc)
+  end
+
+  def discarded_bytes
+    serialcomm_get_discarded_bytes(@sc)
+  end
+
+  def protocol
+    [nil, :legacy, :framed][serialcomm_get_protocol(@sc)]
+  end
+
+  # Counters and latency histograms of the link, see SerialCommStats
+  def stats
+    s = SerialCommStats.new
+    serialcomm_stats_read(@sc, s)
+    s.to_h
+  end
+
+  # Filters a field in the listener: kind is one of SerialCommFiltered::KINDS,
+  # param is alpha for :ema, the window in samples otherwise
+  def filter(field, kind, param = 1)
+    f = SerialCommFiltered::FIELDS.index(field)
+    k = SerialCommFiltered::KINDS.index(kind)
+    raise ArgumentError, "Unknown field #{field}" unless f
+    raise ArgumentError, "Unknown filter #{kind}" unless k
+    raise ArgumentError, "Invalid parameter #{param} for #{kind}" if serialcomm_filter_field(@sc, f, k, param.to_f) != 0
+  end
+
+  # Publishes the filtered values every n frames
+  def decimate(n)
+    serialcomm_filter_decimation(@sc, n)
+  end
+
+  # Last filtered values, with the number of their frame (0 if none yet)
+  def filtered
+    s = SerialCommFiltered.new
+    serialcomm_filtered_read(@sc, s)
+    s.to_h
+  end
+
+  # Computes the aggregates of each pressure cycle in the listener (see SerialCommCycle)
+  def track_cycles(on = true)
+    raise RuntimeError, "Cannot track the cycles" if serialcomm_cycles_track(@sc, on ? 1 : 0) != 0
+  end
+
+  # Takes the completed cycles from the queue, as hashes (at most n)
+  def cycles(n = 256)
+    buf = FFI::MemoryPointer.new(SerialCommCycle, n)
+    count = serialcomm_cycles_take(@sc, buf, n)
+    (0...count).map { |i| SerialCommCycle.new(buf + i * SerialCommCycle.size).to_h }
+  end
+
+  def cycles_dropped
+    serialcomm_get_cycles_dropped(@sc)
+  end
+
   def t_meas
     serialcomm_get_t_meas(@sc)
   end
@@ -287,6 +669,21 @@ class SerialComm
     serialcomm_set_cycle_max(@sc, f)
   end
 
+  # Applies a batch of parameters, e.g. configure(PI_kp: 2.0, PI_ki: 0.1), and waits
+  # for the device to acknowledge all of them. Returns the round trip time in seconds
+  # (nil for a legacy device, that does not acknowledge the commands).
+  def configure(params, timeout_ms = 500)
+    seq = -1
+    params.each do |k, v|
+      raise ArgumentError, "Unknown parameter #{k}" unless CONFIG_COMMANDS.key? k
+      seq = serialcomm_send_command_acked(@sc, CONFIG_COMMANDS[k], v.to_f)
+    end
+    return nil if seq < 0
+    latency = serialcomm_wait_command_ack(@sc, seq, timeout_ms)
+    raise RuntimeError, "Configuration not acknowledged by #{@port}" if latency < 0
+    latency
+  end
+
   def auto_temp
     serialcomm_set_temperature_auto(@sc)
   end
@@ -340,7 +737,24 @@ class SerialComm
   end
 
   def close
-    serialcomm_destroy(@sc)
+    if @manager
+      @manager.remove(self)
+    else
+      serialcomm_destroy(@sc)
+    end
+  end
+
+  # Connection served by a SerialCommManager, see SerialCommManager#add
+  def SerialComm.managed(port, handle, manager)
+    obj = allocate
+    obj.instance_variable_set(:@port, port)
+    obj.instance_variable_set(:@sc, handle)
+    obj.instance_variable_set(:@manager, manager)
+    obj
+  end
+
+  def handle
+    @sc
   end
 
   def SerialComm.finalize(id)
@@ -349,3 +763,117 @@ class SerialComm
   end
 end
 
+# Many connections served by a small pool of I/O threads, with group commands
+class SerialCommManager
+  include SerialCommInterface
+  GROUP_ALL = 0xFFFFFFFF
+
+  def initialize(threads = 1)
+    @mgr = serialcomm_manager_new(threads)
+    raise RuntimeError, "Cannot create the device manager" if @mgr.null?
+    @devices = []
+  end
+
+  attr_reader :devices
+
+  def add(port, group = 0)
+    raise ArgumentError, "port must be a string" unless port.is_a? String
+    handle = serialcomm_manager_add(@mgr, port, group)
+    raise RuntimeError, "Connection error for #{port}" if handle.null?
+    dev = SerialComm.managed(port, handle, self)
+    @devices << dev
+    dev
+  end
+
+  def remove(dev)
+    return unless @devices.delete(dev)
+    serialcomm_manager_remove(@mgr, dev.handle)
+  end
+
+  def online?(dev)
+    serialcomm_manager_online(@mgr, dev.handle) != 0
+  end
+
+  def send_group(group, cmd, value = 0.0)
+    serialcomm_manager_send_group(@mgr, group, cmd, value)
+  end
+
+  def cpu_time
+    serialcomm_manager_get_cpu_time(@mgr)
+  end
+
+  def close
+    @devices.clear
+    serialcomm_manager_free(@mgr)
+  end
+end
+
+# Frames published by another process on a port (SerialComm#publish), read
+# from shared memory without opening the serial line
+class SerialCommBus
+  include SerialCommInterface
+
+  def initialize(port)
+    raise ArgumentError, "port must be a string" unless port.is_a? String
+    @rd = serialcomm_bus_reader_open(port)
+    raise RuntimeError, "#{port} is not published" if @rd.null?
+  end
+
+  # Waits for a frame newer than after: returns [number, frame], or nil on timeout
+  def wait_snapshot(after, timeout_ms = 100)
+    s = SerialCommOutput.new
+    n = serialcomm_bus_reader_wait_snapshot(@rd, after, timeout_ms, s)
+    n == 0 ? nil : [n, s]
+  end
+
+  # The frames published after since (up to n), as SerialCommRecord
+  def history(since = 0, n = 256)
+    buf = FFI::MemoryPointer.new(SerialCommRecord, n)
+    count = serialcomm_bus_reader_history(@rd, since, buf, n)
+    (0...count).map { |i| SerialCommRecord.new(buf + i * SerialCommRecord.size) }
+  end
+
+  def closed?
+    serialcomm_bus_reader_closed(@rd) != 0
+  end
+
+  def close
+    serialcomm_bus_reader_close(@rd)
+  end
+end
+
+# Reader of an archive written by SerialComm#archive
+class SerialCommArchive
+  include SerialCommInterface
+
+  def initialize(path)
+    raise ArgumentError, "path must be a string" unless path.is_a? String
+    @rd = serialcomm_archive_reader_open(path)
+    raise RuntimeError, "#{path} is not an archive" if @rd.null?
+  end
+
+  def frames
+    serialcomm_archive_reader_frames(@rd)
+  end
+
+  # Moves to the first frame of the cycle, false past the end of the archive
+  def seek_cycle(cycle)
+    serialcomm_archive_reader_seek_cycle(@rd, cycle) == 0
+  end
+
+  # Moves to the first frame received at or after time_ns, false past the end
+  def seek_time(time_ns)
+    serialcomm_archive_reader_seek_time(@rd, time_ns) == 0
+  end
+
+  # The next frames (up to n), as SerialCommRecord, empty at the end
+  def read(n = 256)
+    buf = FFI::MemoryPointer.new(SerialCommRecord, n)
+    count = serialcomm_archive_reader_read(@rd, buf, n)
+    (0...count).map { |i| SerialCommRecord.new(buf + i * SerialCommRecord.size) }
+  end
+
+  def close
+    serialcomm_archive_reader_close(@rd)
+  end
+end
@@ -0,0 +1,431 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include "libserialcomm_crc.h"
+#include "libserialcomm_sim.h"
+
+#define SIM_P_SUPPLY 40.0f  /**< Pressure reached with the full actuation */
+#define SIM_P_TAU 0.2f      /**< Time constant of the pressure (s) */
+#define SIM_T_TAU 30.0f     /**< Time constant of the temperature (s) */
+#define SIM_T_AMBIENT 25.0f /**< Temperature without control */
+#define SIM_U_MAX 255.0f    /**< Saturation of the pressure actuation */
+
+/** \brief Current CLOCK_MONOTONIC time in nanoseconds */
+static uint64_t serialcomm_sim_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+} // serialcomm_sim_now
+
+/** \brief Measurement noise, uniform in [-amplitude, amplitude] */
+static float serialcomm_sim_noise(SerialCommSim * sim, float amplitude) {
+  sim->noise = sim->noise * 1664525u + 1013904223u;
+  return amplitude * ((float)(sim->noise >> 8) / (float)(1u << 23) - 1.0f);
+} // serialcomm_sim_noise
+
+extern void serialcomm_sim_init(SerialCommSim * sim) {
+  serialcomm_crc_init();
+  memset(sim, 0, sizeof(SerialCommSim));
+  sim->version = 1;
+  sim->max_version = FRAME_VERSION;
+  sim->out.s.t_meas = SIM_T_AMBIENT;
+  sim->out.s.q_meas = SIM_P_SUPPLY;
+  sim->out.s.kp = 6.0f;
+  sim->out.s.ki = 0.3f;
+  sim->out.s.t_set = SIM_T_AMBIENT;
+  sim->out.s.period = 6.0f;
+  sim->out.s.duty_cycle = 0.5f;
+  sim->out.s.max_cycle = 1000000.0f;
+  sim->out.s.config = CtrlEnPActuator;
+  sim->out.s.state = StateSerialSetup;
+  sim->out.s.error = ErrMsgNoError;
+  sim->p_high = 25.0f;
+  sim->p_low = 5.0f;
+  sim->noise = 0x12345678u;
+  sim->last_ns = serialcomm_sim_now();
+  sim->cycle_ns = sim->last_ns;
+} // serialcomm_sim_init
+
+extern void serialcomm_sim_step(SerialCommSim * sim, uint64_t now_ns) {
+  output_s * o = &(sim->out.s);
+  if (now_ns <= sim->last_ns)
+    return;
+  float dt = (float)(now_ns - sim->last_ns) * 1e-9f;
+  sim->last_ns = now_ns;
+
+  // Square wave reference and cycle counter
+  if (o->state == StateRunning && o->period > 0.0f) {
+    uint64_t period_ns = (uint64_t)(o->period * 1e9f);
+    while (now_ns - sim->cycle_ns >= period_ns) {
+      sim->cycle_ns += period_ns;
+      o->cycle += 1.0f;
+    }
+    float phase = (float)(now_ns - sim->cycle_ns) * 1e-9f / o->period;
+    o->p_set = (phase < o->duty_cycle) ? sim->p_high : sim->p_low;
+    if (o->max_cycle > 0.0f && o->cycle >= o->max_cycle) {
+      o->state = StateWaiting;
+      o->error = ErrMsgCycleLimit;
+    }
+  } else {
+    sim->cycle_ns = now_ns;
+  }
+
+  // PI pressure control, first order actuator
+  float p = o->p_meas;
+  if ((o->config & CtrlEnPActuator) && o->state == StateRunning) {
+    float e = o->p_set - p;
+    sim->integral += e * dt;
+    float u = o->kp * e + o->ki * sim->integral;
+    o->u_pres = (u < 0.0f) ? 0.0f : ((u > SIM_U_MAX) ? SIM_U_MAX : u);
+  } else if (o->state != StateRunning) {
+    o->u_pres = 0.0f;
+  }
+  p += dt * (o->u_pres / SIM_U_MAX * SIM_P_SUPPLY - p) / SIM_P_TAU;
+  o->p_meas = p + serialcomm_sim_noise(sim, 0.02f);
+  o->q_meas = SIM_P_SUPPLY - 0.1f * p + serialcomm_sim_noise(sim, 0.02f);
+
+  // Temperature towards the set point when controlled, otherwise towards ambient
+  float t = o->t_meas;
+  float target = (o->config & (CtrlEnChiller | CtrlEnResistance)) ? o->t_set : SIM_T_AMBIENT;
+  t += dt * (target - t) / SIM_T_TAU;
+  o->t_meas = t + serialcomm_sim_noise(sim, 0.01f);
+} // serialcomm_sim_step
+
+/** \brief Writes len bytes on fd */
+static int serialcomm_sim_write(int fd, const char * b, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, b + done, len - done);
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    done += (size_t)n;
+  }
+  return 0;
+} // serialcomm_sim_write
+
+/** \brief Completes and writes a frame of the framed protocol
+ *
+ * \param f the frame, with the payload already in place after the header (at
+ *        least frame_header_size + len + frame_crc_size bytes)
+ */
+static int serialcomm_sim_frame(int fd, FrameType type, char * f, size_t len) {
+  return serialcomm_sim_write(fd, f, serialcomm_frame_seal(f, type, len));
+} // serialcomm_sim_frame
+
+/** \brief Encodes the changes of the state since the last frame sent (FrameDelta)
+ *
+ * The state rebuilt by the host is tracked in sim->sent: a measurement is sent
+ * again only when it changes after the rounding to 1 / DELTA_SCALE.
+ * \return the length of the payload
+ */
+static size_t serialcomm_sim_delta(SerialCommSim * sim, unsigned char * p) {
+  unsigned int mask = 0;
+  size_t pos = delta_header_size;
+  for (int i = 0; i < DeltaFieldCount; i++) {
+    if (i >= DeltaConfig) {
+      size_t k = DeltaConfig * sizeof(float) + (i - DeltaConfig);
+      if (sim->out.b[k] != sim->sent.b[k]) {
+        p[pos++] = (unsigned char)sim->out.b[k];
+        sim->sent.b[k] = sim->out.b[k];
+        mask |= 1u << i;
+      }
+      continue;
+    }
+
+    float v, last;
+    memcpy(&v, sim->out.b + i * sizeof(float), sizeof(v));
+    memcpy(&last, sim->sent.b + i * sizeof(float), sizeof(last));
+    int16_t q = DELTA_ESCAPE;
+    if (DELTA_SCALED_FIELDS & (1u << i)) {
+      float scaled = roundf(v * DELTA_SCALE);
+      if (scaled > (float)DELTA_ESCAPE && scaled <= 32767.0f) {
+        q = (int16_t)scaled;
+        v = (float)q / DELTA_SCALE;
+      }
+    }
+    if (memcmp(&v, &last, sizeof(v)) == 0)
+      continue;
+    if (DELTA_SCALED_FIELDS & (1u << i)) {
+      memcpy(p + pos, &q, sizeof(q));
+      pos += sizeof(q);
+    }
+    if (q == DELTA_ESCAPE) {
+      memcpy(p + pos, &v, sizeof(v));
+      pos += sizeof(v);
+    }
+    memcpy(sim->sent.b + i * sizeof(float), &v, sizeof(v));
+    mask |= 1u << i;
+  }
+  p[0] = ++(sim->delta_seq);
+  p[1] = (unsigned char)(mask & 0xFF);
+  p[2] = (unsigned char)(mask >> 8);
+  return pos;
+} // serialcomm_sim_delta
+
+/** \brief Sends the current state, with its checksum (or framed, with its CRC) */
+static int serialcomm_sim_send(SerialCommSim * sim, int fd) {
+  serialcomm_sim_step(sim, serialcomm_sim_now());
+  char check = 0x00;
+  for (size_t i = 0; i < output_size; i++)
+    check ^= sim->out.b[i];
+  sim->out.s.check = check;
+
+  if (sim->version != FRAME_VERSION)
+    return serialcomm_sim_write(fd, sim->out.b, output_buffer_size);
+
+  char f[frame_max_size];
+  if (sim->compact && sim->key_left) {
+    size_t len = serialcomm_sim_delta(sim, (unsigned char*)f + frame_header_size);
+    sim->key_left--;
+    return serialcomm_sim_frame(fd, FrameDelta, f, len);
+  }
+  memcpy(f + frame_header_size, sim->out.b, output_size);
+  memcpy(sim->sent.b, sim->out.b, output_buffer_size);
+  sim->delta_seq = 0;
+  sim->key_left = sim->compact ? sim->compact - 1 : 0;
+  return serialcomm_sim_frame(fd, FrameOutput, f, output_size);
+} // serialcomm_sim_send
+
+/** \brief Executes a command received from the host */
+static int serialcomm_sim_command(SerialCommSim * sim, const input_u * in, int fd) {
+  output_s * o = &(sim->out.s);
+  float value = in->s.value;
+
+  switch ((CommandCode)in->s.command) {
+    case cmdHearthbeat:
+      return serialcomm_sim_send(sim, fd);
+    case cmdManualTemperatureControl:
+      o->config &= ~(CtrlEnChiller | CtrlEnResistance);
+      break;
+    case cmdAutomaticTemperatureControl:
+      o->config |= CtrlEnResistance;
+      break;
+    case cmdManualPressureControl:
+      o->config &= ~CtrlEnPActuator;
+      break;
+    case cmdAutomaticPressureControl:
+      o->config |= CtrlEnPActuator;
+      break;
+    case cmdTogglePauseCycle:
+      if (o->state == StateRunning)
+        o->state = StatePause;
+      else if (o->state == StatePause)
+        o->state = StateRunning;
+      break;
+    case cmdEmergencyStopCycle:
+      o->state = StateAlarm;
+      o->error = ErrMsgSerialStop;
+      break;
+    case cmdToggleChillerActuation:
+      o->config ^= CtrlEnChiller;
+      break;
+    case cmdToggleResistanceActuation:
+      o->config ^= CtrlEnResistance;
+      break;
+    case cmdSetTemperature:
+      o->t_set = value;
+      break;
+    case cmdSetPressureHigh:
+      sim->p_high = value;
+      break;
+    case cmdSetPressureLow:
+      sim->p_low = value;
+      break;
+    case cmdSetPressure:
+      o->p_set = value;
+      break;
+    case cmdOverridePIControl:
+      o->u_pres = value;
+      break;
+    case cmdSetPIProportionalGain:
+      o->kp = value;
+      break;
+    case cmdSetPIIntegrativeGain:
+      o->ki = value;
+      break;
+    case cmdSetMaximumCycleNumber:
+      o->max_cycle = value;
+      break;
+    case cmdSetCurrentCycleNumber:
+      o->cycle = value;
+      break;
+    case cmdSetReferencePeriod:
+      o->period = value;
+      break;
+    case cmdSetReferenceDutyCycle:
+      o->duty_cycle = value;
+      break;
+    case cmdSystemReboot: {
+      unsigned char max_version = sim->max_version;
+      serialcomm_sim_init(sim);
+      sim->max_version = max_version;
+      break;
+    }
+    case cmdStartCycle:
+      o->state = StateRunning;
+      o->error = ErrMsgNoError;
+      break;
+    case cmdStreamTelemetry:
+      sim->stream_ms = (value > 0.0f) ? (unsigned int)value : 0;
+      sim->stream_ns = serialcomm_sim_now();
+      break;
+    case cmdProtocolVersion:
+      if (value >= 1.0f && value <= (float)sim->max_version)
+        sim->version = (unsigned char)value;
+      break;
+    case cmdCompactTelemetry:
+      if (sim->version == FRAME_VERSION) {
+        sim->compact = (value >= 1.0f) ? (unsigned int)value : 0;
+        sim->key_left = 0;
+      }
+      break;
+    case cmdSaveStorageConfig:
+    case cmdLoadStorageConfig:
+    case cmdLoadStorageCycle:
+    default:
+      break;
+  }
+  return 0;
+} // serialcomm_sim_command
+
+/** \brief Executes a sequenced command once and in order, then acknowledges it */
+static int serialcomm_sim_sequenced(SerialCommSim * sim, const sequenced_s * p, int fd) {
+  if (!sim->seq_valid || p->epoch != sim->seq_epoch) {
+    sim->seq_valid = 1;
+    sim->seq_epoch = p->epoch;
+    sim->seq_last = (uint16_t)(p->seq - 1);
+  }
+  if (p->seq == (uint16_t)(sim->seq_last + 1)) {
+    input_u in;
+    in.s.command = p->command;
+    in.s.value = p->value;
+    if (serialcomm_sim_command(sim, &in, fd) < 0)
+      return -1;
+    sim->seq_last = p->seq;
+  } else if ((int16_t)(p->seq - sim->seq_last) > 0) {
+    return 0; // After a gap: waits for the retransmission of the missing commands
+  }
+
+  char f[frame_ack_size];
+  ack_s ack = { sim->seq_epoch, sim->seq_last };
+  memcpy(f + frame_header_size, &ack, sizeof(ack_s));
+  return serialcomm_sim_frame(fd, FrameAck, f, sizeof(ack_s));
+} // serialcomm_sim_sequenced
+
+extern int serialcomm_sim_input(SerialCommSim * sim, const char * b, size_t len, int fd) {
+  for (size_t i = 0; i < len; i++) {
+    if (!sim->synced) {
+      if (b[i] == SIGNATURE_MESSAGE) {
+        sim->synced = 1;
+        sim->in.len = 0;
+        sim->out.s.state = StateWaiting;
+      }
+      continue;
+    }
+    if (sim->in.len == 0 && b[i] == SIGNATURE_MESSAGE) {
+      // A new host: the signature is not a command code, the board would reset on open
+      sim->out.s.error = ErrMsgNoError;
+      sim->out.s.state = StateWaiting;
+      sim->stream_ms = 0;
+      sim->version = 1;
+      sim->compact = 0;
+      sim->seq_valid = 0;
+      continue;
+    }
+
+    input_u in;
+    sequenced_s p;
+    switch (serialcomm_command_push(&(sim->in), b[i], sim->max_version >= FRAME_VERSION, &in, &p)) {
+      case SerialCommCommandPartial:
+        break;
+      case SerialCommCommandInvalid:
+        // The firmware slides by one byte on a bad checksum
+        sim->out.s.error = ErrMsgSerialCheck;
+        break;
+      case SerialCommCommandPlain:
+        if (serialcomm_sim_command(sim, &in, fd) < 0)
+          return -1;
+        break;
+      case SerialCommCommandSequenced:
+        if (serialcomm_sim_sequenced(sim, &p, fd) < 0)
+          return -1;
+        break;
+    }
+  }
+  return 0;
+} // serialcomm_sim_input
+
+extern int serialcomm_sim_serve(SerialCommSim * sim, int fd, int wake_fd) {
+  struct pollfd fds[2];
+  fds[0].fd = fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = wake_fd;
+  fds[1].events = POLLIN;
+  char b[256];
+
+  while (1) {
+    int timeout = -1;
+    if (sim->stream_ms) {
+      uint64_t now = serialcomm_sim_now();
+      timeout = (sim->stream_ns > now) ? (int)((sim->stream_ns - now + 999999ULL) / 1000000ULL) : 0;
+    }
+
+    int ready = poll(fds, (wake_fd >= 0) ? 2 : 1, timeout);
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (wake_fd >= 0 && fds[1].revents)
+      return 0;
+
+    if (fds[0].revents & POLLIN) {
+      ssize_t n = read(fd, b, sizeof(b));
+      if (n < 0 && errno != EINTR && errno != EAGAIN)
+        return -1;
+      if (n == 0 || (n > 0 && serialcomm_sim_input(sim, b, (size_t)n, fd) < 0))
+        return -1;
+    } else if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+      return -1;
+    }
+
+    if (sim->stream_ms && serialcomm_sim_now() >= sim->stream_ns) {
+      sim->stream_ns += (uint64_t)sim->stream_ms * 1000000ULL;
+      if (serialcomm_sim_send(sim, fd) < 0)
+        return -1;
+    }
+  }
+} // serialcomm_sim_serve
@@ -0,0 +1,95 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_SIM_H_
+#define LIBSERIALCOMM_SIM_H_
+
+/** \brief Simulator of the remote controller
+ *
+ * The simulator speaks the protocol of messages.h on a file descriptor, as the
+ * firmware does on the serial: it waits for the signature, then it executes
+ * the commands and answers the hearthbeats with an output frame (or streams
+ * them, after cmdStreamTelemetry). It switches to the framed protocol when
+ * requested (cmdProtocolVersion), unless max_version is lowered to emulate a
+ * legacy firmware. In the framed protocol the compact telemetry is available too
+ * (cmdCompactTelemetry) and the sequenced commands are acknowledged. The plant is a simple first order model:
+ * the pressure follows the square wave reference through the PI controller,
+ * and the temperature moves towards its set point.
+ *
+ * It is used by the "pty:" transport, and by the simulator executable, that
+ * exposes it on a pseudo-terminal for hosts that open it as a serial port.
+ */
+
+#include <stdint.h>
+#include "libserialcomm.h"
+#include "libserialcomm_crc.h"
+
+/** \brief State of the simulated controller */
+typedef struct SerialCommSim {
+  output_u out; /**< State of the controller, as sent to the host */
+  float p_high; /**< Pressure of the reference square wave, high level */
+  float p_low; /**< Pressure of the reference square wave, low level */
+  float integral; /**< Integral of the pressure error (PI controller) */
+  char synced; /**< The signature has been received */
+  unsigned int stream_ms; /**< Period of the telemetry stream, 0 if not streaming */
+  uint64_t last_ns; /**< Time of the last step of the model */
+  uint64_t cycle_ns; /**< Start time of the current cycle */
+  uint64_t stream_ns; /**< Time of the next streamed frame */
+  uint32_t noise; /**< State of the measurement noise generator */
+  unsigned char version; /**< Protocol version of the output frames (1 for legacy) */
+  unsigned char max_version; /**< Highest protocol version supported */
+  unsigned int compact; /**< Frames between two full frames of the compact telemetry, 0 if disabled */
+  unsigned int key_left; /**< Compact frames left before the next full frame */
+  unsigned char delta_seq; /**< Sequence number of the last compact frame */
+  output_u sent; /**< State as rebuilt by the host from the frames sent */
+  char seq_valid; /**< A sequenced command has been received from this host */
+  unsigned char seq_epoch; /**< Epoch of the sequenced commands */
+  uint16_t seq_last; /**< Number of the last sequenced command executed */
+  SerialCommCommandParser in; /**< Partial command received */
+} SerialCommSim;
+
+/** \brief Initializes the simulator state (waiting for the signature, framed protocol supported) */
+extern void serialcomm_sim_init(SerialCommSim * sim);
+/** \brief Advances the plant model to now_ns (CLOCK_MONOTONIC nanoseconds) */
+extern void serialcomm_sim_step(SerialCommSim * sim, uint64_t now_ns);
+/** \brief Processes the bytes received from the host, answering on fd
+ *
+ * \return -1 if an answer cannot be written
+ */
+extern int serialcomm_sim_input(SerialCommSim * sim, const char * b, size_t len, int fd);
+/** \brief Serves the host on fd until wake_fd becomes readable or fd is closed
+ *
+ * \param sim the simulator state
+ * \param fd descriptor connected to the host
+ * \param wake_fd descriptor that stops the simulator when readable (or -1)
+ * \return 0 when stopped through wake_fd, -1 on errors of fd
+ */
+extern int serialcomm_sim_serve(SerialCommSim * sim, int fd, int wake_fd);
+
+#endif /* LIBSERIALCOMM_SIM_H_ */
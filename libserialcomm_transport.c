@@ -0,0 +1,360 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "libserialcomm_transport.h"
+#include "libserialcomm_sim.h"
+#ifdef SERIALCOMM_WIRINGPI
+#include <wiringSerial.h>
+#endif
+
+/** \brief State of the pseudo-terminal transport */
+typedef struct SerialCommPty {
+  int master; /**< Master side, served by the simulator */
+  int wakeup; /**< Event that stops the simulator */
+  pthread_t thread; /**< Simulator thread */
+  SerialCommSim sim; /**< Simulator state */
+} SerialCommPty;
+
+static const SerialCommTransport * serialcomm_transports[] = {
+  &serialcomm_transport_termios,
+  &serialcomm_transport_loopback,
+  &serialcomm_transport_pty,
+  &serialcomm_transport_replay,
+  &serialcomm_transport_unix,
+#ifdef SERIALCOMM_WIRINGPI
+  &serialcomm_transport_wiringpi,
+#endif
+  NULL
+};
+
+extern const SerialCommTransport * serialcomm_transport_find(const char * port, const char ** path) {
+  *path = port;
+  const char * colon = port ? strchr(port, ':') : NULL;
+  if (colon) {
+    for (size_t i = 0; serialcomm_transports[i]; i++) {
+      size_t len = strlen(serialcomm_transports[i]->name);
+      if ((size_t)(colon - port) == len && strncmp(port, serialcomm_transports[i]->name, len) == 0) {
+        *path = colon + 1;
+        return serialcomm_transports[i];
+      }
+    }
+  }
+#ifdef SERIALCOMM_WIRINGPI
+  return &serialcomm_transport_wiringpi;
+#else
+  return &serialcomm_transport_termios;
+#endif
+} // serialcomm_transport_find
+
+
+extern ssize_t serialcomm_fd_read(SerialComm * sc, void * b, size_t len) {
+  return read(sc->serial, b, len);
+} // serialcomm_fd_read
+
+extern ssize_t serialcomm_fd_writev(SerialComm * sc, const struct iovec * iov, int iovcnt) {
+  return writev(sc->serial, iov, iovcnt);
+} // serialcomm_fd_writev
+
+extern void serialcomm_fd_flush(SerialComm * sc) {
+  // The output is kept: it may still hold the signature. Not a terminal: nothing to flush
+  tcflush(sc->serial, TCIFLUSH);
+} // serialcomm_fd_flush
+
+extern void serialcomm_fd_close(SerialComm * sc) {
+  close(sc->serial);
+} // serialcomm_fd_close
+
+extern int serialcomm_fd_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) ? -1 : 0;
+} // serialcomm_fd_nonblock
+
+
+/** \brief Termios speed of a line speed in bps, or B0 if not supported */
+static speed_t serialcomm_baud_speed(unsigned int baud) {
+  switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 576000: return B576000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 1152000: return B1152000;
+    case 1500000: return B1500000;
+    case 2000000: return B2000000;
+    default: return B0;
+  }
+} // serialcomm_baud_speed
+
+extern int serialcomm_termios_setup(int fd, const SerialCommOptions * opt) {
+  speed_t speed = serialcomm_baud_speed((opt && opt->baud) ? opt->baud : SERIALCOMM_BAUD);
+  struct termios options;
+  if (speed == B0 || tcgetattr(fd, &options) < 0)
+    return -1;
+  cfmakeraw(&options);
+  options.c_cflag |= (CLOCAL | CREAD);
+  options.c_cflag &= ~(CSTOPB | PARENB);
+  options.c_cc[VMIN] = 0;
+  options.c_cc[VTIME] = 0;
+  cfsetispeed(&options, speed);
+  cfsetospeed(&options, speed);
+  return tcsetattr(fd, TCSANOW, &options);
+} // serialcomm_termios_setup
+
+/** \brief Requests the low latency mode to the serial driver
+ *
+ * The driver pushes the received bytes to the reader immediately, instead of
+ * batching them. Not all the drivers support it: errors are ignored.
+ */
+static void serialcomm_low_latency(int fd) {
+  struct serial_struct serial;
+  if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+    serial.flags |= ASYNC_LOW_LATENCY;
+    ioctl(fd, TIOCSSERIAL, &serial);
+  }
+} // serialcomm_low_latency
+
+/** \brief Opens a terminal device in raw mode, non blocking (writes wait in poll, see serialcomm_send_drain) */
+static int serialcomm_termios_open(SerialComm * sc, const char * path) {
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (serialcomm_termios_setup(fd, &(sc->options)) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (sc->options.low_latency)
+    serialcomm_low_latency(fd);
+  return fd;
+} // serialcomm_termios_open
+
+const SerialCommTransport serialcomm_transport_termios = {
+  "termios",
+  serialcomm_termios_open,
+  serialcomm_fd_flush,
+  serialcomm_fd_read,
+  serialcomm_fd_writev,
+  serialcomm_fd_close
+};
+
+
+#ifdef SERIALCOMM_WIRINGPI
+static int serialcomm_wiringpi_open(SerialComm * sc, const char * path) {
+  int fd = serialOpen(path, (int)sc->options.baud);
+  if (fd < 0)
+    return -1;
+  // wiringPi leaves blocking reads with a 10 s VTIME: the listener needs them non blocking
+  struct termios options;
+  int flags = fcntl(fd, F_GETFL);
+  if (tcgetattr(fd, &options) < 0 || flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    serialClose(fd);
+    return -1;
+  }
+  options.c_cc[VMIN] = 0;
+  options.c_cc[VTIME] = 0;
+  if (tcsetattr(fd, TCSANOW, &options) < 0) {
+    serialClose(fd);
+    return -1;
+  }
+  if (sc->options.low_latency)
+    serialcomm_low_latency(fd);
+  return fd;
+} // serialcomm_wiringpi_open
+
+static void serialcomm_wiringpi_close(SerialComm * sc) {
+  serialClose(sc->serial);
+} // serialcomm_wiringpi_close
+
+const SerialCommTransport serialcomm_transport_wiringpi = {
+  "wiringpi",
+  serialcomm_wiringpi_open,
+  serialcomm_fd_flush,
+  serialcomm_fd_read,
+  serialcomm_fd_writev,
+  serialcomm_wiringpi_close
+};
+#endif
+
+
+/** \brief Opens a socket pair, the second end is kept for the device */
+static int serialcomm_loopback_open(SerialComm * sc, const char * path) {
+  int sv[2];
+  int * peer = (int*)malloc(sizeof(int));
+  if (!peer)
+    return -1;
+  // Only the library end is non blocking, the device end is left to the caller
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+    free(peer);
+    return -1;
+  }
+  if (serialcomm_fd_nonblock(sv[0]) < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    free(peer);
+    return -1;
+  }
+  *peer = sv[1];
+  sc->transport_data = peer;
+  return sv[0];
+} // serialcomm_loopback_open
+
+static void serialcomm_loopback_close(SerialComm * sc) {
+  close(sc->serial);
+  if (sc->transport_data) {
+    close(*(int*)sc->transport_data);
+    free(sc->transport_data);
+    sc->transport_data = NULL;
+  }
+} // serialcomm_loopback_close
+
+extern int serialcomm_transport_peer(SerialComm * sc) {
+  if (!sc || sc->transport != &serialcomm_transport_loopback || !sc->transport_data)
+    return -1;
+  return *(int*)sc->transport_data;
+} // serialcomm_transport_peer
+
+const SerialCommTransport serialcomm_transport_loopback = {
+  "loopback",
+  serialcomm_loopback_open,
+  serialcomm_fd_flush,
+  serialcomm_fd_read,
+  serialcomm_fd_writev,
+  serialcomm_loopback_close
+};
+
+
+/** \brief Connects to the socket of a daemon that shares a connection */
+static int serialcomm_unix_open(SerialComm * sc, const char * path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || serialcomm_fd_nonblock(fd) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+} // serialcomm_unix_open
+
+/** \brief Writes on the socket: a daemon that went away is a write error, not a SIGPIPE */
+static ssize_t serialcomm_unix_writev(SerialComm * sc, const struct iovec * iov, int iovcnt) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec*)iov;
+  msg.msg_iovlen = (size_t)iovcnt;
+  return sendmsg(sc->serial, &msg, MSG_NOSIGNAL);
+} // serialcomm_unix_writev
+
+const SerialCommTransport serialcomm_transport_unix = {
+  "unix",
+  serialcomm_unix_open,
+  serialcomm_fd_flush,
+  serialcomm_fd_read,
+  serialcomm_unix_writev,
+  serialcomm_fd_close
+};
+
+
+/** \brief Simulator thread on the master side of the pseudo-terminal */
+static void * serialcomm_pty_thread(void * pty_v) {
+  SerialCommPty * pty = (SerialCommPty*)pty_v;
+  serialcomm_sim_serve(&(pty->sim), pty->master, pty->wakeup);
+  return NULL;
+} // serialcomm_pty_thread
+
+/** \brief Opens a pseudo-terminal pair: the slave is the serial, the master the simulator */
+static int serialcomm_pty_open(SerialComm * sc, const char * path) {
+  SerialCommPty * pty = (SerialCommPty*)malloc(sizeof(SerialCommPty));
+  if (!pty)
+    return -1;
+  serialcomm_sim_init(&(pty->sim));
+  pty->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  pty->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+  char name[128];
+  int fd = -1;
+  if (pty->wakeup >= 0 && pty->master >= 0 && grantpt(pty->master) == 0 &&
+      unlockpt(pty->master) == 0 && ptsname_r(pty->master, name, sizeof(name)) == 0)
+    fd = serialcomm_termios_open(sc, name);
+
+  if (fd < 0 || pthread_create(&(pty->thread), NULL, serialcomm_pty_thread, (void*)pty)) {
+    if (fd >= 0)
+      close(fd);
+    if (pty->master >= 0)
+      close(pty->master);
+    if (pty->wakeup >= 0)
+      close(pty->wakeup);
+    free(pty);
+    return -1;
+  }
+  sc->transport_data = pty;
+  return fd;
+} // serialcomm_pty_open
+
+static void serialcomm_pty_close(SerialComm * sc) {
+  SerialCommPty * pty = (SerialCommPty*)sc->transport_data;
+  if (pty) {
+    uint64_t one = 1;
+    if (write(pty->wakeup, &one, sizeof(one)) == sizeof(one))
+      pthread_join(pty->thread, NULL);
+    close(pty->master);
+    close(pty->wakeup);
+    free(pty);
+    sc->transport_data = NULL;
+  }
+  close(sc->serial);
+} // serialcomm_pty_close
+
+const SerialCommTransport serialcomm_transport_pty = {
+  "pty",
+  serialcomm_pty_open,
+  serialcomm_fd_flush,
+  serialcomm_fd_read,
+  serialcomm_fd_writev,
+  serialcomm_pty_close
+};
@@ -0,0 +1,118 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright (c) 2018, Matteo Ragni
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by Matteo Ragni.
+ * 4. Neither the name of Matteo Ragni nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#ifndef LIBSERIALCOMM_TRANSPORT_H_
+#define LIBSERIALCOMM_TRANSPORT_H_
+
+/** \brief Transport layer of the serial communication
+ *
+ * The library accesses the serial line only through the transport of the
+ * SerialComm structure. All the transports provide a file descriptor (used by
+ * the listener in poll()) and the operations to open, flush, read, write and
+ * close it. The transport is selected by the port name prefix:
+ *
+ *  - "termios:<device>" plain POSIX serial device, 8N1 raw mode, with the line
+ *    speed, VMIN/VTIME and low latency of the SerialCommOptions
+ *  - "wiringpi:<device>" serial device opened through wiringPi (only when the
+ *    library is built with SERIALCOMM_WIRINGPI)
+ *  - "loopback:" local socket pair; the other end is returned by
+ *    serialcomm_transport_peer, for a device implemented in the same process
+ *  - "pty:" pseudo-terminal pair, with the device simulator of
+ *    libserialcomm_sim.h running in a thread on the master side
+ *  - "replay:<file>[@<speed>]" playback of a recorded session (see
+ *    libserialcomm_replay.h)
+ *  - "unix:<socket>" connection shared by a daemon (see libserialcomm_daemon.h)
+ *
+ * A port name without a known prefix uses the default transport: wiringPi when
+ * available, termios otherwise.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "libserialcomm.h"
+
+/** \brief Operations of a transport */
+struct SerialCommTransport {
+  const char * name; /**< Name of the transport, also the port name prefix before ':' */
+  /** \brief Opens the transport on path (the port name without prefix)
+   * \return the file descriptor, non blocking, or -1 on error. Private state goes in sc->transport_data */
+  int (*open)(SerialComm * sc, const char * path);
+  /** \brief Discards the data received and not yet read */
+  void (*flush)(SerialComm * sc);
+  /** \brief Reads the available bytes, without blocking after a poll() */
+  ssize_t (*read)(SerialComm * sc, void * b, size_t len);
+  /** \brief Writes a vector of buffers, may return a partial write */
+  ssize_t (*writev)(SerialComm * sc, const struct iovec * iov, int iovcnt);
+  /** \brief Closes the descriptor and releases the transport state */
+  void (*close)(SerialComm * sc);
+};
+
+extern const SerialCommTransport serialcomm_transport_termios;
+extern const SerialCommTransport serialcomm_transport_loopback;
+extern const SerialCommTransport serialcomm_transport_pty;
+extern const SerialCommTransport serialcomm_transport_replay;
+extern const SerialCommTransport serialcomm_transport_unix;
+#ifdef SERIALCOMM_WIRINGPI
+extern const SerialCommTransport serialcomm_transport_wiringpi;
+#endif
+
+/** \brief Selects the transport for a port name
+ *
+ * \param port the port name
+ * \param path receives the part of the port name to pass to the open operation
+ * \return the transport (never NULL, the default one if the prefix is unknown)
+ */
+extern const SerialCommTransport * serialcomm_transport_find(const char * port, const char ** path);
+/** \brief Device end of a loopback transport
+ *
+ * \param sc a pointer to the communication structure
+ * \return the descriptor of the other end of the socket pair, or -1 if the
+ *         transport is not a loopback
+ */
+extern int serialcomm_transport_peer(SerialComm * sc);
+
+/** \brief Descriptor based operations, shared by the transports */
+extern ssize_t serialcomm_fd_read(SerialComm * sc, void * b, size_t len);
+extern ssize_t serialcomm_fd_writev(SerialComm * sc, const struct iovec * iov, int iovcnt);
+extern void serialcomm_fd_flush(SerialComm * sc);
+extern void serialcomm_fd_close(SerialComm * sc);
+/** \brief Sets O_NONBLOCK on a descriptor, as the transports return it
+ * \return 0 on success, -1 on error */
+extern int serialcomm_fd_nonblock(int fd);
+/** \brief Configures a terminal descriptor in raw 8N1 mode
+ *
+ * VMIN and VTIME are 0: the listener reads after poll(), and a read must return
+ * what is available without waiting for more bytes.
+ * \param fd the terminal descriptor
+ * \param opt line speed, NULL for SERIALCOMM_BAUD
+ * \return 0 on success, -1 on error (also for an unsupported line speed)
+ */
+extern int serialcomm_termios_setup(int fd, const SerialCommOptions * opt);
+
+#endif /* LIBSERIALCOMM_TRANSPORT_H_ */
@@ -4,25 +4,28 @@
 
 
 void print_structure(void * sc) {
-  printf("STRUCTURE\n");
-  printf("     t_meas = %3.3f\n", serialcomm_get_t_meas(sc));
-  printf("     p_meas = %3.3f\n", serialcomm_get_p_meas(sc));
-  printf("     q_meas = %3.3f\n", serialcomm_get_q_meas(sc));
-  printf("         kp = %3.3f\n", serialcomm_get_kp(sc));
-  printf("         ki = %3.3f\n", serialcomm_get_ki(sc));
-  printf("      t_set = %3.3f\n", serialcomm_get_t_set(sc));
-  printf("      p_set = %3.3f\n", serialcomm_get_p_set(sc));
-  printf("     u_pres = %3.3f\n", serialcomm_get_u_pres(sc));
-  printf("     period = %3.3f\n", serialcomm_get_period(sc));
-  printf(" duty_cycle = %3.3f\n", serialcomm_get_duty_cycle(sc));
-  printf("      cycle = %f\n", serialcomm_get_cycle(sc));
-  printf("  max_cycle = %f\n", serialcomm_get_cycle_max(sc));
+  output_s out;
+  unsigned long frame = serialcomm_get_snapshot(sc, &out);
+
+  printf("STRUCTURE (frame %lu)\n", frame);
+  printf("     t_meas = %3.3f\n", out.t_meas);
+  printf("     p_meas = %3.3f\n", out.p_meas);
+  printf("     q_meas = %3.3f\n", out.q_meas);
+  printf("         kp = %3.3f\n", out.kp);
+  printf("         ki = %3.3f\n", out.ki);
+  printf("      t_set = %3.3f\n", out.t_set);
+  printf("      p_set = %3.3f\n", out.p_set);
+  printf("     u_pres = %3.3f\n", out.u_pres);
+  printf("     period = %3.3f\n", out.period);
+  printf(" duty_cycle = %3.3f\n", out.duty_cycle);
+  printf("      cycle = %f\n", out.cycle);
+  printf("  max_cycle = %f\n", out.max_cycle);
   printf("Config:\n");
-  printf(" - Chiller is %s\n", (serialcomm_get_chiller_config(sc) ? "on" : "off"));
-  printf(" - Resistance is %s\n", (serialcomm_get_actuator_config(sc) ? "on" : "off"));
-  printf(" - Actuator is %s\n", (serialcomm_get_actuator_config(sc) ? "on" : "off"));
-  printf("State: %s\n", serialcomm_get_state_string(sc));
-  printf("Error: %s\n", serialcomm_get_error_string(sc));
+  printf(" - Chiller is %s\n", ((out.config & CtrlEnChiller) ? "on" : "off"));
+  printf(" - Resistance is %s\n", ((out.config & CtrlEnResistance) ? "on" : "off"));
+  printf(" - Actuator is %s\n", ((out.config & CtrlEnPActuator) ? "on" : "off"));
+  printf("State: %s\n", serialcomm_state_string(out.state));
+  printf("Error: %s\n", serialcomm_error_string(out.error));
 }
 
 int main(int argc, char const *argv[]) {
@@ -35,6 +38,10 @@ int main(int argc, char const *argv[]) {
   void *sc;
 
   sc = serialcomm_initialize(serial_port);
+  if (!sc) {
+    printf("Cannot connect to %s (error %d)\n", serial_port, serialcomm_check_errors());
+    return -1;
+  }
 
   printf("Opened serial port\n"); 
 
@@ -46,10 +53,11 @@ int main(int argc, char const *argv[]) {
   serialcomm_set_pressure_auto(sc);
   serialcomm_toggle_chiller(sc);
   
-  serialcomm_update(sc);
-  sleep(2);
+  if (serialcomm_update_wait(sc, 2000) < 0)
+    printf("No answer from the remote device\n");
 
   print_structure(sc);
+  printf("Listener CPU time: %.6f s\n", serialcomm_get_listener_cpu_time(sc));
 
   serialcomm_destroy(sc);
   return 0;
@@ -53,9 +53,9 @@ sc.play
 
 begin
   while (1)
-    sc.update
-    puts "#{sc.cycle}, #{sc.p_actuator_meas}, #{sc.p_accumulator_meas}, #{sc.t_meas}"
-    sleep 0.1 
+    s = sc.update_snapshot
+    next unless s
+    puts "#{s.cycle}, #{s.p_meas}, #{s.q_meas}, #{s.t_meas}"
   end
 ensure
   sc.close
@@ -36,6 +36,8 @@
 #define FORCE_PACKED __attribute__((packed))
 #endif
 
+#include <stdint.h>
+
 #define SIGNATURE_MESSAGE 0x63
 
 /** Input Message Protocol */
@@ -73,6 +75,104 @@ typedef struct FORCE_PACKED output_s {
 #define output_size (sizeof(output_s) - sizeof(char))
 #define output_buffer_size sizeof(output_s)
 
+/** Framed Protocol (version 2)
+ *
+ * Each frame is a frame_header_s, followed by length bytes of payload and by the
+ * CRC-16 of header and payload, least significant byte first. The CRC is the
+ * CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF, not reflected.
+ *
+ * The host asks for the framed protocol with the legacy command
+ * cmdProtocolVersion (value FRAME_VERSION). From then on the firmware sends
+ * framed output frames, and it accepts both framed and legacy commands (a
+ * legacy command never starts with FRAME_START). A legacy firmware ignores the
+ * request and keeps sending output_s frames, thus the host detects it from the
+ * frames it receives.
+ */
+
+#define FRAME_START 0xA5
+#define FRAME_VERSION 2
+#define FRAME_CRC_POLY 0x1021
+#define FRAME_CRC_INIT 0xFFFF
+
+typedef struct FORCE_PACKED frame_header_s {
+  unsigned char start;   /**< FRAME_START */
+  unsigned char version; /**< FRAME_VERSION */
+  unsigned char type;    /**< Payload type (FrameType) */
+  unsigned char length;  /**< Payload bytes */
+} frame_header_s;
+
+typedef enum FrameType {
+  FrameOutput = 0x1,  /**< Payload: output_s, without the check byte */
+  FrameCommand = 0x2, /**< Payload: input_s, without the check byte */
+  FrameDelta = 0x3,   /**< Payload: compact output, see below */
+  FrameCommandSeq = 0x4, /**< Payload: sequenced_s, acknowledged by a FrameAck */
+  FrameAck = 0x5,     /**< Payload: ack_s */
+  FrameTypeCount
+} FrameType;
+
+/** Sequenced Commands (FrameCommandSeq, FrameAck)
+ *
+ * The firmware executes the sequenced commands in order: a command is executed
+ * only if its sequence number follows the last one executed, and it is then
+ * acknowledged with its number. A command already executed (a retransmission)
+ * is acknowledged again with the last number executed, without executing it,
+ * and a command after a gap is dropped, waiting for the missing one. The ack
+ * of a number thus confirms all the commands up to it. A new epoch (the host
+ * gave up on a lost command) restarts the sequence from its first command.
+ * The signature (SIGNATURE_MESSAGE) resets the sequence too: the first
+ * sequenced command after it is executed whatever its epoch and number. The
+ * host starts each connection with a random epoch, so a firmware that missed
+ * the signature still tells the new sequence from the previous one.
+ */
+
+typedef struct FORCE_PACKED sequenced_s {
+  unsigned char epoch; /**< Sequence epoch */
+  uint16_t seq;        /**< Sequence number */
+  char command;        /**< As in input_s */
+  float value;         /**< As in input_s */
+} sequenced_s;
+
+typedef struct FORCE_PACKED ack_s {
+  unsigned char epoch; /**< Epoch of the command acknowledged */
+  uint16_t seq;        /**< Last sequence number executed */
+} ack_s;
+
+/** Compact Telemetry (FrameDelta)
+ *
+ * Requested with cmdCompactTelemetry, only in the framed protocol. The output
+ * is sent as a delta on the previous frame: a sequence byte (increased on each
+ * delta, 1 after a FrameOutput), the mask of the changed fields (16 bits, bit i
+ * for DeltaField i) and the changed fields, in order. The measurements of
+ * DELTA_SCALED_FIELDS are int16 values of the measure times DELTA_SCALE (or
+ * DELTA_ESCAPE followed by the float, when out of range); the other floats are
+ * sent whole, the flags as a byte. Values are in the byte order of output_s.
+ * A full FrameOutput is sent every value frames of cmdCompactTelemetry, and
+ * after a lost delta (a gap in the sequence) the host waits for it.
+ */
+
+typedef enum DeltaField {
+  DeltaTMeas = 0, DeltaPMeas, DeltaQMeas, DeltaKp, DeltaKi, DeltaTSet, DeltaPSet,
+  DeltaUPres, DeltaPeriod, DeltaDutyCycle, DeltaCycle, DeltaMaxCycle,
+  DeltaConfig,    /**< First of the flags, after the 12 floats of output_s */
+  DeltaState,
+  DeltaError,
+  DeltaFieldCount
+} DeltaField;
+
+#define DELTA_SCALED_FIELDS ((1 << DeltaTMeas) | (1 << DeltaPMeas) | (1 << DeltaQMeas) | (1 << DeltaUPres))
+#define DELTA_SCALE 100.0f
+#define DELTA_ESCAPE (-32768)
+#define delta_header_size 3
+#define delta_max_size (delta_header_size + DeltaConfig * (2 + sizeof(float)) + (DeltaFieldCount - DeltaConfig))
+
+#define frame_header_size sizeof(frame_header_s)
+#define frame_crc_size 2
+#define frame_max_size (frame_header_size + 255 + frame_crc_size)
+#define frame_output_size (frame_header_size + output_size + frame_crc_size)
+#define frame_command_size (frame_header_size + input_size + frame_crc_size)
+#define frame_sequenced_size (frame_header_size + sizeof(sequenced_s) + frame_crc_size)
+#define frame_ack_size (frame_header_size + sizeof(ack_s) + frame_crc_size)
+
 typedef enum CommandCode {
   cmdHearthbeat,                  /**< Command from the screen: it is alive! */
   cmdManualTemperatureControl,    /**< Overrides (disabling) the temperature control */
@@ -99,6 +199,9 @@ typedef enum CommandCode {
   cmdSaveStorageConfig,           /**< Save current configuration in the EEPROM */
   cmdLoadStorageConfig,           /**< Load storage config from EEPROM. Extremely risky, it may be corrupted data */
   cmdLoadStorageCycle,            /**< Load current cycle number from EEPROM. Extremely Risky it may be corrupted data */
+  cmdStreamTelemetry,             /**< Sends an output frame every value milliseconds without hearthbeat, 0 stops the stream */
+  cmdProtocolVersion,             /**< Switches to the framed protocol version value (see FRAME_VERSION) */
+  cmdCompactTelemetry,            /**< Sends deltas, with a full frame every value frames, 0 sends full frames only */
   cmdCommandCodeSize              /**< This last one is a size for the array of function pointers */
 } CommandCode;
 
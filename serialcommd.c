@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include "libserialcomm_bus.h"
+#include "libserialcomm_daemon.h"
+
+/* Shares one serial connection among the local clients, that open it as
+ * "unix:<socket>" (see libserialcomm_daemon.h). */
+
+void serialcommd_err(SerialCommErr err, SerialComm *sc) {
+  if (err != SerialCommErrNoErr)
+    fprintf(stderr, "serialcommd: error %d on %s\n", (int)err, sc->port);
+}
+
+int main(int argc, char const *argv[]) {
+  // -b also publishes the frames on the shared memory bus (see libserialcomm_bus.h),
+  // -f requests the framed protocol, for a device that supports it
+  int bus = 0;
+  SerialCommOptions opt;
+  memset(&opt, 0, sizeof(opt));
+  for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+    if (strcmp(argv[1], "-b") == 0)
+      bus = 1;
+    else if (strcmp(argv[1], "-f") == 0)
+      opt.protocol = SerialCommProtocolNegotiate;
+    else
+      break;
+  }
+  if (argc != 3) {
+    printf("Run with the arguments [-b] [-f] <port> <socket>\n");
+    return -1;
+  }
+
+  // The signals are waited by the main thread only, the other threads inherit the mask
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  SerialComm *sc = serialcomm_open_ex(argv[1], &opt, serialcommd_err);
+  if (!sc)
+    return -1;
+  serialcomm_sync(sc);
+  serialcomm_start_listener(sc);
+  if (!sc->listener_running || serialcomm_handshake(sc, SERIALCOMM_CONNECT_TIMEOUT_MS) < 0) {
+    fprintf(stderr, "serialcommd: no answer from %s\n", argv[1]);
+    serialcomm_close(sc);
+    return -1;
+  }
+  if (bus && serialcomm_bus_start(sc) < 0) {
+    serialcomm_close(sc);
+    return -1;
+  }
+
+  SerialCommDaemon *d = serialcomm_daemon_start(sc, argv[2]);
+  if (!d) {
+    perror("serialcommd: cannot serve the socket");
+    serialcomm_close(sc);
+    return -1;
+  }
+  printf("Serving %s on %s\n", argv[1], argv[2]);
+  char port[SERIALCOMM_BUS_NAME_SIZE];
+  if (bus && serialcomm_bus_port(sc, port, sizeof(port)) == 0)
+    printf("Publishing on the bus of %s\n", port);
+  fflush(stdout);
+
+  int sig;
+  sigwait(&signals, &sig);
+
+  unsigned long dropped = serialcomm_daemon_dropped(d);
+  serialcomm_daemon_stop(d);
+  serialcomm_close(sc);
+  printf("Stopped, %lu frames dropped for slow clients\n", dropped);
+  return 0;
+}
@@ -0,0 +1,91 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include "libserialcomm_sim.h"
+#include "libserialcomm_transport.h"
+
+static int wakeup = -1;
+
+/* Tells if path is a link to the pseudo-terminal target, or to any one if target is NULL */
+int pty_link(const char *path, const char *target) {
+  struct stat st;
+  char dest[128];
+  if (lstat(path, &st) < 0 || !S_ISLNK(st.st_mode))
+    return 0;
+  ssize_t n = readlink(path, dest, sizeof(dest) - 1);
+  if (n < 0)
+    return 0;
+  dest[n] = '\0';
+  return target ? strcmp(dest, target) == 0 : strncmp(dest, "/dev/pts/", 9) == 0;
+}
+
+void stop(int sig) {
+  uint64_t one = 1;
+  if (write(wakeup, &one, sizeof(one)) < 0)
+    _exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+  // -l emulates a legacy firmware, that does not support the framed protocol
+  int legacy = (argc > 1 && strcmp(argv[1], "-l") == 0);
+  if (legacy) {
+    argc--;
+    argv++;
+  }
+  if (argc > 2) {
+    printf("Run with the optional arguments [-l] [link to the simulated port]\n");
+    return -1;
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  char name[128];
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0 ||
+      ptsname_r(master, name, sizeof(name)) != 0) {
+    perror("Cannot create the pseudo-terminal");
+    return -1;
+  }
+
+  // The slave end is kept open, so the hosts can close and open it again
+  int slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (slave < 0 || serialcomm_termios_setup(slave, NULL) < 0) {
+    perror("Cannot configure the pseudo-terminal");
+    return -1;
+  }
+  if (argc == 2) {
+    // Only the link left by a previous simulator is replaced, any other file is kept
+    struct stat st;
+    if (lstat(argv[1], &st) == 0) {
+      if (!pty_link(argv[1], NULL)) {
+        fprintf(stderr, "Cannot create the link: %s exists and is not a link to a pseudo-terminal\n", argv[1]);
+        return -1;
+      }
+      unlink(argv[1]);
+    }
+    if (symlink(name, argv[1]) < 0) {
+      perror("Cannot create the link");
+      return -1;
+    }
+  }
+
+  wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  printf("Simulated port: %s\n", (argc == 2 ? argv[1] : name));
+  fflush(stdout);
+
+  SerialCommSim sim;
+  serialcomm_sim_init(&sim);
+  if (legacy)
+    sim.max_version = 1;
+  int ret = serialcomm_sim_serve(&sim, master, wakeup);
+
+  if (argc == 2 && pty_link(argv[1], name))
+    unlink(argv[1]);
+  close(slave);
+  close(master);
+  close(wakeup);
+  return ret;
+}
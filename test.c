@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "libserialcomm_archive.h"
+#include "libserialcomm_crc.h"
+#include "libserialcomm_interface.h"
+#include "libserialcomm_manager.h"
+#include "libserialcomm_transport.h"
+
+/* Checks of the protocol and of the archive, run by make test. Each test prints its name and the
+ * failed checks, and the exit status is not zero if any check failed. */
+
+static int test_failed;
+
+#define TEST_CHECK(cond)                                             \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      printf("    %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      test_failed++;                                                 \
+    }                                                                \
+  } while (0)
+
+void test_err(SerialCommErr err, SerialComm *sc) {}
+
+/* Waits until the listener has received n frames, or no frame arrives for a second */
+unsigned long test_wait_frames(SerialComm *sc, unsigned long n) {
+  unsigned long last = serialcomm_frame_number(sc);
+  while (last < n) {
+    unsigned long next = serialcomm_wait_frame(sc, last, 1000);
+    if (next == 0)
+      break;
+    last = next;
+  }
+  return last;
+}
+
+/* The check value of the CRC-16/CCITT-FALSE catalogue */
+void test_crc(void) {
+  printf("crc\n");
+  serialcomm_crc_init();
+  TEST_CHECK(serialcomm_crc16(FRAME_CRC_INIT, "123456789", 9) == 0x29B1);
+  // The slicing must not depend on the split of the input
+  uint16_t crc = serialcomm_crc16(FRAME_CRC_INIT, "12345", 5);
+  TEST_CHECK(serialcomm_crc16(crc, "6789", 4) == 0x29B1);
+  TEST_CHECK(serialcomm_crc16(FRAME_CRC_INIT, "", 0) == FRAME_CRC_INIT);
+}
+
+/* Writes a framed output frame with the cycle number i in f, returning its length */
+size_t test_frame(unsigned char *f, unsigned int i) {
+  output_u out;
+  memset(&out, 0, sizeof(out));
+  out.s.cycle = (float)i;
+  out.s.t_meas = 20.0f + (float)(i % 100);
+  memcpy(f + frame_header_size, out.b, output_size);
+  return serialcomm_frame_seal((char *)f, FrameOutput, output_size);
+}
+
+/* Frames with a byte dropped are discarded, and every intact frame after them is received */
+void test_resync(void) {
+  printf("resync\n");
+  const unsigned int frames = 2000;
+  SerialCommOptions opt;
+  memset(&opt, 0, sizeof(opt));
+  opt.protocol = SerialCommProtocolFramed;
+  SerialComm *sc = serialcomm_open_ex("loopback:", &opt, test_err);
+  TEST_CHECK(sc != NULL);
+  if (!sc)
+    return;
+  int fd = serialcomm_transport_peer(sc);
+  serialcomm_sync(sc);
+  serialcomm_start_listener(sc);
+
+  unsigned char *stream = (unsigned char *)malloc(frames * frame_max_size + frame_max_size);
+  size_t len = 0;
+  unsigned int damaged = 0, last_intact = 0;
+  unsigned int seed = 1;
+  for (unsigned int i = 0; i < frames; i++) {
+    size_t n = test_frame(stream + len, i);
+    if (rand_r(&seed) % 10 == 0) {
+      size_t drop = (size_t)rand_r(&seed) % n;
+      memmove(stream + len + drop, stream + len + drop + 1, n - drop - 1);
+      n--;
+      damaged++;
+    } else {
+      last_intact = i;
+    }
+    len += n;
+  }
+  // A start byte inside a damaged frame may announce a frame longer than the rest of the stream
+  memset(stream + len, 0, frame_max_size);
+  len += frame_max_size;
+
+  for (size_t done = 0; done < len;) {
+    ssize_t n = write(fd, stream + done, len - done);
+    if (n <= 0)
+      break;
+    done += (size_t)n;
+  }
+  free(stream);
+
+  unsigned long received = test_wait_frames(sc, frames - damaged);
+  SerialCommStats stats;
+  serialcomm_get_stats(sc, &stats);
+  TEST_CHECK(received == frames - damaged);
+  // The damaged frames and the padding are discarded, not a byte more
+  size_t frame_len = frame_header_size + output_size + frame_crc_size;
+  TEST_CHECK(stats.discarded == damaged * (frame_len - 1) + frame_max_size);
+  TEST_CHECK(stats.frames_bad > 0);
+  TEST_CHECK(stats.resyncs > 0);
+  output_s last;
+  serialcomm_read_output(sc, &last);
+  TEST_CHECK(last.cycle == (float)last_intact);
+  serialcomm_close(sc);
+}
+
+/* Sequenced commands are executed once and in order, on two connections in a row */
+void test_ack(void) {
+  printf("ack\n");
+  SerialCommOptions opt;
+  memset(&opt, 0, sizeof(opt));
+  opt.protocol = SerialCommProtocolNegotiate;
+  for (int run = 0; run < 2; run++) {
+    SerialComm *sc = serialcomm_open_ex("pty:", &opt, test_err);
+    TEST_CHECK(sc != NULL);
+    if (!sc)
+      return;
+    serialcomm_sync(sc);
+    serialcomm_start_listener(sc);
+    TEST_CHECK(serialcomm_handshake(sc, SERIALCOMM_CONNECT_TIMEOUT_MS) == 0);
+    TEST_CHECK(serialcomm_protocol(sc) == SerialCommProtocolFramed);
+    long seq = -1;
+    for (int i = 1; i <= 20; i++)
+      seq = serialcomm_send_acked(sc, cmdSetPIProportionalGain, (float)i);
+    TEST_CHECK(seq >= 0);
+    TEST_CHECK(serialcomm_wait_ack(sc, (unsigned int)seq, 1000, NULL) == 0);
+
+    // The answers to the hearthbeats of the handshake may still be on their way
+    output_s out;
+    memset(&out, 0, sizeof(out));
+    for (int i = 0; i < 10 && out.kp != 20.0f; i++) {
+      unsigned long last = serialcomm_frame_number(sc);
+      serialcomm_send(sc, cmdHearthbeat, 0.0f);
+      serialcomm_wait_frame(sc, last, 100);
+      serialcomm_read_output(sc, &out);
+    }
+    TEST_CHECK(out.kp == 20.0f);
+    serialcomm_close(sc);
+  }
+}
+
+/* A device whose output buffer is full does not hold the other devices of its I/O thread */
+void test_manager(void) {
+  printf("manager\n");
+  SerialCommOptions opt;
+  memset(&opt, 0, sizeof(opt));
+  opt.protocol = SerialCommProtocolFramed;
+  SerialCommManager *mgr = serialcomm_manager_create(1);
+  SerialComm *stalled = serialcomm_open_ex("loopback:", &opt, test_err);
+  SerialComm *sc = serialcomm_open_ex("loopback:", &opt, test_err);
+  TEST_CHECK(mgr && stalled && sc);
+  if (!mgr || !stalled || !sc)
+    return;
+  // The peer of the stalled device never reads, its output buffer is soon full
+  int size = 4096;
+  setsockopt(stalled->serial, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  int fd = serialcomm_transport_peer(sc);
+  serialcomm_sync(stalled);
+  serialcomm_sync(sc);
+  TEST_CHECK(serialcomm_manager_attach(mgr, stalled, 1) == 0);
+  TEST_CHECK(serialcomm_manager_attach(mgr, sc, 2) == 0);
+
+  unsigned char f[frame_max_size];
+  int late = 0;
+  for (unsigned int i = 0; i < 20; i++) {
+    for (int k = 0; k < SERIALCOMM_TX_QUEUE_SIZE; k++)
+      serialcomm_send(stalled, cmdHearthbeat, 0.0f);
+    unsigned long last = serialcomm_frame_number(sc);
+    size_t n = test_frame(f, i);
+    TEST_CHECK(write(fd, f, n) == (ssize_t)n);
+    if (serialcomm_wait_frame(sc, last, SERIALCOMM_TX_STALL_MS / 5) == 0)
+      late++;
+  }
+  TEST_CHECK(late == 0);
+  SerialCommStats stats;
+  serialcomm_get_stats(stalled, &stats);
+  TEST_CHECK(stats.commands_dropped > 0);
+
+  TEST_CHECK(serialcomm_manager_detach(mgr, stalled) == 0);
+  TEST_CHECK(serialcomm_manager_detach(mgr, sc) == 0);
+  serialcomm_close(stalled);
+  serialcomm_close(sc);
+  serialcomm_manager_destroy(mgr);
+}
+
+/* Fills n records whose fields stress the encoders of the archive: gaps in the
+ * frame numbers, times going back, NaN, -0, infinities and runs of equal values */
+void test_records(SerialCommRecord *r, size_t n) {
+  const float special[] = {NAN, -NAN, -0.0f, 0.0f, INFINITY, -INFINITY, 1e-45f, 3.4e38f};
+  unsigned int seed = 2;
+  unsigned long seq = 0;
+  uint64_t t = 1000000000ULL;
+  memset(r, 0, n * sizeof(*r));
+  for (size_t i = 0; i < n; i++) {
+    seq += (rand_r(&seed) % 50 == 0) ? 1 + (unsigned long)(rand_r(&seed) % 1000) : 1;
+    switch (rand_r(&seed) % 20) {
+    case 0: t -= (uint64_t)(rand_r(&seed) % 5000000); break; // Clock stepped back
+    case 1: t += (uint64_t)rand_r(&seed) << 20; break;      // Long pause
+    default: t += 1000000 + (uint64_t)(rand_r(&seed) % 1000); break;
+    }
+    r[i].seq = seq;
+    r[i].time_ns = t;
+    float *f = (float *)&r[i].frame;
+    for (int k = 0; k < 12; k++) {
+      unsigned int c = (unsigned int)rand_r(&seed) % 10;
+      if (i > 0 && c < 4)
+        f[k] = ((float *)&r[i - 1].frame)[k];
+      else if (c < 6)
+        f[k] = special[rand_r(&seed) % 8];
+      else
+        f[k] = (float)rand_r(&seed) / (float)RAND_MAX * 200.0f - 100.0f;
+    }
+    // The index of the chunks assumes a cycle that never decreases
+    r[i].frame.cycle = (float)(i / 10);
+    r[i].frame.config = (char)(i / 1000);
+    r[i].frame.state = (char)(rand_r(&seed) % 100 == 0 ? rand_r(&seed) : (i / 300));
+    r[i].frame.error = (char)(i % 7 == 0);
+    r[i].frame.check = serialcomm_lcr_check((char *)&r[i].frame, output_size);
+  }
+}
+
+/* Reads the whole archive at path and compares it bit by bit with the first n records of r */
+void test_archive_read(const char *path, const SerialCommRecord *r, size_t n) {
+  SerialCommArchiveReader *rd = serialcomm_archive_load(path);
+  TEST_CHECK(rd != NULL);
+  if (!rd)
+    return;
+  TEST_CHECK(serialcomm_archive_frames(rd) == n);
+  SerialCommRecord *back = (SerialCommRecord *)calloc(n + 1, sizeof(*back));
+  size_t got = 0, k;
+  while (got <= n && (k = serialcomm_archive_read(rd, back + got, n + 1 - got)) > 0)
+    got += k;
+  TEST_CHECK(got == n);
+  size_t bad = 0;
+  for (size_t i = 0; i < got && i < n; i++) {
+    if (back[i].seq != r[i].seq || back[i].time_ns != r[i].time_ns ||
+        memcmp(&back[i].frame, &r[i].frame, sizeof(output_s)) != 0)
+      bad++;
+  }
+  TEST_CHECK(bad == 0);
+  // The cycle 6000 is the 60000th frame, in the middle of a chunk
+  if (n > 60010) {
+    TEST_CHECK(serialcomm_archive_seek_cycle(rd, 6000) == 0);
+    TEST_CHECK(serialcomm_archive_read(rd, back, 1) == 1);
+    TEST_CHECK(back[0].seq == r[60000].seq);
+  }
+  free(back);
+  serialcomm_archive_unload(rd);
+}
+
+/* Adds delta to the size of a column in the header of the chunk k of the archive at path */
+void test_archive_damage(const char *path, unsigned int k, uint32_t delta) {
+  int fd = open(path, O_RDWR);
+  off_t off = SERIALCOMM_ARCHIVE_HEADER_SIZE;
+  SerialCommArchiveChunk h;
+  for (unsigned int i = 0; fd >= 0 && pread(fd, &h, sizeof(h), off) == (ssize_t)sizeof(h); i++) {
+    if (i == k) {
+      h.column[SerialCommArchiveTime] += delta;
+      TEST_CHECK(pwrite(fd, &h, sizeof(h), off) == (ssize_t)sizeof(h));
+      break;
+    }
+    off += (off_t)(sizeof(h) + h.range.bytes);
+  }
+  if (fd >= 0)
+    close(fd);
+}
+
+/* A chunk whose header is damaged is skipped (chunk 10), the other chunks are read */
+void test_archive_damaged(const char *path, uint64_t frames, const SerialCommRecord *r, size_t n) {
+  SerialCommArchiveReader *rd = serialcomm_archive_load(path);
+  TEST_CHECK(rd != NULL);
+  if (!rd)
+    return;
+  TEST_CHECK(serialcomm_archive_frames(rd) == frames);
+  SerialCommRecord *back = (SerialCommRecord *)malloc(n * sizeof(*back));
+  size_t got = 0, k;
+  while (got < n && (k = serialcomm_archive_read(rd, back + got, n - got)) > 0)
+    got += k;
+  size_t before = 10 * SERIALCOMM_ARCHIVE_CHUNK;
+  TEST_CHECK(got == (frames > before ? frames - SERIALCOMM_ARCHIVE_CHUNK : before));
+  TEST_CHECK(memcmp(&back[before - 1].frame, &r[before - 1].frame, sizeof(output_s)) == 0);
+  if (got > before)
+    TEST_CHECK(back[before].seq == r[before + SERIALCOMM_ARCHIVE_CHUNK].seq);
+  TEST_CHECK(serialcomm_archive_seek_cycle(rd, before / 10 + 1) < 0);
+  free(back);
+  serialcomm_archive_unload(rd);
+}
+
+/* The archive gives back the frames as written, and a file without its trailer
+ * (writer killed) is read up to its last complete chunk */
+void test_archive(void) {
+  printf("archive\n");
+  const size_t n = 30 * SERIALCOMM_ARCHIVE_CHUNK + 100;
+  SerialCommRecord *r = (SerialCommRecord *)malloc(n * sizeof(*r));
+  test_records(r, n);
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/serialcomm_test.%d.sarc", (int)getpid());
+
+  SerialCommArchive *ar = serialcomm_archive_create(path);
+  TEST_CHECK(ar != NULL);
+  if (!ar) {
+    free(r);
+    return;
+  }
+  uint64_t complete = 0, bytes;
+  for (size_t i = 0; i < n; i++) {
+    TEST_CHECK(serialcomm_archive_append(ar, &r[i]) == 0);
+    if (i + 1 == n - 100)
+      serialcomm_archive_count(ar, &complete);
+  }
+  TEST_CHECK(serialcomm_archive_count(ar, &bytes) == n);
+  TEST_CHECK(serialcomm_archive_close(ar) == 0);
+  test_archive_read(path, r, n);
+  // The size of a column out of the chunk: the index of the trailer still counts all the frames
+  test_archive_damage(path, 10, 0x40000000u);
+  test_archive_damaged(path, n, r, n);
+  test_archive_damage(path, 10, (uint32_t)-0x40000000);
+
+  // Cut the file in the middle of the last chunk, the index and trailer go with it
+  TEST_CHECK(truncate(path, (off_t)complete + 100) == 0);
+  test_archive_read(path, r, n - 100);
+  // Without the trailer the chunks are indexed up to the damaged one
+  test_archive_damage(path, 10, 0x40000000u);
+  test_archive_damaged(path, 10 * SERIALCOMM_ARCHIVE_CHUNK, r, n);
+  unlink(path);
+  free(r);
+}
+
+int main(int argc, char *argv[]) {
+  test_crc();
+  test_resync();
+  test_ack();
+  test_manager();
+  test_archive();
+  printf(test_failed ? "%d checks failed\n" : "All the checks passed\n", test_failed);
+  return test_failed ? 1 : 0;
+}